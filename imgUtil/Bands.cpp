@@ -0,0 +1,100 @@
+/**
+ * @file Bands.cpp
+ * Implementation of forEachBand.
+ */
+
+#include "Bands.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace imgUtil {
+  /**
+   * Band threads running now, across every caller in the process.
+   */
+  static std::atomic<unsigned int> bandThreads(0);
+
+  /**
+   * Takes up to wanted of the band threads the process may still start:
+   * one fewer than its cores, the callers themselves being busy too.
+   * @return how many were taken, to be handed back once they are joined.
+   */
+  static unsigned int claimThreads(unsigned int wanted) {
+    unsigned int limit = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    unsigned int running = bandThreads.load();
+    unsigned int taken;
+    do {
+      taken = running < limit ? std::min(wanted, limit - running) : 0;
+    } while (taken > 0 && !bandThreads.compare_exchange_weak(running, running + taken));
+    return taken;
+  }
+
+  namespace {
+    // joins the band threads however forEachBand is left, since destroying
+    // a thread that is still joinable ends the process
+    struct Joiner {
+      std::vector<std::thread> threads;
+      unsigned int claimed;
+
+      ~Joiner() {
+        for (std::thread & t : threads) {
+          t.join();
+        }
+        bandThreads -= claimed;
+      }
+    };
+  }
+
+  void forEachBand(unsigned int rows, unsigned int bands,
+                   std::function<void(unsigned int, unsigned int, unsigned int)> const & body) {
+    if (rows == 0) {
+      return;
+    }
+    bands = std::max(1u, std::min(bands, rows));
+    unsigned int height = (rows + bands - 1) / bands;
+    bands = (rows + height - 1) / height;
+
+    // an exception thrown on a band thread would end the process, so it
+    // is kept for the caller instead
+    std::vector<std::exception_ptr> failed(bands);
+    auto run = [&](unsigned int band) {
+      try {
+        body(band, band * height, std::min(rows, (band + 1) * height));
+      } catch (...) {
+        failed[band] = std::current_exception();
+      }
+    };
+
+    std::vector<unsigned int> left(1, 0); // bands the caller runs
+    {
+      Joiner joiner;
+      joiner.claimed = claimThreads(bands - 1);
+      joiner.threads.reserve(joiner.claimed);
+      for (unsigned int band = 1; band < bands; band++) {
+        bool started = false;
+        if (joiner.threads.size() < joiner.claimed) {
+          try {
+            joiner.threads.emplace_back(run, band);
+            started = true;
+          } catch (const std::exception &) {
+            // out of threads, most likely; the caller does this band
+          }
+        }
+        if (!started) {
+          left.push_back(band);
+        }
+      }
+      for (unsigned int band : left) {
+        run(band);
+      }
+    }
+
+    for (std::exception_ptr const & e : failed) {
+      if (e) {
+        std::rethrow_exception(e);
+      }
+    }
+  }
+}
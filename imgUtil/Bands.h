@@ -0,0 +1,34 @@
+/**
+ * @file Bands.h
+ * Running work over horizontal bands of an image on several threads.
+ */
+
+#ifndef CS221_BANDS_H_
+#define CS221_BANDS_H_
+
+#include <functional>
+
+namespace imgUtil {
+  /**
+    * Splits rows [0, rows) into bands of even height and runs
+    * body(band, top, bottom) once for each, band counting from 0.
+    *
+    * The calling thread runs the first band itself. Threads are started
+    * for the others only while the band threads running across the
+    * process number fewer than its cores, so many callers at once do
+    * not each start a thread per core; a band that gets no thread, or
+    * whose thread cannot be started, is run by the caller afterwards.
+    * Every thread started is joined before this returns, even when body
+    * throws; the first exception is then passed on.
+    *
+    * @param rows Number of rows to cover.
+    * @param bands Number of bands wanted; at least 1 and at most rows are
+    *              used.
+    * @param body The work for one band: the band's number, its first row,
+    *             and the row past its last.
+    */
+  void forEachBand(unsigned int rows, unsigned int bands,
+                   std::function<void(unsigned int, unsigned int, unsigned int)> const & body);
+}
+
+#endif
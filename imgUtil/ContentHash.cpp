@@ -0,0 +1,192 @@
+/**
+ * @file ContentHash.cpp
+ * Implementation of the ContentHasher class.
+ */
+
+#include <cstring>
+#include "ContentHash.h"
+
+namespace imgUtil {
+  // the xxHash64 primes
+  static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+  static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+  static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+  static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+  static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+  static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static inline uint64_t mixRound(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    lane = rotl(lane, 31);
+    return lane * PRIME1;
+  }
+
+  static inline uint64_t merge(uint64_t h, uint64_t lane) {
+    h ^= mixRound(0, lane);
+    return h * PRIME1 + PRIME4;
+  }
+
+  static inline uint64_t colorWord(unsigned char r, unsigned char g, unsigned char b) {
+    return (uint64_t) r | ((uint64_t) g << 8) | ((uint64_t) b << 16);
+  }
+
+  static inline uint64_t alphaWord(double a) {
+    a += 0.0; // -0 and 0 are the same alpha
+    uint64_t bits;
+    std::memcpy(&bits, &a, sizeof(bits));
+    return bits;
+  }
+
+  ContentHasher::ContentHasher(uint64_t seed) {
+    reset(seed);
+  }
+
+  void ContentHasher::reset(uint64_t seed) {
+    lanes_[0] = seed + PRIME1 + PRIME2;
+    lanes_[1] = seed + PRIME2;
+    lanes_[2] = seed;
+    lanes_[3] = seed - PRIME1;
+    pending_[0] = pending_[1] = 0;
+    hasPending_ = false;
+    pixels_ = 0;
+    seed_ = seed;
+  }
+
+  void ContentHasher::_addPixel(uint64_t color, uint64_t alpha) {
+    if (!hasPending_) {
+      pending_[0] = color;
+      pending_[1] = alpha;
+      hasPending_ = true;
+      return;
+    }
+
+    lanes_[0] = mixRound(lanes_[0], pending_[0]);
+    lanes_[1] = mixRound(lanes_[1], pending_[1]);
+    lanes_[2] = mixRound(lanes_[2], color);
+    lanes_[3] = mixRound(lanes_[3], alpha);
+    hasPending_ = false;
+  }
+
+  void ContentHasher::add(RGBAPixel const * pixels, std::size_t count) {
+    if (count == 0) {
+      return;
+    }
+
+    pixels_ += count;
+    if (hasPending_) {
+      _addPixel(colorWord(pixels->r, pixels->g, pixels->b), alphaWord(pixels->a));
+      pixels++;
+      count--;
+    }
+
+    // two pixels per step, one word per lane
+    uint64_t l0 = lanes_[0], l1 = lanes_[1], l2 = lanes_[2], l3 = lanes_[3];
+    std::size_t i = 0;
+    for (; i + 1 < count; i += 2) {
+      l0 = mixRound(l0, colorWord(pixels[i].r, pixels[i].g, pixels[i].b));
+      l1 = mixRound(l1, alphaWord(pixels[i].a));
+      l2 = mixRound(l2, colorWord(pixels[i + 1].r, pixels[i + 1].g, pixels[i + 1].b));
+      l3 = mixRound(l3, alphaWord(pixels[i + 1].a));
+    }
+    lanes_[0] = l0; lanes_[1] = l1; lanes_[2] = l2; lanes_[3] = l3;
+
+    if (i < count) {
+      _addPixel(colorWord(pixels[i].r, pixels[i].g, pixels[i].b), alphaWord(pixels[i].a));
+    }
+  }
+
+  void ContentHasher::addRow(ImageView const & view, unsigned int y) {
+    if (view.format() == PIXEL_FORMAT_RGBAPIXEL) {
+      add(view.row(y), view.width());
+      return;
+    }
+
+    unsigned char const * bytes = view.rowBytes(y);
+    pixels_ += view.width();
+    for (unsigned int x = 0; x < view.width(); x++, bytes += 4) {
+      // the same alpha as PNG::readFromFile gives, so both formats agree
+      _addPixel(colorWord(bytes[0], bytes[1], bytes[2]), alphaWord(bytes[3] / 255.));
+    }
+  }
+
+  void ContentHasher::add(ImageView const & view) {
+    for (unsigned int y = 0; y < view.height(); y++) {
+      addRow(view, y);
+    }
+  }
+
+  uint64_t ContentHasher::_finish(uint64_t h) const {
+    h += pixels_ * 16;
+    if (hasPending_) {
+      for (uint64_t word : pending_) {
+        h ^= mixRound(0, word);
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+      }
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  uint64_t ContentHasher::digest() const {
+    uint64_t h = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) + rotl(lanes_[3], 18);
+    for (uint64_t lane : lanes_) {
+      h = merge(h, lane);
+    }
+    return _finish(h);
+  }
+
+  Hash128 ContentHasher::digest128() const {
+    Hash128 result;
+    result.low = digest();
+
+    // the same lanes combined in a different order and with different
+    // rotations, so the two halves are independent
+    uint64_t h = rotl(lanes_[3], 1) + rotl(lanes_[2], 7) + rotl(lanes_[1], 12) + rotl(lanes_[0], 18) + (seed_ ^ PRIME5);
+    for (int i = 3; i >= 0; i--) {
+      h = merge(h, lanes_[i] ^ PRIME3);
+    }
+    result.high = _finish(h);
+    return result;
+  }
+
+  static uint64_t imageSeed(ImageView const & view) {
+    return ((uint64_t) view.width() << 32) | view.height();
+  }
+
+  uint64_t contentHash(ImageView const & view) {
+    ContentHasher hasher(imageSeed(view));
+    hasher.add(view);
+    return hasher.digest();
+  }
+
+  Hash128 contentHash128(ImageView const & view) {
+    ContentHasher hasher(imageSeed(view));
+    hasher.add(view);
+    return hasher.digest128();
+  }
+
+  Hash128 bytesHash128(unsigned char const * bytes, std::size_t size) {
+    // read the bytes as one row of RGBA8 pixels, padding the last one;
+    // the size in the seed tells the padding apart from real zeros
+    ContentHasher hasher(~(uint64_t) size);
+    hasher.add(ImageView(const_cast<unsigned char *>(bytes), size / 4, 1, size));
+
+    std::size_t tail = size % 4;
+    if (tail > 0) {
+      unsigned char last[4] = { 0, 0, 0, 0 };
+      for (std::size_t i = 0; i < tail; i++) {
+        last[i] = bytes[size - tail + i];
+      }
+      hasher.add(ImageView(last, 1, 1, 4));
+    }
+    return hasher.digest128();
+  }
+}
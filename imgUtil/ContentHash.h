@@ -0,0 +1,107 @@
+/**
+ * @file ContentHash.h
+ * A fast 64- and 128-bit hash of pixel contents, fed row by row, for
+ * use as a cache key for images and the trees built from them.
+ */
+
+#ifndef CS221_CONTENTHASH_H_
+#define CS221_CONTENTHASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "ImageView.h"
+#include "RGBAPixel.h"
+
+namespace imgUtil {
+  /**
+   * A 128-bit hash value.
+   */
+  struct Hash128 {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(Hash128 const & other) const { return low == other.low && high == other.high; }
+    bool operator!=(Hash128 const & other) const { return !(*this == other); }
+  };
+
+  /**
+   * ContentHasher: an incremental hash over a stream of pixels, in the
+   * style of xxHash64. Each pixel is read as two 64-bit words, one
+   * holding its red, green and blue bytes and one holding the bits of its
+   * alpha, and two pixels at a time are mixed into four independent
+   * lanes, so the loop has no dependency between neighbouring pixels.
+   *
+   * The result only depends on the pixels' values and their order, not on
+   * how they were split between calls or on the format of the view they
+   * came from: a PNG and an RGBA8 buffer holding the same image hash the
+   * same.
+   */
+  class ContentHasher {
+  public:
+    /**
+      * Starts an empty stream.
+      * @param seed Value that different uses of the hash can use to keep
+      *             their keys apart.
+      */
+    ContentHasher(uint64_t seed = 0);
+
+    /**
+      * Empties the stream and starts again with the given seed.
+      */
+    void reset(uint64_t seed = 0);
+
+    /**
+      * Adds count pixels to the stream.
+      */
+    void add(RGBAPixel const * pixels, std::size_t count);
+
+    /**
+      * Adds row y of a view to the stream.
+      */
+    void addRow(ImageView const & view, unsigned int y);
+
+    /**
+      * Adds every row of a view to the stream, top to bottom.
+      */
+    void add(ImageView const & view);
+
+    /**
+      * Gets the 64-bit hash of the pixels added so far. More pixels may
+      * still be added afterwards.
+      */
+    uint64_t digest() const;
+
+    /**
+      * Gets the 128-bit hash of the pixels added so far; its low half is
+      * not the same as digest().
+      */
+    Hash128 digest128() const;
+
+  private:
+    uint64_t lanes_[4];             /*< Running state of the four lanes */
+    uint64_t pending_[2];           /*< Words of a pixel still waiting for its pair */
+    bool hasPending_;               /*< Whether pending_ holds a pixel */
+    uint64_t pixels_;               /*< Number of pixels added */
+    uint64_t seed_;                 /*< Seed the stream was started with */
+
+    void _addPixel(uint64_t color, uint64_t alpha);
+    uint64_t _finish(uint64_t h) const;
+  };
+
+  /**
+    * Hashes a whole image, including its dimensions, in one call.
+    */
+  uint64_t contentHash(ImageView const & view);
+
+  /**
+    * Hashes a whole image, including its dimensions, to 128 bits.
+    */
+  Hash128 contentHash128(ImageView const & view);
+
+  /**
+    * Hashes a buffer of raw bytes, such as an encoded file, to 128 bits.
+    */
+  Hash128 bytesHash128(unsigned char const * bytes, std::size_t size);
+}
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * @file ImageView.cpp
+ * Implementation of the ImageView class.
+ */
+
+#include "ImageView.h"
+
+namespace imgUtil {
+  ImageView::ImageView()
+    : data_(nullptr), width_(0), height_(0), strideBytes_(0), format_(PIXEL_FORMAT_RGBAPIXEL) { }
+
+  ImageView::ImageView(RGBAPixel * pixels, unsigned int width, unsigned int height, std::size_t strideBytes)
+    : data_(reinterpret_cast<unsigned char *>(pixels)), width_(width), height_(height), strideBytes_(strideBytes),
+      format_(PIXEL_FORMAT_RGBAPIXEL) { }
+
+  ImageView::ImageView(unsigned char * bytes, unsigned int width, unsigned int height, std::size_t strideBytes)
+    : data_(bytes), width_(width), height_(height), strideBytes_(strideBytes), format_(PIXEL_FORMAT_RGBA8) { }
+
+  void ImageView::fill(unsigned int x, unsigned int y, unsigned int count, RGBAPixel const & color) const {
+    if (format_ == PIXEL_FORMAT_RGBAPIXEL) {
+      RGBAPixel * p = row(y) + x;
+      for (unsigned int i = 0; i < count; i++) {
+        p[i] = color;
+      }
+      return;
+    }
+
+    // same conversion as PNG::writeToFile
+    unsigned char bytes[4] = { color.r, color.g, color.b, (unsigned char) (color.a * 255) };
+    unsigned char * p = rowBytes(y) + 4 * x;
+    for (unsigned int i = 0; i < count; i++) {
+      p[4 * i] = bytes[0];
+      p[4 * i + 1] = bytes[1];
+      p[4 * i + 2] = bytes[2];
+      p[4 * i + 3] = bytes[3];
+    }
+  }
+
+  bool ImageView::contains(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    // written so that none of the sums can overflow
+    return x < width_ && y < height_ && w <= width_ - x && h <= height_ - y;
+  }
+
+  ImageView ImageView::sub(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    if (!contains(x, y, w, h)) {
+      return ImageView();
+    }
+
+    ImageView view(*this);
+    view.data_ = rowBytes(y) + x * (format_ == PIXEL_FORMAT_RGBAPIXEL ? sizeof(RGBAPixel) : 4);
+    view.width_ = w;
+    view.height_ = h;
+    return view;
+  }
+}
@@ -0,0 +1,104 @@
+/**
+ * @file ImageView.h
+ * A non-owning view of an image stored somewhere else: a PNG, a
+ * caller-provided buffer, or a rectangle of either.
+ */
+
+#ifndef CS221_IMAGEVIEW_H_
+#define CS221_IMAGEVIEW_H_
+
+#include <cstddef>
+#include "RGBAPixel.h"
+
+namespace imgUtil {
+  /**
+   * Layouts an ImageView can read and write.
+   */
+  enum PixelFormat {
+    PIXEL_FORMAT_RGBAPIXEL, /**< an RGBAPixel per pixel, as stored by PNG */
+    PIXEL_FORMAT_RGBA8      /**< four bytes per pixel: red, green, blue, alpha */
+  };
+
+  class ImageView {
+  public:
+    /**
+      * Creates an empty view.
+      */
+    ImageView();
+
+    /**
+      * Creates a view of RGBAPixels.
+      * @param pixels The upper left pixel.
+      * @param width Width of the image.
+      * @param height Height of the image.
+      * @param strideBytes Distance in bytes between the starts of two rows.
+      */
+    ImageView(RGBAPixel * pixels, unsigned int width, unsigned int height, std::size_t strideBytes);
+
+    /**
+      * Creates a view of RGBA8 pixels.
+      * @param bytes The upper left pixel's red byte.
+      * @param width Width of the image.
+      * @param height Height of the image.
+      * @param strideBytes Distance in bytes between the starts of two rows.
+      */
+    ImageView(unsigned char * bytes, unsigned int width, unsigned int height, std::size_t strideBytes);
+
+    unsigned int width() const { return width_; }
+    unsigned int height() const { return height_; }
+    /**
+      * Gets the distance, in bytes, between the starts of two consecutive
+      * rows; PNG::stride() is in pixels.
+      */
+    std::size_t strideBytes() const { return strideBytes_; }
+    PixelFormat format() const { return format_; }
+
+    /**
+      * Gets a pointer to the first byte of row y. Unchecked.
+      */
+    unsigned char * rowBytes(unsigned int y) const { return data_ + y * strideBytes_; }
+
+    /**
+      * Gets a pointer to the first pixel of row y of a view of RGBAPixels.
+      * Unchecked.
+      */
+    RGBAPixel * row(unsigned int y) const { return reinterpret_cast<RGBAPixel *>(rowBytes(y)); }
+
+    /**
+      * Reads the pixel at (x, y) in either format. Unchecked.
+      */
+    RGBAPixel pixel(unsigned int x, unsigned int y) const {
+      if (format_ == PIXEL_FORMAT_RGBAPIXEL) {
+        return row(y)[x];
+      }
+      unsigned char * p = rowBytes(y) + 4 * x;
+      return RGBAPixel(p[0], p[1], p[2], p[3] / 255.);
+    }
+
+    /**
+      * Sets pixels [x, x + count) of row y to color, in either format.
+      * Unchecked.
+      */
+    void fill(unsigned int x, unsigned int y, unsigned int count, RGBAPixel const & color) const;
+
+    /**
+      * Checks whether a rectangle lies entirely inside the view.
+      */
+    bool contains(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+      * Gets a view of a rectangle of this view, sharing its pixels.
+      * @return an empty view if the rectangle is not inside this view.
+      */
+    ImageView sub(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+  private:
+    unsigned char *data_;           /*< First byte of the upper left pixel */
+    unsigned int width_;            /*< Width of the view */
+    unsigned int height_;           /*< Height of the view */
+    std::size_t strideBytes_;       /*< Bytes between the starts of two rows */
+    PixelFormat format_;            /*< Layout of each pixel */
+  };
+}
+
+#endif
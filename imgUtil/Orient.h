@@ -0,0 +1,57 @@
+/**
+ * @file Orient.h
+ * Rotating, flipping and transposing images pixel by pixel, without
+ * building a tree.
+ */
+
+#ifndef CS221_ORIENT_H_
+#define CS221_ORIENT_H_
+
+#include "ImageView.h"
+
+namespace imgUtil {
+  /**
+    * Copies src to dst with rows and columns swapped: pixel (x, y) of src
+    * becomes pixel (y, x) of dst.
+    * @param src The image to transpose.
+    * @param dst Where the result goes: src.height() wide, src.width()
+    *            high, of the same format, not overlapping src.
+    * @return false, if dst does not have the right size and format.
+    */
+  bool transpose(ImageView const & src, ImageView const & dst);
+
+  /**
+    * Copies src to dst turned a quarter turn counter-clockwise, as
+    * QTree::RotateCCW does. Same requirements as transpose.
+    */
+  bool rotate90(ImageView const & src, ImageView const & dst);
+
+  /**
+    * Copies src to dst turned a quarter turn clockwise. Same requirements
+    * as transpose.
+    */
+  bool rotate270(ImageView const & src, ImageView const & dst);
+
+  /**
+    * Transposes a square view in place.
+    * @return false, if the view is not square.
+    */
+  bool transpose(ImageView const & view);
+
+  /**
+    * Turns a view half a turn in place.
+    */
+  void rotate180(ImageView const & view);
+
+  /**
+    * Mirrors a view left to right in place.
+    */
+  void flipHorizontal(ImageView const & view);
+
+  /**
+    * Mirrors a view top to bottom in place.
+    */
+  void flipVertical(ImageView const & view);
+}
+
+#endif
@@ -12,6 +12,8 @@
 #include <cassert>
 #include "lodepng/lodepng.h"
 #include "PNG.h"
+#include "ContentHash.h"
+#include "Orient.h"
 //#include "RGB_HSL.h"
 
 namespace imgUtil {
@@ -96,9 +98,26 @@ namespace imgUtil {
     return &imageData_[index];
   }
 
+  bool PNG::contains(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    // written so that none of the sums can overflow
+    return x < width_ && y < height_ && w <= width_ - x && h <= height_ - y;
+  }
+
   bool PNG::readFromFile(string const & fileName) {
+    vector<unsigned char> file;
+    unsigned error = lodepng::load_file(file, fileName);
+
+    if (error) {
+      cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+      return false;
+    }
+
+    return readFromBuffer(file.data(), file.size());
+  }
+
+  bool PNG::readFromBuffer(unsigned char const * data, std::size_t size) {
     vector<unsigned char> byteData;
-    unsigned error = lodepng::decode(byteData, width_, height_, fileName);
+    unsigned error = lodepng::decode(byteData, width_, height_, data, size);
 
     if (error) {
       cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
@@ -170,6 +189,91 @@ namespace imgUtil {
     return (error == 0);
   }
 
+  bool PNG::writeToBuffer(vector<unsigned char> & out) const {
+    return imgUtil::writeToBuffer(*this, out);
+  }
+
+  PNG::operator ImageView() const {
+    return ImageView(imageData_, width_, height_, stride() * sizeof(RGBAPixel));
+  }
+
+  bool writeToBuffer(ImageView const & view, vector<unsigned char> & out) {
+    unsigned width = view.width();
+    unsigned height = view.height();
+    out.clear();
+
+    unsigned error;
+    if (view.format() == PIXEL_FORMAT_RGBA8 && view.strideBytes() == (std::size_t) width * 4) {
+      // already laid out as lodepng wants it
+      error = lodepng::encode(out, view.rowBytes(0), width, height);
+    } else {
+      vector<unsigned char> byteData((std::size_t) width * height * 4);
+      unsigned char * bytes = byteData.data();
+      for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++) {
+          RGBAPixel pixel = view.pixel(x, y);
+          *bytes++ = pixel.r;
+          *bytes++ = pixel.g;
+          *bytes++ = pixel.b;
+          *bytes++ = pixel.a * 255;
+        }
+      }
+      error = lodepng::encode(out, byteData, width, height);
+    }
+
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    }
+
+    return (error == 0);
+  }
+
+  bool writeToFile(ImageView const & view, string const & fileName) {
+    vector<unsigned char> encoded;
+    if (!writeToBuffer(view, encoded)) {
+      return false;
+    }
+
+    unsigned error = lodepng::save_file(encoded, fileName);
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    }
+
+    return (error == 0);
+  }
+
+  bool inspectPNG(unsigned char const * data, std::size_t size, PNGHeader & header) {
+    LodePNGState state;
+    lodepng_state_init(&state);
+    unsigned error = lodepng_inspect(&header.width, &header.height, &state, data, size);
+    LodePNGColorMode color = state.info_png.color;
+    header.bitDepth = color.bitdepth;
+    header.colorType = color.colortype;
+    header.bitsPerPixel = error ? 0 : lodepng_get_bpp(&color);
+    header.interlaced = state.info_png.interlace_method == 1;
+    lodepng_state_cleanup(&state);
+
+    if (error) {
+      cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+      return false;
+    }
+
+    // lodepng_inspect leaves the pairing of color type and bit depth to
+    // the decoder; check it here, as the decoder would
+    unsigned d = header.bitDepth;
+    switch (header.colorType) {
+      case LCT_GREY: error = (d == 1 || d == 2 || d == 4 || d == 8 || d == 16) ? 0 : 37; break;
+      case LCT_PALETTE: error = (d == 1 || d == 2 || d == 4 || d == 8) ? 0 : 37; break;
+      case LCT_RGB: case LCT_GREY_ALPHA: case LCT_RGBA: error = (d == 8 || d == 16) ? 0 : 37; break;
+      default: error = 31;
+    }
+    if (error) {
+      cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+      return false;
+    }
+    return true;
+  }
+
   unsigned int PNG::width() const {
     return width_;
   }
@@ -184,14 +288,11 @@ namespace imgUtil {
 
     // Copy the current data to the new image data, using the existing pixel
     // for coordinates within the bounds of the old image size
-    for (unsigned x = 0; x < newWidth; x++) {
-      for (unsigned y = 0; y < newHeight; y++) {
-        if (x < width_ && y < height_) {
-          RGBAPixel * oldPixel = this->getPixel(x, y);
-          RGBAPixel & newPixel = newImageData[ (x + (y * newWidth)) ];
-          newPixel = *oldPixel;
-        }
-      }
+    unsigned copyWidth = std::min(width_, newWidth);
+    unsigned copyHeight = std::min(height_, newHeight);
+    for (unsigned y = 0; y < copyHeight; y++) {
+      RGBAPixel * oldRow = row(y);
+      std::copy(oldRow, oldRow + copyWidth, newImageData + y * newWidth);
     }
 
     // Clear the existing image
@@ -203,22 +304,80 @@ namespace imgUtil {
     imageData_ = newImageData;
   }
 
-  std::size_t PNG::computeHash() const {
-    std::hash<float> hashFunction;
-    std::size_t hash = 0;
+  void PNG::resize(unsigned int newWidth, unsigned int newHeight, ResampleFilter filter) {
+    RGBAPixel * newImageData = new RGBAPixel[newWidth * newHeight];
+    ImageView newView(newImageData, newWidth, newHeight, newWidth * sizeof(RGBAPixel));
 
+    if (!Resampler(filter).resample(*this, newView)) {
+      // nothing to scale from (or to); fall back to cropping and padding
+      delete[] newImageData;
+      resize(newWidth, newHeight);
+      return;
+    }
 
-    for (unsigned x = 0; x < this->width(); x++) {
-      for (unsigned y = 0; y < this->height(); y++) {
-        RGBAPixel * pixel = this->getPixel(x, y);
-        hash = (hash << 1) + hash + hashFunction(pixel->r);
-        hash = (hash << 1) + hash + hashFunction(pixel->g);
-        hash = (hash << 1) + hash + hashFunction(pixel->b);
-        hash = (hash << 1) + hash + hashFunction(pixel->a);
-      }
+    delete[] imageData_;
+    width_ = newWidth;
+    height_ = newHeight;
+    imageData_ = newImageData;
+  }
+
+  void PNG::transpose() {
+    if (width_ == height_) {
+      imgUtil::transpose(*this);
+      return;
+    }
+
+    RGBAPixel * newImageData = new RGBAPixel[width_ * height_];
+    imgUtil::transpose(*this, ImageView(newImageData, height_, width_, height_ * sizeof(RGBAPixel)));
+    delete[] imageData_;
+    std::swap(width_, height_);
+    imageData_ = newImageData;
+  }
+
+  void PNG::rotate90() {
+    if (width_ == height_) {
+      // (x, y) -> (y, x) -> (y, w - 1 - x)
+      imgUtil::transpose(*this);
+      imgUtil::flipVertical(*this);
+      return;
     }
 
-    return hash;
+    RGBAPixel * newImageData = new RGBAPixel[width_ * height_];
+    imgUtil::rotate90(*this, ImageView(newImageData, height_, width_, height_ * sizeof(RGBAPixel)));
+    delete[] imageData_;
+    std::swap(width_, height_);
+    imageData_ = newImageData;
+  }
+
+  void PNG::rotate180() {
+    imgUtil::rotate180(*this);
+  }
+
+  void PNG::rotate270() {
+    if (width_ == height_) {
+      // (x, y) -> (y, x) -> (h - 1 - y, x)
+      imgUtil::transpose(*this);
+      imgUtil::flipHorizontal(*this);
+      return;
+    }
+
+    RGBAPixel * newImageData = new RGBAPixel[width_ * height_];
+    imgUtil::rotate270(*this, ImageView(newImageData, height_, width_, height_ * sizeof(RGBAPixel)));
+    delete[] imageData_;
+    std::swap(width_, height_);
+    imageData_ = newImageData;
+  }
+
+  void PNG::flipHorizontal() {
+    imgUtil::flipHorizontal(*this);
+  }
+
+  void PNG::flipVertical() {
+    imgUtil::flipVertical(*this);
+  }
+
+  std::size_t PNG::computeHash() const {
+    return contentHash(*this);
   }
 
   std::ostream & operator << ( std::ostream& os, PNG const& png ) {
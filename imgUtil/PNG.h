@@ -11,10 +11,30 @@
 #include <vector>
 //#include "HSLAPixel.h"
 #include "RGBAPixel.h"
+#include "ImageView.h"
+#include "Resample.h"
 
 using namespace std;
 
 namespace imgUtil {
+  /**
+   * A run of consecutive pixels, such as all or part of an image row.
+   * Does not own the pixels; usable in range-based for loops.
+   */
+  class PixelSpan {
+  public:
+    PixelSpan(RGBAPixel * first, unsigned int count) : first_(first), count_(count) { }
+
+    RGBAPixel * begin() const { return first_; }
+    RGBAPixel * end() const { return first_ + count_; }
+    unsigned int size() const { return count_; }
+    RGBAPixel & operator[](unsigned int i) const { return first_[i]; }
+
+  private:
+    RGBAPixel *first_;              /*< First pixel of the run */
+    unsigned int count_;            /*< Number of pixels in the run */
+  };
+
   class PNG {
   public:
     /**
@@ -72,6 +92,15 @@ namespace imgUtil {
       */
     bool readFromFile(string const & fileName);
 
+    /**
+      * Decodes a PNG image held in memory.
+      * Overwrites any current image content in the PNG.
+      * @param data The encoded PNG.
+      * @param size Number of bytes at data.
+      * @return true, if the image was successfully decoded and loaded.
+      */
+    bool readFromBuffer(unsigned char const * data, std::size_t size);
+
     /**
       * Writes a PNG image to a file.
       * @param fileName Name of the file to be written.
@@ -79,6 +108,19 @@ namespace imgUtil {
       */
     bool writeToFile(string const & fileName);
 
+    /**
+      * Encodes the image as a PNG into memory.
+      * @param out Buffer that receives the encoded PNG.
+      * @return true, if the image was successfully encoded.
+      */
+    bool writeToBuffer(vector<unsigned char> & out) const;
+
+    /**
+      * Gets a view of the whole image. No pixels are copied; the view is
+      * valid until the image is resized or destroyed.
+      */
+    operator ImageView() const;
+
     /**
       * Pixel access operator. Gets a pointer to the pixel at the given
       * coordinates in the image. (0,0) is the upper left corner.
@@ -89,6 +131,43 @@ namespace imgUtil {
       */
     RGBAPixel * getPixel(unsigned int x, unsigned int y) const;
 
+    /**
+      * Checks whether a rectangle lies entirely inside the image. Callers
+      * of the unchecked accessors below check their region once with this
+      * instead of having every pixel access checked.
+      * @param x X-coordinate of the upper left corner of the rectangle.
+      * @param y Y-coordinate of the upper left corner of the rectangle.
+      * @param w Width of the rectangle.
+      * @param h Height of the rectangle.
+      * @return true, if every pixel of the rectangle is in the image.
+      */
+    bool contains(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+      * Unchecked pixel access: the pixel at (x, y), which must be
+      * inside the image.
+      */
+    RGBAPixel & at(unsigned int x, unsigned int y) const { return imageData_[x + y * stride()]; }
+
+    /**
+      * Unchecked row access: a pointer to the first pixel of row y, which
+      * must be inside the image. Pixel x of the row is row(y)[x], and
+      * row(y + 1) is row(y) + stride().
+      */
+    RGBAPixel * row(unsigned int y) const { return imageData_ + y * stride(); }
+
+    /**
+      * Gets the distance, in pixels, between the starts of two
+      * consecutive rows; ImageView::strideBytes() is in bytes.
+      */
+    unsigned int stride() const { return width_; }
+
+    /**
+      * Unchecked span access: count pixels of row y starting at x, all of
+      * which must be inside the image.
+      */
+    PixelSpan span(unsigned int x, unsigned int y, unsigned int count) const { return PixelSpan(row(y) + x, count); }
+
     /**
       * Gets the width of this image.
       * @return Width of the image.
@@ -111,7 +190,51 @@ namespace imgUtil {
     void resize(unsigned int newWidth, unsigned int newHeight);
 
     /**
-     * Computes a hash of the contents of the image.
+      * Scales the image to the given size, interpolating with filter.
+      * To resize many images, keep a Resampler and a destination buffer
+      * between calls instead.
+      * @param newWidth New width of the image.
+      * @param newHeight New height of the image.
+      * @param filter Filter to interpolate with.
+      */
+    void resize(unsigned int newWidth, unsigned int newHeight, ResampleFilter filter);
+
+    /**
+      * Swaps the rows and columns of the image: pixel (x, y) moves to
+      * (y, x). Square images are transposed in place.
+      */
+    void transpose();
+
+    /**
+      * Turns the image a quarter turn counter-clockwise, as
+      * QTree::RotateCCW does. Square images are turned in place.
+      */
+    void rotate90();
+
+    /**
+      * Turns the image half a turn, in place.
+      */
+    void rotate180();
+
+    /**
+      * Turns the image a quarter turn clockwise. Square images are turned
+      * in place.
+      */
+    void rotate270();
+
+    /**
+      * Mirrors the image left to right, in place.
+      */
+    void flipHorizontal();
+
+    /**
+      * Mirrors the image top to bottom, in place.
+      */
+    void flipVertical();
+
+    /**
+     * Computes a hash of the contents of the image: its size and its
+     * pixels, read row by row. Equal to contentHash(*this).
      */
     std::size_t computeHash() const;
 
@@ -127,6 +250,51 @@ namespace imgUtil {
      void _copy(PNG const & other);
   };
 
+  /**
+    * Encodes an image view as a PNG into memory. Packed RGBA8 views are
+    * handed to the encoder as they are; anything else is converted first.
+    * @param view The pixels to encode.
+    * @param out Buffer that receives the encoded PNG.
+    * @return true, if the image was successfully encoded.
+    */
+  bool writeToBuffer(ImageView const & view, vector<unsigned char> & out);
+
+  /**
+    * Writes an image view to a file as a PNG.
+    * @param view The pixels to encode.
+    * @param fileName Name of the file to be written.
+    * @return true, if the image was successfully written.
+    */
+  bool writeToFile(ImageView const & view, string const & fileName);
+
+  /**
+    * Bytes at the start of a PNG file that hold everything inspectPNG
+    * looks at: the signature and the IHDR chunk.
+    */
+  const std::size_t PNG_HEADER_BYTES = 33;
+
+  /**
+    * What the header of a PNG file says about the image in it.
+    */
+  struct PNGHeader {
+    unsigned int width;
+    unsigned int height;
+    unsigned int bitDepth;   /*< Bits per channel, or per palette index */
+    unsigned int colorType;  /*< As in the PNG specification: 0 grey, 2 RGB, 3 palette, 4 grey and alpha, 6 RGBA */
+    unsigned int bitsPerPixel;
+    bool interlaced;
+  };
+
+  /**
+    * Reads the header of a PNG without decoding any pixels, and checks
+    * that it describes an image the decoder can read.
+    * @param data The start of the file; PNG_HEADER_BYTES are enough.
+    * @param size Number of bytes at data.
+    * @param header Receives what the header says.
+    * @return true, if the header is complete, intact and supported.
+    */
+  bool inspectPNG(unsigned char const * data, std::size_t size, PNGHeader & header);
+
   std::ostream & operator<<(std::ostream & out, PNG const & pixel);
   std::stringstream & operator<<(std::stringstream & out, PNG const & pixel);
 }
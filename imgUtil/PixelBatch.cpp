@@ -0,0 +1,232 @@
+/**
+ * @file PixelBatch.cpp
+ * Implementation of the PixelBatch class.
+ *
+ * The kernels below are plain loops over the channel arrays with no
+ * branches in their bodies so that the compiler can vectorize them; the
+ * early-exit comparisons are done afterwards, a chunk at a time.
+ */
+
+#include "PixelBatch.h"
+#include <algorithm>
+
+namespace imgUtil {
+  /**
+   * Number of pixels tested between early-exit checks in allWithin.
+   */
+  static const std::size_t CHUNK = 256;
+
+  PixelBatch::PixelBatch() : opaque_(true) { }
+
+  void PixelBatch::reserve(std::size_t n) {
+    r_.reserve(n);
+    g_.reserve(n);
+    b_.reserve(n);
+    a_.reserve(n);
+    w_.reserve(n);
+  }
+
+  void PixelBatch::clear() {
+    r_.clear();
+    g_.clear();
+    b_.clear();
+    a_.clear();
+    w_.clear();
+    pr_.clear();
+    pg_.clear();
+    pb_.clear();
+    opaque_ = true;
+  }
+
+  void PixelBatch::push(RGBAPixel const & pixel, unsigned int weight) {
+    r_.push_back(pixel.r);
+    g_.push_back(pixel.g);
+    b_.push_back(pixel.b);
+    a_.push_back(pixel.a);
+    w_.push_back(weight);
+    opaque_ = opaque_ && pixel.a == 1.0;
+  }
+
+  void PixelBatch::_premultiply() const {
+    // pixels are only ever appended, so the ones already converted stay
+    // valid and only those pushed since are added
+    std::size_t done = pr_.size();
+    std::size_t n = size();
+    if (done == n) {
+      return;
+    }
+
+    pr_.resize(n);
+    pg_.resize(n);
+    pb_.resize(n);
+    for (std::size_t i = done; i < n; i++) {
+      // same expressions as RGBAPixel::distanceTo, so the results match bit for bit
+      pr_[i] = (r_[i] / 255.0) * a_[i];
+      pg_[i] = (g_[i] / 255.0) * a_[i];
+      pb_[i] = (b_[i] / 255.0) * a_[i];
+    }
+  }
+
+  std::size_t PixelBatch::size() const {
+    return r_.size();
+  }
+
+  bool PixelBatch::opaque() const {
+    return opaque_;
+  }
+
+  bool PixelBatch::allWithin(RGBAPixel const & ref, double tolerance, std::size_t begin, std::size_t end) const {
+    if (opaque_ && ref.a == 1.0) {
+      // With both alphas 1, distanceTo is (dr^2 + dg^2 + db^2) / 255^2 up to
+      // a relative rounding error far below 1e-9.
+      double lo = tolerance * 65025.0 * (1 - 1e-9);
+      double hi = tolerance * 65025.0 * (1 + 1e-9);
+
+      for (std::size_t i = begin; i < end; i += CHUNK) {
+        std::size_t stop = std::min(end, i + CHUNK);
+        double worst = _maxSquaredDiff(ref, i, stop);
+        if (worst > hi) {
+          return false;
+        }
+        if (worst >= lo && !_chunkWithin(ref, tolerance, i, stop)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    for (std::size_t i = begin; i < end; i += CHUNK) {
+      if (!_chunkWithin(ref, tolerance, i, std::min(end, i + CHUNK))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  unsigned int PixelBatch::_maxSquaredDiff(RGBAPixel const & ref, std::size_t begin, std::size_t end) const {
+    const unsigned char *r = r_.data();
+    const unsigned char *g = g_.data();
+    const unsigned char *b = b_.data();
+    int refR = ref.r;
+    int refG = ref.g;
+    int refB = ref.b;
+
+    unsigned int worst = 0;
+    for (std::size_t i = begin; i < end; i++) {
+      int dr = refR - r[i];
+      int dg = refG - g[i];
+      int db = refB - b[i];
+      unsigned int sq = dr * dr + dg * dg + db * db;
+      worst = sq > worst ? sq : worst;
+    }
+    return worst;
+  }
+
+  void PixelBatch::distancesTo(RGBAPixel const & ref, std::size_t begin, std::size_t end, double * out) const {
+    _premultiply();
+
+    const double *pr = pr_.data();
+    const double *pg = pg_.data();
+    const double *pb = pb_.data();
+    const double *a = a_.data();
+
+    // the reference is "other" in RGBAPixel::distanceTo
+    double r_other = (ref.r / 255.0) * ref.a;
+    double g_other = (ref.g / 255.0) * ref.a;
+    double b_other = (ref.b / 255.0) * ref.a;
+    double a_other = ref.a;
+
+    for (std::size_t i = begin; i < end; i++) {
+      double r_diff = r_other - pr[i];
+      double g_diff = g_other - pg[i];
+      double b_diff = b_other - pb[i];
+
+      double alphadiff = a_other - a[i];
+
+      double r_sq = r_diff * r_diff;
+      double g_sq = g_diff * g_diff;
+      double b_sq = b_diff * b_diff;
+      double r_alt = (r_diff - alphadiff) * (r_diff - alphadiff);
+      double g_alt = (g_diff - alphadiff) * (g_diff - alphadiff);
+      double b_alt = (b_diff - alphadiff) * (b_diff - alphadiff);
+
+      out[i - begin] = (r_sq < r_alt ? r_alt : r_sq) + (g_sq < g_alt ? g_alt : g_sq) + (b_sq < b_alt ? b_alt : b_sq);
+    }
+  }
+
+  bool PixelBatch::_chunkWithin(RGBAPixel const & ref, double tolerance, std::size_t begin, std::size_t end) const {
+    double dist[CHUNK];
+    distancesTo(ref, begin, end, dist);
+
+    for (std::size_t i = 0; i < end - begin; i++) {
+      if (!(dist[i] <= tolerance)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void PixelBatch::addError(RGBAPixel const & ref, std::size_t begin, std::size_t end, double & sse, double & worst) const {
+    bool opaque = opaque_ && ref.a == 1.0;
+    double r_other = (ref.r / 255.0) * ref.a;
+    double g_other = (ref.g / 255.0) * ref.a;
+    double b_other = (ref.b / 255.0) * ref.a;
+
+    double dist[CHUNK];
+    for (std::size_t i = begin; i < end; i += CHUNK) {
+      std::size_t stop = std::min(end, i + CHUNK);
+
+      if (opaque) {
+        // the premultiplied channels are the 8-bit values, so the squared
+        // error is exact in integers; distances are only needed when this
+        // chunk might hold a new worst one
+        unsigned long long chunkSse = 0;
+        double most = _squaredError(ref, i, stop, chunkSse);
+        sse += chunkSse;
+        if (most < worst * 65025.0 * (1 - 1e-9)) {
+          continue;
+        }
+        distancesTo(ref, i, stop, dist);
+        for (std::size_t j = 0; j < stop - i; j++) {
+          worst = std::max(worst, dist[j]);
+        }
+        continue;
+      }
+
+      distancesTo(ref, i, stop, dist);
+
+      double chunkSse = 0.0;
+      for (std::size_t j = i; j < stop; j++) {
+        double r_diff = r_other - pr_[j];
+        double g_diff = g_other - pg_[j];
+        double b_diff = b_other - pb_[j];
+        chunkSse += w_[j] * (r_diff * r_diff + g_diff * g_diff + b_diff * b_diff);
+        worst = std::max(worst, dist[j - i]);
+      }
+      sse += chunkSse * 65025.0;
+    }
+  }
+
+  unsigned int PixelBatch::_squaredError(RGBAPixel const & ref, std::size_t begin, std::size_t end, unsigned long long & sse) const {
+    const unsigned char *r = r_.data();
+    const unsigned char *g = g_.data();
+    const unsigned char *b = b_.data();
+    const unsigned int *w = w_.data();
+    int refR = ref.r;
+    int refG = ref.g;
+    int refB = ref.b;
+
+    unsigned int worst = 0;
+    unsigned long long total = 0;
+    for (std::size_t i = begin; i < end; i++) {
+      int dr = refR - r[i];
+      int dg = refG - g[i];
+      int db = refB - b[i];
+      unsigned int sq = dr * dr + dg * dg + db * db;
+      worst = sq > worst ? sq : worst;
+      total += (unsigned long long) w[i] * sq;
+    }
+    sse += total;
+    return worst;
+  }
+}
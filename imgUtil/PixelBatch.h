@@ -0,0 +1,107 @@
+/**
+ * @file PixelBatch.h
+ * A structure-of-arrays batch of pixels that can be compared against a
+ * single reference pixel many at a time.
+ */
+
+#ifndef CS221_PIXELBATCH_H_
+#define CS221_PIXELBATCH_H_
+
+#include <cstddef>
+#include <vector>
+#include "RGBAPixel.h"
+
+namespace imgUtil {
+  class PixelBatch {
+  public:
+    /**
+     * Constructs an empty batch.
+     */
+    PixelBatch();
+
+    /**
+     * Reserves room for n pixels.
+     */
+    void reserve(std::size_t n);
+
+    /**
+     * Removes every pixel, keeping the allocated storage.
+     */
+    void clear();
+
+    /**
+     * Appends a pixel to the end of the batch.
+     * @param pixel the pixel.
+     * @param weight how many times the pixel counts in addError, such as
+     *               the area it covers.
+     */
+    void push(RGBAPixel const & pixel, unsigned int weight = 1);
+
+    /**
+     * Returns the number of pixels in the batch.
+     */
+    std::size_t size() const;
+
+    /**
+     * Returns true if every pixel in the batch has alpha 1.
+     */
+    bool opaque() const;
+
+    /**
+     * Tests whether pixels [begin, end) are all within tolerance of ref.
+     * Gives exactly the same answer as checking
+     * pixel.distanceTo(ref) <= tolerance for each pixel in turn.
+     *
+     * When the batch and ref are opaque the squared distances are computed
+     * in integers; only when the largest of them is too close to the
+     * tolerance to call are the pixels compared in double precision.
+     *
+     * @param ref the reference pixel.
+     * @param tolerance the largest allowed distance.
+     * @param begin index of the first pixel to test.
+     * @param end one past the index of the last pixel to test.
+     */
+    bool allWithin(RGBAPixel const & ref, double tolerance, std::size_t begin, std::size_t end) const;
+
+    /**
+     * Computes the distance from each of pixels [begin, end) to ref.
+     * out[i - begin] is set to exactly the value of pixel i's
+     * distanceTo(ref).
+     *
+     * @param ref the reference pixel.
+     * @param begin index of the first pixel.
+     * @param end one past the index of the last pixel.
+     * @param out array of at least end - begin distances.
+     */
+    void distancesTo(RGBAPixel const & ref, std::size_t begin, std::size_t end, double * out) const;
+
+    /**
+     * Adds the error of replacing pixels [begin, end) with ref. The squared
+     * differences of red, green and blue, premultiplied by alpha on a 0-255
+     * scale, are weighted and added to sse; worst is raised to the largest
+     * distanceTo(ref) among the pixels.
+     */
+    void addError(RGBAPixel const & ref, std::size_t begin, std::size_t end, double & sse, double & worst) const;
+
+  private:
+    std::vector<unsigned char> r_;  /*< red channels */
+    std::vector<unsigned char> g_;  /*< green channels */
+    std::vector<unsigned char> b_;  /*< blue channels */
+    std::vector<double> a_;         /*< alpha channels */
+    std::vector<unsigned int> w_;   /*< weights */
+    bool opaque_;                   /*< whether every alpha is 1 */
+
+    // premultiplied red, green and blue, in [0, 1]; filled in on first use,
+    // and extended to pixels pushed since
+    mutable std::vector<double> pr_;
+    mutable std::vector<double> pg_;
+    mutable std::vector<double> pb_;
+
+    void _premultiply() const;
+    unsigned int _maxSquaredDiff(RGBAPixel const & ref, std::size_t begin, std::size_t end) const;
+    unsigned int _squaredError(RGBAPixel const & ref, std::size_t begin, std::size_t end, unsigned long long & sse) const;
+    bool _chunkWithin(RGBAPixel const & ref, double tolerance, std::size_t begin, std::size_t end) const;
+  };
+}
+
+#endif
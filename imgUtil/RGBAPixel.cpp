@@ -85,7 +85,7 @@ namespace imgUtil {
    *
    * @param other the other RGBAPixel to compare to this one
    */
-  double RGBAPixel::distanceTo(RGBAPixel other) {
+  double RGBAPixel::distanceTo(RGBAPixel const & other) const {
       // this pixel's color channels
       double r_this = (r / 255.0) * a;
       double g_this = (g / 255.0) * a;
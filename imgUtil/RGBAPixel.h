@@ -63,7 +63,7 @@ namespace imgUtil {
      * 
      * @param other the other RGBAPixel to compare to this one
      */
-    double distanceTo(RGBAPixel other);
+    double distanceTo(RGBAPixel const & other) const;
   };
 
   /**
@@ -0,0 +1,214 @@
+/**
+ * @file Resample.cpp
+ * Implementation of the Resampler class.
+ *
+ * Both passes are plain loops over contiguous float rows with a fixed
+ * number of taps, so that the compiler can vectorize them.
+ */
+
+#include "Resample.h"
+#include "Bands.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace imgUtil {
+  /**
+   * Fewest rows handed to one thread in either pass.
+   */
+  static const unsigned int MIN_BAND_ROWS = 32;
+
+  static const double PI = 3.14159265358979323846;
+
+  static double radiusOf(ResampleFilter filter) {
+    switch (filter) {
+      case RESAMPLE_BOX: return 0.5;
+      case RESAMPLE_BILINEAR: return 1.0;
+      default: return 3.0;
+    }
+  }
+
+  static double sinc(double x) {
+    return x == 0 ? 1.0 : std::sin(PI * x) / (PI * x);
+  }
+
+  static double weightOf(ResampleFilter filter, double x) {
+    switch (filter) {
+      case RESAMPLE_BOX: return (x >= -0.5 && x < 0.5) ? 1.0 : 0.0;
+      case RESAMPLE_BILINEAR: return std::max(0.0, 1.0 - std::fabs(x));
+      default: return std::fabs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    }
+  }
+
+  Resampler::Resampler(ResampleFilter filter, unsigned int threads)
+    : filter_(filter), threads_(threads) {
+    horizontal_.from = horizontal_.to = 0;
+    vertical_.from = vertical_.to = 0;
+  }
+
+  bool Resampler::resample(ImageView const & src, ImageView const & dst) {
+    if (src.width() == 0 || src.height() == 0 || dst.width() == 0 || dst.height() == 0) {
+      return false;
+    }
+
+    _weights(horizontal_, src.width(), dst.width());
+    _weights(vertical_, src.height(), dst.height());
+    rows_.resize((std::size_t) src.height() * dst.width() * 4);
+
+    // x first: every source row is read once, into rows_
+    unsigned int workers = _threadsFor(src.height());
+    if (scratch_.size() < workers) {
+      scratch_.resize(workers);
+    }
+    // forEachBand joins every band it starts, even if one throws
+    forEachBand(src.height(), workers, [&](unsigned int band, unsigned int top, unsigned int bottom) {
+      _horizontal(src, top, bottom, scratch_[band]);
+    });
+
+    // then y, one output row at a time
+    workers = _threadsFor(dst.height());
+    if (scratch_.size() < workers) {
+      scratch_.resize(workers);
+    }
+    forEachBand(dst.height(), workers, [&](unsigned int band, unsigned int top, unsigned int bottom) {
+      _vertical(dst, top, bottom, scratch_[band]);
+    });
+
+    return true;
+  }
+
+  void Resampler::_weights(Weights & weights, unsigned int from, unsigned int to) const {
+    if (weights.from == from && weights.to == to) {
+      return;
+    }
+
+    // when shrinking, stretch the filter to cover every source pixel
+    double scale = (double) from / to;
+    double stretch = std::max(1.0, scale);
+    double support = radiusOf(filter_) * stretch;
+    unsigned int taps = std::min(from, (unsigned int) std::ceil(2 * support) + 2);
+
+    weights.from = from;
+    weights.to = to;
+    weights.taps = taps;
+    weights.start.assign(to, 0);
+    weights.weights.assign((std::size_t) to * taps, 0.0f);
+
+    std::vector<double> row(taps);
+    for (unsigned int i = 0; i < to; i++) {
+      double center = (i + 0.5) * scale - 0.5;
+      long lo = (long) std::floor(center - support);
+      long hi = (long) std::ceil(center + support);
+
+      long first = std::max(0L, lo);
+      long start = std::min(first, (long) from - taps);
+      std::fill(row.begin(), row.end(), 0.0);
+
+      // taps beyond the edges repeat the edge pixel
+      double total = 0;
+      for (long j = lo; j <= hi; j++) {
+        double w = weightOf(filter_, (j - center) / stretch);
+        if (w == 0) {
+          continue;
+        }
+        long k = std::min(std::max(j, 0L), (long) from - 1) - start;
+        row[k] += w;
+        total += w;
+      }
+
+      weights.start[i] = (unsigned int) start;
+      float * out = &weights.weights[(std::size_t) i * taps];
+      for (unsigned int k = 0; k < taps; k++) {
+        out[k] = (float) (row[k] / total);
+      }
+    }
+  }
+
+  void Resampler::_horizontal(ImageView const & src, unsigned int rowBegin, unsigned int rowEnd, std::vector<float> & scratch) {
+    unsigned int width = src.width();
+    unsigned int outWidth = horizontal_.to;
+    unsigned int taps = horizontal_.taps;
+    scratch.resize((std::size_t) width * 4);
+    float * in = scratch.data();
+
+    for (unsigned int y = rowBegin; y < rowEnd; y++) {
+      // premultiply the source row
+      if (src.format() == PIXEL_FORMAT_RGBAPIXEL) {
+        RGBAPixel const * pixels = src.row(y);
+        for (unsigned int x = 0; x < width; x++) {
+          float a = (float) pixels[x].a;
+          in[4 * x] = pixels[x].r * a;
+          in[4 * x + 1] = pixels[x].g * a;
+          in[4 * x + 2] = pixels[x].b * a;
+          in[4 * x + 3] = a;
+        }
+      } else {
+        unsigned char const * bytes = src.rowBytes(y);
+        for (unsigned int x = 0; x < width; x++) {
+          float a = bytes[4 * x + 3] / 255.0f;
+          in[4 * x] = bytes[4 * x] * a;
+          in[4 * x + 1] = bytes[4 * x + 1] * a;
+          in[4 * x + 2] = bytes[4 * x + 2] * a;
+          in[4 * x + 3] = a;
+        }
+      }
+
+      float * out = &rows_[(std::size_t) y * outWidth * 4];
+      for (unsigned int x = 0; x < outWidth; x++) {
+        float const * w = &horizontal_.weights[(std::size_t) x * taps];
+        float const * p = in + (std::size_t) horizontal_.start[x] * 4;
+        float r = 0, g = 0, b = 0, a = 0;
+        for (unsigned int k = 0; k < taps; k++) {
+          r += w[k] * p[4 * k];
+          g += w[k] * p[4 * k + 1];
+          b += w[k] * p[4 * k + 2];
+          a += w[k] * p[4 * k + 3];
+        }
+        out[4 * x] = r;
+        out[4 * x + 1] = g;
+        out[4 * x + 2] = b;
+        out[4 * x + 3] = a;
+      }
+    }
+  }
+
+  void Resampler::_vertical(ImageView const & dst, unsigned int rowBegin, unsigned int rowEnd, std::vector<float> & scratch) const {
+    unsigned int width = dst.width();
+    unsigned int taps = vertical_.taps;
+    std::size_t rowFloats = (std::size_t) width * 4;
+    scratch.resize(rowFloats);
+    float * sum = scratch.data();
+
+    for (unsigned int y = rowBegin; y < rowEnd; y++) {
+      std::fill(sum, sum + rowFloats, 0.0f);
+      float const * w = &vertical_.weights[(std::size_t) y * taps];
+      for (unsigned int k = 0; k < taps; k++) {
+        float const * in = &rows_[(vertical_.start[y] + k) * rowFloats];
+        float wk = w[k];
+        for (std::size_t j = 0; j < rowFloats; j++) {
+          sum[j] += wk * in[j];
+        }
+      }
+
+      for (unsigned int x = 0; x < width; x++) {
+        // store alpha in 1/255 steps, as read from a file, so that opaque
+        // images stay exactly opaque despite float rounding
+        float a = std::min(1.0f, std::max(0.0f, sum[4 * x + 3]));
+        int alpha = (int) (a * 255.0f + 0.5f);
+        RGBAPixel pixel(0, 0, 0, alpha / 255.);
+        if (alpha > 0) {
+          float unmultiply = 1.0f / a;
+          pixel.r = (unsigned char) std::min(255.0f, std::max(0.0f, sum[4 * x] * unmultiply + 0.5f));
+          pixel.g = (unsigned char) std::min(255.0f, std::max(0.0f, sum[4 * x + 1] * unmultiply + 0.5f));
+          pixel.b = (unsigned char) std::min(255.0f, std::max(0.0f, sum[4 * x + 2] * unmultiply + 0.5f));
+        }
+        dst.fill(x, y, 1, pixel);
+      }
+    }
+  }
+
+  unsigned int Resampler::_threadsFor(unsigned int rows) const {
+    unsigned int threads = threads_ ? threads_ : std::max(1u, std::thread::hardware_concurrency());
+    return std::max(1u, std::min(threads, rows / MIN_BAND_ROWS));
+  }
+}
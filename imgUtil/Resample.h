@@ -0,0 +1,77 @@
+/**
+ * @file Resample.h
+ * Resizing an image with interpolation, as two separable passes over
+ * rows of premultiplied float pixels.
+ */
+
+#ifndef CS221_RESAMPLE_H_
+#define CS221_RESAMPLE_H_
+
+#include <vector>
+#include "ImageView.h"
+
+namespace imgUtil {
+  /**
+   * Filters a Resampler can use.
+   */
+  enum ResampleFilter {
+    RESAMPLE_BOX,      /**< average of the source pixels each output pixel covers */
+    RESAMPLE_BILINEAR, /**< triangle filter; bilinear interpolation when upscaling */
+    RESAMPLE_LANCZOS3  /**< windowed sinc with three lobes; sharpest, may ring slightly */
+  };
+
+  /**
+   * Resizes images with a fixed filter.
+   *
+   * Colors are premultiplied by alpha while they are filtered, so
+   * transparent pixels do not bleed their color into their neighbours.
+   * Each pass walks rows in memory order with a fixed number of taps per
+   * output pixel, and rows are shared out between threads.
+   *
+   * The filter weights and the intermediate rows are kept between calls,
+   * so resizing many images of the same size into the same destination
+   * allocates nothing after the first call.
+   */
+  class Resampler {
+  public:
+    /**
+      * Creates a resampler.
+      * @param filter The filter to resize with.
+      * @param threads Largest number of threads to use; 0 for one per core.
+      */
+    Resampler(ResampleFilter filter = RESAMPLE_LANCZOS3, unsigned int threads = 0);
+
+    /**
+      * Resizes src to the size of dst, writing every pixel of dst.
+      * @param src The image to resize.
+      * @param dst Where the result goes; must not overlap src.
+      * @return false, if either view is empty.
+      */
+    bool resample(ImageView const & src, ImageView const & dst);
+
+  private:
+    // for every output position along one axis: the first source
+    // position read and taps_ weights, zero-padded
+    struct Weights {
+      unsigned int from;       /*< Source size the weights were made for */
+      unsigned int to;         /*< Output size the weights were made for */
+      unsigned int taps;       /*< Weights per output position */
+      std::vector<unsigned int> start;
+      std::vector<float> weights;
+    };
+
+    ResampleFilter filter_;         /*< Filter to resize with */
+    unsigned int threads_;          /*< Largest number of threads, 0 for one per core */
+    Weights horizontal_;            /*< Weights along x for the last sizes used */
+    Weights vertical_;              /*< Weights along y for the last sizes used */
+    std::vector<float> rows_;       /*< Source rows resized along x, 4 floats per pixel */
+    std::vector<std::vector<float> > scratch_; /*< One row buffer per thread */
+
+    void _weights(Weights & weights, unsigned int from, unsigned int to) const;
+    void _horizontal(ImageView const & src, unsigned int rowBegin, unsigned int rowEnd, std::vector<float> & scratch);
+    void _vertical(ImageView const & dst, unsigned int rowBegin, unsigned int rowEnd, std::vector<float> & scratch) const;
+    unsigned int _threadsFor(unsigned int rows) const;
+  };
+}
+
+#endif
@@ -3,10 +3,29 @@
  * @description basic test cases for QTree
  */
 
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
 
 #include "qtree.h"
+#include "qtree-batch.h"
+#include "qtree-cache.h"
+#include "qtree-daemon.h"
+#include "qtree-memory.h"
+#include "qtree-reclaim.h"
+#include "qtree-sequence.h"
+#include "qtreepng.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -17,6 +36,53 @@ void TestBuildRender(unsigned int scale);
 void TestFlipHorizontal();
 void TestRotateCCW();
 void TestPrune(double tol);
+void TestPruneToPSNR(double psnr);
+void TestCopyOnWrite();
+void TestDeduplicate();
+void TestDeferredClear();
+void TestUpdate();
+void TestSequence();
+void TestCrop();
+void TestDownscale(unsigned int levels);
+void TestOverlay();
+void TestResample();
+void TestOrient();
+void TestResultCache();
+void TestBatch(bool useRing);
+void TestDaemon();
+void TestLibrary();
+void TestSharedMemory();
+void TestMemoryGovernor();
+
+static CompressDaemon* daemonToStop = nullptr;
+
+static void StopDaemon(int) {
+	daemonToStop->Stop();
+}
+
+/**
+ * Removes path, and everything under it if it is a directory.
+ */
+static void removeTree(const string& path) {
+	struct stat info;
+	if (lstat(path.c_str(), &info) != 0) {
+		return;
+	}
+	if (S_ISDIR(info.st_mode)) {
+		if (DIR* handle = opendir(path.c_str())) {
+			while (dirent* item = readdir(handle)) {
+				string name = item->d_name;
+				if (name != "." && name != "..") {
+					removeTree(path + "/" + name);
+				}
+			}
+			closedir(handle);
+		}
+		rmdir(path.c_str());
+	} else {
+		unlink(path.c_str());
+	}
+}
 
 /***********************************/
 /*** MAIN FUNCTION PROGRAM ENTRY ***/
@@ -24,12 +90,44 @@ void TestPrune(double tol);
 
 int main(int argc, char* argv[]) {
 
+	// pngCompressor --daemon <socket> [threads] [memory MB]: serve jobs until interrupted
+	if (argc >= 3 && string(argv[1]) == "--daemon") {
+		CompressDaemon daemon(argv[2], argc >= 4 ? (unsigned int) atoi(argv[3]) : 0, 256 << 20,
+		                      argc >= 5 ? strtoull(argv[4], nullptr, 10) << 20 : 0);
+		if (!daemon.Listen()) {
+			return 1;
+		}
+		daemonToStop = &daemon;
+		signal(SIGINT, StopDaemon);
+		signal(SIGTERM, StopDaemon);
+		daemon.Serve();
+		return 0;
+	}
+
 	TestBuildRender(1);
 	TestBuildRender(6);
 	TestFlipHorizontal();
 	TestRotateCCW();
 	TestPrune(0.01);
 	TestPrune(0.05);
+	TestPruneToPSNR(30);
+	TestCopyOnWrite();
+	TestDeduplicate();
+	TestDeferredClear();
+	TestUpdate();
+	TestSequence();
+	TestCrop();
+	TestDownscale(1);
+	TestOverlay();
+	TestResample();
+	TestOrient();
+	TestResultCache();
+	TestBatch(true);
+	TestBatch(false);
+	TestDaemon();
+	TestLibrary();
+	TestSharedMemory();
+	TestMemoryGovernor();
 
 	return 0;
 }
@@ -193,6 +291,10 @@ void TestPrune(double tol) {
 
 	cout << "Pruned tree contains " << t.CountNodes() << " nodes and " << t.CountLeaves() << " leaves." << endl;
 
+	PruneStats stats = t.LastPruneStats();
+	cout << "Prune collapsed " << stats.prunedSubtrees << " subtrees covering " << stats.prunedPixels << " pixels: "
+	     << "PSNR " << stats.PSNR() << " dB, max error " << stats.maxError << "." << endl;
+
 	cout << "Rendering tree to PNG at x1 scale... ";
 	PNG output = t.Render(1);
 	cout << "done." << endl;
@@ -204,4 +306,728 @@ void TestPrune(double tol) {
 	cout << "done." << endl;
 
 	cout << "Exiting TestPrune.\n" << endl;
-}
\ No newline at end of file
+}
+
+void TestPruneToPSNR(double psnr) {
+	cout << "Entered TestPruneToPSNR, PSNR: " << psnr << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling PruneToPSNR... ";
+	double tol = t.PruneToPSNR(psnr);
+	cout << "done." << endl;
+
+	cout << "Pruned with tolerance " << tol << " to " << t.CountLeaves() << " leaves, PSNR "
+	     << t.LastPruneStats().PSNR() << " dB." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = t.Render(1);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-psnr_" + to_string((int) psnr) + "-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestPruneToPSNR.\n" << endl;
+}
+
+void TestCopyOnWrite() {
+	cout << "Entered TestCopyOnWrite" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	PNG before = t.Render(1);
+	cout << "done." << endl;
+
+	// the copy shares every node with t until it changes them
+	cout << "Copying the tree, then pruning, rotating and flipping the copy... ";
+	QTree copy(t);
+	copy.Prune(0.05);
+	copy.RotateCCW();
+	copy.FlipHorizontal();
+	cout << "done." << endl;
+
+	cout << "Copy contains " << copy.CountLeaves() << " leaves, the original " << t.CountLeaves() << "." << endl;
+	cout << "Original renders the same as before the copy changed: " << (t.Render(1) == before ? "yes" : "no") << "."
+	     << endl;
+
+	cout << "Rendering the copy to PNG at x1 scale... ";
+	PNG output = copy.Render(1);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/malachi-copy-prune_0.05-rotateccw_x1-fliphorizontal_x1-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestCopyOnWrite.\n" << endl;
+}
+
+void TestDeduplicate() {
+	cout << "Entered TestDeduplicate" << endl;
+
+	// read input PNG, and tile a 64x64 piece of it four times over, so
+	// that each quadrant of the tree describes the same pixels
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	PNG tiled(128, 128);
+	for (unsigned int y = 0; y < tiled.height(); y++) {
+		for (unsigned int x = 0; x < tiled.width(); x++) {
+			*tiled.getPixel(x, y) = *input.getPixel(96 + x % 64, 80 + y % 64);
+		}
+	}
+
+	cout << "Constructing QTree from tiled image... ";
+	QTree t(tiled);
+	PNG before = t.Render(1);
+	cout << "done." << endl;
+
+	cout << "Tree contains " << t.CountNodes() << " nodes, " << t.CountUniqueNodes() << " distinct." << endl;
+
+	cout << "Calling Deduplicate... ";
+	t.Deduplicate();
+	cout << "done." << endl;
+
+	cout << "Tree contains " << t.CountNodes() << " nodes, " << t.CountUniqueNodes() << " distinct." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = t.Render(1);
+	cout << "done." << endl;
+
+	cout << "Deduplicated tree renders the same: " << (output == before ? "yes" : "no") << "." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-tiled_128x128-deduplicate-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestDeduplicate.\n" << endl;
+}
+
+void TestDeferredClear() {
+	cout << "Entered TestDeferredClear" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	NodeReclaimer& reclaimer = NodeReclaimer::Instance();
+	reclaimer.Drain();
+	ReclaimStats before = reclaimer.Stats();
+
+	// the copy is pruned, so it shares some of its nodes with the original
+	// and owns the rest
+	cout << "Constructing a deferred QTree and a pruned copy of it... ";
+	QTree* t = new QTree(input);
+	t->SetDeferredClear(true);
+	QTree copy(*t);
+	copy.SetDeferredClear(false);
+	copy.Prune(0.05);
+	PNG expected = copy.Render(1);
+	cout << "done." << endl;
+
+	cout << "Destroying the original and draining the reclaimer... ";
+	delete t;
+	reclaimer.Drain();
+	cout << "done." << endl;
+
+	ReclaimStats after = reclaimer.Stats();
+	cout << "Reclaimed " << after.reclaimedTrees - before.reclaimedTrees << " trees, "
+	     << after.reclaimedNodes - before.reclaimedNodes << " nodes; " << after.rejectedTrees - before.rejectedTrees
+	     << " rejected." << endl;
+	cout << "Copy renders the same as before the original went: " << (copy.Render(1) == expected ? "yes" : "no")
+	     << "." << endl;
+
+	// with the reclaimer held the queue fills up, and the trees it refuses
+	// are freed on the spot
+	cout << "Destroying " << NodeReclaimer::MAX_PENDING_TREES + 4 << " deferred trees while the reclaimer is held... ";
+	before = after;
+	reclaimer.Hold(true);
+	{
+		vector<QTree> trees(NodeReclaimer::MAX_PENDING_TREES + 4, QTree(input));
+		for (QTree& tree : trees) {
+			tree.Prune(0.05);
+			tree.SetDeferredClear(true);
+		}
+	}
+	ReclaimStats held = reclaimer.Stats();
+	reclaimer.Hold(false);
+	reclaimer.Drain();
+	after = reclaimer.Stats();
+	cout << "done." << endl;
+
+	cout << "While held, " << held.pendingTrees << " trees waited and " << held.rejectedTrees - before.rejectedTrees
+	     << " were freed at once; then " << after.reclaimedTrees - before.reclaimedTrees << " were reclaimed, "
+	     << after.pendingTrees << " left." << endl;
+
+	cout << "Exiting TestDeferredClear.\n" << endl;
+}
+
+void TestUpdate() {
+	cout << "Entered TestUpdate" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	// paint a bar across the image, standing in for a changed status bar
+	pair<unsigned int, unsigned int> ul(10, 40);
+	pair<unsigned int, unsigned int> lr(49, 47);
+	for (unsigned int y = ul.second; y <= lr.second; y++) {
+		for (unsigned int x = ul.first; x <= lr.first; x++) {
+			*input.getPixel(x, y) = RGBAPixel(255, 128, 0);
+		}
+	}
+
+	cout << "Calling Update on the changed rectangle... ";
+	t.Update(input, ul, lr);
+	cout << "done." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = t.Render(1);
+	cout << "done." << endl;
+
+	cout << "Updated tree matches a freshly built tree: " << (output == QTree(input).Render(1) ? "yes" : "no") << endl;
+
+	// write output PNG
+	string outfilename = "images-output/malachi-update-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestUpdate.\n" << endl;
+}
+
+void TestSequence() {
+	cout << "Entered TestSequence" << endl;
+
+	// read input PNG
+	PNG frame;
+	frame.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	QTreeSequence encoder;
+	QTreeSequence decoder;
+
+	for (unsigned int i = 0; i < 4; i++) {
+		// move a small block across the image, standing in for a cursor;
+		// the last one is translucent, so its alpha must survive the delta
+		RGBAPixel cursor = (i < 3 ? RGBAPixel(255, 255, 255) : RGBAPixel(255, 255, 255, 0.3));
+		for (unsigned int y = 100; y < 110; y++) {
+			for (unsigned int x = 20 + i * 30; x < 30 + i * 30; x++) {
+				*frame.getPixel(x, y) = cursor;
+			}
+		}
+
+		cout << "Pushing frame " << i << "... ";
+		encoder.Push(frame);
+		cout << "done." << endl;
+
+		stringstream delta;
+		encoder.WriteDelta(delta);
+		cout << "Frame " << i << " rebuilt " << encoder.ChangedRegions().size() << " subtrees; delta is "
+		     << delta.str().size() << " bytes." << endl;
+
+		bool applied = decoder.ApplyDelta(delta);
+		cout << "Decoded frame matches: " << (applied && decoder.Current().Render(1) == frame ? "yes" : "no") << endl;
+
+		// the decoder's render must be the encoder's, byte for byte
+		vector<unsigned char> sent;
+		vector<unsigned char> received;
+		encoder.Current().Render(1).writeToBuffer(sent);
+		if (applied) {
+			decoder.Current().Render(1).writeToBuffer(received);
+		}
+		cout << "Decoded frame renders the same bytes: " << (applied && sent == received ? "yes" : "no") << endl;
+	}
+
+	cout << "Exiting TestSequence.\n" << endl;
+}
+
+void TestCrop() {
+	cout << "Entered TestCrop" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Crop... ";
+	QTree cropped = t.Crop(make_pair(10u, 20u), make_pair(49u, 69u));
+	cout << "done." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = cropped.Render(1);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/malachi-crop-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestCrop.\n" << endl;
+}
+
+void TestDownscale(unsigned int levels) {
+	cout << "Entered TestDownscale, levels: " << levels << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Downscale... ";
+	QTree small = t.Downscale(levels);
+	cout << "done." << endl;
+
+	cout << "Downscaled tree contains " << small.CountNodes() << " nodes and " << small.CountLeaves() << " leaves." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = small.Render(1);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-downscale_" + to_string(levels) + "-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestDownscale.\n" << endl;
+}
+
+void TestOverlay() {
+	cout << "Entered TestOverlay" << endl;
+
+	// read input PNGs
+	PNG base;
+	base.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	PNG top;
+	top.readFromFile("images-original/malachi-60x87.png");
+
+	// give the top image a transparent band and a translucent band
+	for (unsigned int y = 0; y < top.height(); y++) {
+		for (unsigned int x = 0; x < top.width(); x++) {
+			if (y < 20) {
+				top.getPixel(x, y)->a = 0.0;
+			} else if (y >= 60) {
+				top.getPixel(x, y)->a = 0.5;
+			}
+		}
+	}
+
+	cout << "Constructing QTrees from images... ";
+	QTree t(base);
+	QTree overlay(top);
+	cout << "done." << endl;
+
+	cout << "Calling Overlay... ";
+	t.Overlay(overlay, 150, 100);
+	cout << "done." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = t.Render(1);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-overlay-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestOverlay.\n" << endl;
+}
+
+void TestResample() {
+	cout << "Entered TestResample" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Resampling image to 160x140 with Lanczos... ";
+	PNG small(160, 140);
+	Resampler resampler(RESAMPLE_LANCZOS3);
+	resampler.resample(input, small);
+	cout << "done." << endl;
+
+	cout << "Constructing QTree from image... ";
+	QTree t(small);
+	cout << "done." << endl;
+
+	cout << "Rendering tree to PNG at x1 scale... ";
+	PNG output = t.Render(1);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-resample_160x140-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestResample.\n" << endl;
+}
+
+void TestOrient() {
+	cout << "Entered TestOrient" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Rotating image pixels CCW... ";
+	PNG rotated = input;
+	rotated.rotate90();
+	cout << "done." << endl;
+
+	cout << "Rotating tree CCW and rendering at x1 scale... ";
+	QTree t(input);
+	t.RotateCCW();
+	PNG expected = t.Render(1);
+	cout << "done." << endl;
+	cout << "Pixel rotation " << (rotated == expected ? "matches" : "DOES NOT match") << " the tree." << endl;
+
+	cout << "Turning a square image four quarter turns each way... ";
+	PNG square;
+	square.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	square.resize(224, 224);
+	PNG turned = square;
+	for (unsigned int i = 0; i < 4; i++) {
+		turned.rotate90();
+	}
+	for (unsigned int i = 0; i < 4; i++) {
+		turned.rotate270();
+	}
+	turned.rotate180();
+	turned.flipHorizontal();
+	turned.flipVertical();
+	cout << "done." << endl;
+	cout << "Square image " << (turned == square ? "is" : "is NOT") << " back where it started." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/malachi-rotate90_x1.png";
+	cout << "Writing rotated PNG to file... ";
+	rotated.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestOrient.\n" << endl;
+}
+
+void TestResultCache() {
+	cout << "Entered TestResultCache" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	ResultCache cache(64 << 20);
+	CompressParams params(0.05, 2, 1);
+
+	cout << "Compressing the same image from four threads at once... ";
+	vector<shared_ptr<const vector<unsigned char> > > results(4);
+	vector<thread> requests;
+	for (unsigned int i = 0; i < results.size(); i++) {
+		requests.emplace_back([&cache, &input, &params, &results, i]() { results[i] = cache.Encoded(input, params); });
+	}
+	for (thread& request : requests) {
+		request.join();
+	}
+	cout << "done." << endl;
+
+	cout << "Compressing it again with another tolerance... ";
+	cache.Encoded(input, CompressParams(0.01, 2, 1));
+	cout << "done." << endl;
+
+	CacheStats stats = cache.Stats();
+	cout << "Cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.joined << " joined, "
+	     << stats.entries << " entries taking about " << stats.bytes << " bytes." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-cache-prune_0.05-rotateccw_x1-render_x2.png";
+	cout << "Writing cached PNG to file... ";
+	ofstream out(outfilename, ios::binary);
+	out.write((const char*) results[0]->data(), results[0]->size());
+	cout << "done." << endl;
+
+	cout << "Exiting TestResultCache.\n" << endl;
+}
+
+void TestBatch(bool useRing) {
+	cout << "Entered TestBatch, useRing: " << useRing << endl;
+
+	// start from nothing, whatever an earlier run of the program left, so
+	// that the first run compresses every image and the second skips them
+	removeTree("images-output/batch");
+	BatchCompressor batch("images-output/batch/manifest.txt", 256 << 20, 0, useRing);
+	CompressParams params(0.02);
+	cout << "Reading and writing through " << (batch.UsingRing() ? "io_uring." : "a thread pool.") << endl;
+
+	for (unsigned int run = 0; run < 2; run++) {
+		cout << "Compressing images-original into images-output/batch... ";
+		BatchStats stats = batch.Run("images-original", "images-output/batch", params);
+		cout << "done." << endl;
+
+		cout << "Run " << run << ": " << stats.files << " files, " << stats.compressed << " compressed, "
+		     << stats.skipped << " skipped, " << stats.rehashed << " rehashed, " << stats.failed << " failed." << endl;
+	}
+
+	// the same directories spelled another way are still up to date
+	cout << "Compressing ./images-original/ into ./images-output/batch/... ";
+	BatchStats stats = batch.Run("./images-original/", "./images-output/batch/", params);
+	cout << "done." << endl;
+	cout << "Run 2: " << stats.files << " files, " << stats.compressed << " compressed, " << stats.skipped
+	     << " skipped, " << stats.rehashed << " rehashed, " << stats.failed << " failed." << endl;
+
+	// and an input that goes away leaves the manifest with it
+	removeTree("images-output/batch-input");
+	mkdir("images-output/batch-input", 0755);
+	mkdir("images-output/batch-input/in", 0755);
+	for (const char* name : { "a.png", "b.png" }) {
+		ifstream from("images-original/malachi-60x87.png", ios::binary);
+		ofstream to(string("images-output/batch-input/in/") + name, ios::binary);
+		to << from.rdbuf();
+	}
+	BatchCompressor small("images-output/batch-input/manifest.txt", 256 << 20, 0, useRing);
+	small.Run("images-output/batch-input/in", "images-output/batch-input/out", params);
+	remove("images-output/batch-input/in/b.png");
+	small.Run("images-output/batch-input/in", "images-output/batch-input/out", params);
+	ifstream manifest("images-output/batch-input/manifest.txt");
+	unsigned int lines = 0;
+	for (string line; getline(manifest, line);) {
+		lines++;
+	}
+	cout << "After deleting an input the manifest holds " << lines - 1 << " entries." << endl;
+
+	cout << "Exiting TestBatch.\n" << endl;
+}
+
+void TestDaemon() {
+	cout << "Entered TestDaemon" << endl;
+
+	CompressDaemon daemon("images-output/daemon.sock", 2, 64 << 20);
+	if (!daemon.Listen()) {
+		cout << "Exiting TestDaemon.\n" << endl;
+		return;
+	}
+	thread server([&daemon]() { daemon.Serve(); });
+
+	DaemonClient client;
+	cout << "Connecting to the daemon... ";
+	bool connected = client.Connect("images-output/daemon.sock");
+	cout << (connected ? "done." : "failed.") << endl;
+
+	// one job by path, one by descriptor both ways
+	cout << "Sending two jobs without waiting... ";
+	client.Compress("images-original/kkkk_nnkm-256x224.png",
+	                "images-output/kkkk_nnkm-256x224-daemon-prune_0.05-rotateccw_x1-render_x2.png", CompressParams(0.05, 2, 1));
+	int in = open("images-original/malachi-60x87.png", O_RDONLY);
+	int out = open("images-output/malachi-daemon-prune_0.01-render_x1.png", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	client.Compress("", "", CompressParams(0.01), in, out);
+	close(in);
+	close(out);
+	cout << "done." << endl;
+
+	for (unsigned int i = 0; i < 2; i++) {
+		string reply;
+		client.ReadReply(reply);
+		// the timings differ from run to run, so only the outcome is shown
+		cout << "Reply: " << reply.substr(0, reply.find('\t', reply.find('\t') + 1)) << endl;
+	}
+
+	client.RequestStats();
+	string reply;
+	client.ReadReply(reply);
+	DaemonStats stats = daemon.Stats();
+	cout << "Daemon: " << stats.completed << " completed, " << stats.failed << " failed, " << stats.rejected
+	     << " rejected, " << stats.queued << " queued." << endl;
+
+	cout << "Stopping the daemon... ";
+	client.Close();
+	daemon.Stop();
+	server.join();
+	cout << "done." << endl;
+
+	cout << "Exiting TestDaemon.\n" << endl;
+}
+
+void TestLibrary() {
+	cout << "Entered TestLibrary" << endl;
+
+	// read the encoded input, as a service holding it in memory would
+	ifstream in("images-original/kkkk_nnkm-256x224.png", ios::binary);
+	vector<unsigned char> encoded((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+	qtreepng_params params;
+	qtreepng_default_params(&params);
+	params.tolerance = 0.05;
+	params.scale = 2;
+	params.rotations = 1;
+
+	cout << "Compressing PNG bytes in memory... ";
+	qtreepng::Compressor compressor;
+	vector<unsigned char> result;
+	qtreepng_status status = compressor.Compress(encoded.data(), encoded.size(), params, result);
+	cout << qtreepng_status_text(status) << "." << endl;
+
+	cout << "Compressing into a buffer too small to hold it... ";
+	unsigned char small[16];
+	size_t needed = 0;
+	qtreepng_context* context = qtreepng_create(16 << 20);
+	status = qtreepng_compress(context, encoded.data(), encoded.size(), &params, small, sizeof(small), &needed);
+	qtreepng_destroy(context);
+	cout << qtreepng_status_text(status) << ", " << (needed == result.size() ? "the right" : "the WRONG")
+	     << " size asked for." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-library-prune_0.05-rotateccw_x1-render_x2.png";
+	cout << "Writing compressed PNG to file... ";
+	ofstream out(outfilename, ios::binary);
+	out.write((const char*) result.data(), result.size());
+	cout << "done." << endl;
+
+	cout << "Exiting TestLibrary.\n" << endl;
+}
+
+void TestSharedMemory() {
+	cout << "Entered TestSharedMemory" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	CompressDaemon daemon("images-output/daemon.sock", 2, 64 << 20);
+	if (!daemon.Listen()) {
+		cout << "Exiting TestSharedMemory.\n" << endl;
+		return;
+	}
+	thread server([&daemon]() { daemon.Serve(); });
+
+	// lay the pixels out as a producer holding a decoded frame would
+	cout << "Copying pixels into a shared segment... ";
+	SharedImage image = { -1, 0, 0, false, input.width(), input.height(), input.width() * 4 };
+	image.size = image.stride * image.height;
+	image.fd = CreateSharedSegment("qtree-input", image.size);
+	unsigned char* pixels = (unsigned char*) mmap(nullptr, image.size, PROT_READ | PROT_WRITE, MAP_SHARED, image.fd, 0);
+	for (unsigned int y = 0; y < image.height; y++) {
+		for (unsigned int x = 0; x < image.width; x++) {
+			RGBAPixel* pixel = input.getPixel(x, y);
+			unsigned char* p = pixels + y * image.stride + 4 * x;
+			p[0] = pixel->r;
+			p[1] = pixel->g;
+			p[2] = pixel->b;
+			p[3] = (unsigned char) (pixel->a * 255 + 0.5);
+		}
+	}
+	munmap(pixels, image.size);
+	cout << "done." << endl;
+
+	SharedSegment result = { CreateSharedSegment("qtree-output", 1 << 20), 0, 1 << 20 };
+
+	cout << "Compressing from one segment into the other... ";
+	DaemonClient client;
+	client.Connect("images-output/daemon.sock");
+	client.CompressShared(image, result, CompressParams(0.02));
+	string reply;
+	client.ReadReply(reply);
+	cout << "done." << endl;
+	cout << "Reply: " << reply.substr(0, reply.find('\t', reply.find('\t') + 1)) << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-shared-prune_0.02-render_x1.png";
+	cout << "Writing the output segment to file... ";
+	size_t size = reply.compare(0, 2, "OK") == 0 ? strtoul(reply.c_str() + reply.find('\t', 3) + 1, nullptr, 10) : 0;
+	vector<char> encoded(size);
+	if (size > 0 && pread(result.fd, encoded.data(), size, 0) == (ssize_t) size) {
+		ofstream out(outfilename, ios::binary);
+		out.write(encoded.data(), size);
+	}
+	cout << "done." << endl;
+
+	client.Close();
+	close(image.fd);
+	close(result.fd);
+	daemon.Stop();
+	server.join();
+
+	cout << "Exiting TestSharedMemory.\n" << endl;
+}
+
+void TestMemoryGovernor() {
+	cout << "Entered TestMemoryGovernor" << endl;
+
+	// read both inputs, encoded, and predict their peaks from their headers
+	const char* names[] = { "images-original/kkkk_nnkm-256x224.png", "images-original/malachi-60x87.png" };
+	vector<vector<unsigned char> > files(2);
+	vector<uint64_t> peaks(2);
+	CompressParams params(0.02);
+	for (unsigned int i = 0; i < 2; i++) {
+		ifstream in(names[i], ios::binary);
+		files[i].assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+		PNGHeader header;
+		inspectPNG(files[i].data(), files[i].size(), header);
+		peaks[i] = MemoryGovernor::PredictPNG(header, files[i].size(), params);
+		cout << names[i] << ": " << header.width << "x" << header.height << ", predicted peak " << peaks[i]
+		     << " bytes." << endl;
+	}
+
+	// room for the big image alone, so the small one waits for it
+	MemoryGovernor governor(peaks[0]);
+	ResultCache cache(64 << 20);
+	vector<shared_ptr<const vector<unsigned char> > > results(2);
+	MemoryGrant big = governor.Admit(peaks[0]);
+
+	cout << "Compressing the small image while the big one holds the budget... ";
+	thread small([&]() {
+		MemoryReservation memory(governor, peaks[1]);
+		PNG img;
+		img.readFromBuffer(files[1].data(), files[1].size());
+		results[1] = cache.Encoded(img, params);
+	});
+	// the big job is let go only once the small one waits for it, so the
+	// counts are the same every run
+	while (governor.Stats().waited == 0) {
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	PNG img;
+	img.readFromBuffer(files[0].data(), files[0].size());
+	results[0] = cache.Encoded(img, params);
+	governor.Release(big);
+	small.join();
+	cout << "done." << endl;
+
+	GovernorStats stats = governor.Stats();
+	cout << "Governor: budget " << stats.budget << " bytes, at most " << stats.peakReserved << " reserved, "
+	     << stats.waited << " waited, " << stats.overtaken << " overtaken." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-governed-prune_0.02-render_x1.png";
+	cout << "Writing governed PNG to file... ";
+	ofstream out(outfilename, ios::binary);
+	out.write((const char*) results[0]->data(), results[0]->size());
+	cout << "done." << endl;
+
+	cout << "Exiting TestMemoryGovernor.\n" << endl;
+}
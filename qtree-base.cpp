@@ -3,6 +3,8 @@
  * @description partial implementation of QTree class used for storing image data
  */
 
+#include <cstring>
+
 #include "qtree.h"
 
  /**
@@ -18,6 +20,44 @@ Node::Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int>
 	NE = nullptr;
 	SW = nullptr;
 	SE = nullptr;
+
+	refs = 1;
+	Rehash();
+}
+
+/**
+ * Folds v into the running hash h.
+ */
+static uint64_t mixHash(uint64_t h, uint64_t v) {
+	v *= 0x9e3779b97f4a7c15ULL;
+	v ^= v >> 32;
+	h ^= v;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 29;
+	return h;
+}
+
+/**
+ * Recomputes hash from the node's width, height, average color and the
+ * hashes of its children. The node's position in the image is left out,
+ * so identical regions anywhere in an image hash alike.
+ * Must be called whenever a node's children or color change.
+ */
+void Node::Rehash() {
+	uint64_t alpha;
+	memcpy(&alpha, &avg.a, sizeof(alpha));
+
+	uint64_t h = mixHash(0, lowRight.first - upLeft.first);
+	h = mixHash(h, lowRight.second - upLeft.second);
+	h = mixHash(h, (uint64_t(avg.r) << 16) | (uint64_t(avg.g) << 8) | avg.b);
+	h = mixHash(h, alpha);
+
+	Node* children[4] = { NW, NE, SW, SE };
+	for (Node* child : children) {
+		h = mixHash(h, child ? child->hash : 0);
+	}
+
+	hash = h;
 }
 
 /**
@@ -42,6 +82,20 @@ QTree::QTree(const QTree& other) {
 	Copy(other);
 }
 
+/**
+ * Constructor that adopts an already built tree.
+ * @param nd root of the tree; the new QTree takes over its reference.
+ * @param w width of the image represented by the tree.
+ * @param h height of the image represented by the tree.
+ */
+QTree::QTree(Node* nd, unsigned int w, unsigned int h) {
+	root = nd;
+	width = w;
+	height = h;
+	deferClear = false;
+	resetPruneStats();
+}
+
 /**
  * Counts the number of nodes in the tree
  */
@@ -0,0 +1,533 @@
+/**
+ * @file qtree-batch.cpp
+ * @description implementation of BatchCompressor
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "qtree-batch.h"
+
+/**
+ * Tag on the first line of every manifest.
+ */
+static const char MANIFEST_MAGIC[] = "QTB1";
+
+/**
+ * Fewest inputs read ahead of the workers.
+ */
+static const size_t READ_AHEAD = 16;
+
+static string hex64(uint64_t v) {
+	char text[17];
+	snprintf(text, sizeof(text), "%016llx", (unsigned long long) v);
+	return text;
+}
+
+static bool parseU64(const string& text, int base, uint64_t& v) {
+	if (text.empty()) {
+		return false;
+	}
+	char* end;
+	errno = 0;
+	v = strtoull(text.c_str(), &end, base);
+	return errno == 0 && *end == '\0';
+}
+
+/**
+ * Runs body(i, worker) for every i below count, on workers threads.
+ */
+template <typename Body>
+static void parallelFor(size_t count, unsigned int workers, Body body) {
+	atomic<size_t> next(0);
+	vector<thread> pool;
+	for (unsigned int w = 0; w < workers; w++) {
+		pool.emplace_back([&next, &body, count, w]() {
+			for (size_t i = next++; i < count; i = next++) {
+				body(i, w);
+			}
+		});
+	}
+	for (thread& worker : pool) {
+		worker.join();
+	}
+}
+
+static bool parseI64(const string& text, int64_t& v) {
+	if (text.empty()) {
+		return false;
+	}
+	char* end;
+	errno = 0;
+	v = strtoll(text.c_str(), &end, 10);
+	return errno == 0 && *end == '\0';
+}
+
+/**
+ * Returns dir without trailing slashes or leading "./", so that the
+ * same directory spelled either way gives the same paths under it.
+ */
+static string trimDir(string dir) {
+	while (dir.size() > 1 && dir.back() == '/') {
+		dir.pop_back();
+	}
+	while (dir.size() > 2 && dir.compare(0, 2, "./") == 0) {
+		dir.erase(0, dir.find_first_not_of('/', 2));
+	}
+	return dir;
+}
+
+/**
+ * Loads the manifest at manifestPath, if there is one.
+ * @param manifestPath file the manifest is read from and saved to.
+ * @param cacheBytes budget of the ResultCache shared by the workers.
+ * @param memoryBytes memory the jobs running at once may take
+ *        together; 0 for half of the physical memory.
+ * @param useRing false to read and write through AsyncIO's thread pool
+ *        even if io_uring works.
+ */
+BatchCompressor::BatchCompressor(const string& manifestPath, size_t cacheBytes, uint64_t memoryBytes, bool useRing)
+	: manifestPath(manifestPath), cache(cacheBytes), io(AsyncIO::DEFAULT_DEPTH, useRing), readAhead(0),
+	  governor(memoryBytes, [this]() { return (uint64_t) cache.Stats().bytes + readAhead; }) {
+	LoadManifest();
+}
+
+/**
+ * Compresses every PNG under inputDir that is not already up to date
+ * in outputDir, then saves the manifest, forgetting inputs that are
+ * no longer there.
+ * @param inputDir directory searched, recursively, for .png files.
+ * @param outputDir directory the results are written under; created
+ *        if missing.
+ * @param params what to do to each image.
+ * @return counts of what was done.
+ */
+BatchStats BatchCompressor::Run(const string& inputDir, const string& outputDir, const CompressParams& params) {
+	BatchStats total = { 0, 0, 0, 0, 0 };
+	string inDir = trimDir(inputDir);
+	string outDir = trimDir(outputDir);
+
+	vector<string> files;
+	ListPNGs(inDir, "", files);
+	sort(files.begin(), files.end());
+	total.files = files.size();
+
+	if (!MakeParents(outDir + "/")) {
+		cerr << "BatchCompressor: cannot create " << outDir << endl;
+		total.failed = files.size();
+		return total;
+	}
+
+	unsigned int workers = max(1u, thread::hardware_concurrency());
+	workers = (unsigned int) min<size_t>(workers, max<size_t>(1, files.size()));
+	BatchStats zero = { 0, 0, 0, 0, 0 };
+	vector<BatchStats> counts(workers, zero);
+	string key = ParamsKey(params);
+
+	// first stat everything, which is all most files of a repeated run need
+	vector<Job> jobs(files.size());
+	vector<char> needed(files.size(), 0);
+	parallelFor(files.size(), workers, [&](size_t i, unsigned int w) {
+		Job& job = jobs[i];
+		job.name = files[i];
+		job.input = inDir + "/" + files[i];
+		job.output = outDir + "/" + files[i];
+		if (!Stamp(job.input, job.stamp)) {
+			counts[w].failed++;
+		} else if (UpToDate(key, job)) {
+			counts[w].skipped++;
+		} else {
+			needed[i] = 1;
+		}
+	});
+
+	// then read just the header of each of the rest, to turn away files
+	// that would not decode before any work is spent on them
+	vector<Job*> pending;
+	vector<future<IOResult> > headers;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (needed[i]) {
+			pending.push_back(&jobs[i]);
+			headers.push_back(io.Read(jobs[i].input, PNG_HEADER_BYTES));
+		}
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < pending.size(); i++) {
+		IOResult header = headers[i].get();
+		Job& job = *pending[i];
+		if (!header.ok || !inspectPNG(header.bytes.data(), header.bytes.size(), job.header)) {
+			cerr << "BatchCompressor: skipping unreadable " << job.input << endl;
+			total.failed++;
+			continue;
+		}
+		job.cost = PredictCost(job.header, params);
+		job.memory = MemoryGovernor::PredictPNG(job.header, job.stamp.size, params);
+		pending[kept++] = &job;
+	}
+	pending.resize(kept);
+
+	// and start the most expensive first, so that no big image is left
+	// to run alone at the end
+	stable_sort(pending.begin(), pending.end(), [](const Job* a, const Job* b) { return a->cost > b->cost; });
+
+	// the rest are read ahead of the workers, so that they seldom wait
+	// for storage, and their outputs are written behind them. Each worker
+	// takes the first job read that fits in memory beside the running
+	// ones, or else waits for the first job of all to fit, so that small
+	// jobs run around a big one instead of queueing behind it
+	vector<future<IOResult> > reads(pending.size());
+	vector<char> taken(pending.size(), 0);
+	size_t first = 0; // no job before it is left
+	size_t issued = 0;
+	size_t ahead = max<size_t>(READ_AHEAD, 2 * workers);
+	mutex readLock;
+	// jobs whose output is being written; each is finished, and its
+	// buffer dropped, by the first worker to find its write done
+	vector<Job*> writing;
+	mutex writeLock;
+	parallelFor(pending.size(), workers, [&](size_t, unsigned int w) {
+		size_t i;
+		MemoryGrant grant;
+		bool admitted = false;
+		future<IOResult> read;
+		{
+			lock_guard<mutex> guard(readLock);
+			while (taken[first]) {
+				first++;
+			}
+			for (; issued < pending.size() && issued <= first + ahead; issued++) {
+				reads[issued] = io.Read(pending[issued]->input);
+				readAhead += pending[issued]->stamp.size;
+			}
+			i = first;
+			for (size_t j = first; j < issued && !admitted; j++) {
+				if (!taken[j] && governor.TryAdmit(pending[j]->memory, grant)) {
+					i = j;
+					admitted = true;
+				}
+			}
+			taken[i] = 1;
+			read = move(reads[i]);
+			readAhead -= pending[i]->stamp.size;
+		}
+		if (!admitted) {
+			grant = governor.Admit(pending[i]->memory);
+		}
+		IOResult input = read.get();
+		Compress(*pending[i], input, params, key, counts[w]);
+		governor.Release(grant);
+
+		vector<Job*> done;
+		{
+			lock_guard<mutex> guard(writeLock);
+			if (pending[i]->written.valid()) {
+				writing.push_back(pending[i]);
+			}
+			size_t kept = 0;
+			for (Job* job : writing) {
+				if (job->written.wait_for(chrono::seconds(0)) == future_status::ready) {
+					done.push_back(job);
+				} else {
+					writing[kept++] = job;
+				}
+			}
+			writing.resize(kept);
+		}
+		for (Job* job : done) {
+			Finish(*job, counts[w]);
+		}
+	});
+
+	for (Job* job : writing) {
+		Finish(*job, total);
+	}
+
+	for (const BatchStats& stats : counts) {
+		total.compressed += stats.compressed;
+		total.skipped += stats.skipped;
+		total.rehashed += stats.rehashed;
+		total.failed += stats.failed;
+	}
+
+	// inputs deleted or renamed since an earlier run are not kept on
+	{
+		lock_guard<mutex> guard(lock);
+		for (auto it = manifest.begin(); it != manifest.end();) {
+			if (binary_search(files.begin(), files.end(), it->first)) {
+				++it;
+			} else {
+				it = manifest.erase(it);
+			}
+		}
+	}
+
+	SaveManifest();
+	return total;
+}
+
+/**
+ * Writes the manifest to its file, replacing the old one only once
+ * the new one is complete.
+ * @return true if the manifest was written successfully.
+ */
+bool BatchCompressor::SaveManifest() const {
+	vector<pair<string, ManifestEntry> > entries;
+	{
+		lock_guard<mutex> guard(lock);
+		entries.assign(manifest.begin(), manifest.end());
+	}
+	sort(entries.begin(), entries.end(),
+	     [](const pair<string, ManifestEntry>& a, const pair<string, ManifestEntry>& b) { return a.first < b.first; });
+
+	string temp = manifestPath + ".tmp";
+	{
+		ofstream out(temp.c_str(), ios::binary | ios::trunc);
+		out << MANIFEST_MAGIC << '\n';
+		for (const pair<string, ManifestEntry>& item : entries) {
+			const ManifestEntry& e = item.second;
+			out << item.first << '\t' << e.input.size << '\t' << e.input.mtime << '\t'
+			    << hex64(e.content.low) << '\t' << hex64(e.content.high) << '\t' << e.params << '\t'
+			    << e.output << '\t' << e.outputStamp.size << '\t' << e.outputStamp.mtime << '\t'
+			    << hex64(e.outputHash.low) << '\t' << hex64(e.outputHash.high) << '\n';
+		}
+		out.flush();
+		if (!out) {
+			cerr << "BatchCompressor: cannot write " << temp << endl;
+			return false;
+		}
+	}
+
+	if (rename(temp.c_str(), manifestPath.c_str()) != 0) {
+		cerr << "BatchCompressor: cannot replace " << manifestPath << endl;
+		return false;
+	}
+	return true;
+}
+
+void BatchCompressor::LoadManifest() {
+	ifstream in(manifestPath.c_str(), ios::binary);
+	if (!in) {
+		return;
+	}
+
+	string line;
+	if (!getline(in, line) || line != MANIFEST_MAGIC) {
+		cerr << "BatchCompressor: " << manifestPath << " is not a manifest; starting afresh" << endl;
+		return;
+	}
+
+	unsigned int lineNo = 1;
+	while (getline(in, line)) {
+		lineNo++;
+		vector<string> fields;
+		stringstream split(line);
+		string field;
+		while (getline(split, field, '\t')) {
+			fields.push_back(field);
+		}
+
+		ManifestEntry e;
+		bool ok = fields.size() == 11
+		          && parseU64(fields[1], 10, e.input.size) && parseI64(fields[2], e.input.mtime)
+		          && parseU64(fields[3], 16, e.content.low) && parseU64(fields[4], 16, e.content.high)
+		          && parseU64(fields[7], 10, e.outputStamp.size) && parseI64(fields[8], e.outputStamp.mtime)
+		          && parseU64(fields[9], 16, e.outputHash.low) && parseU64(fields[10], 16, e.outputHash.high);
+		if (!ok) {
+			// the file will simply be compressed again
+			cerr << "BatchCompressor: ignoring malformed line " << lineNo << " of " << manifestPath << endl;
+			continue;
+		}
+
+		e.params = fields[5];
+		e.output = fields[6];
+		manifest[fields[0]] = e;
+	}
+}
+
+/**
+ * Looks job's input up in the manifest, and decides whether its output
+ * can be left as it is on the strength of its stamp alone.
+ * @return true if the output is up to date.
+ */
+bool BatchCompressor::UpToDate(const string& key, Job& job) {
+	bool known;
+	{
+		lock_guard<mutex> guard(lock);
+		auto found = manifest.find(job.name);
+		known = found != manifest.end();
+		if (known) {
+			job.prev = found->second;
+		}
+	}
+
+	// the recorded output is only any use if it was made the same way
+	// and nobody has touched it since
+	FileStamp outStamp;
+	job.outputValid = known && job.prev.params == key && job.prev.output == job.output
+	                  && Stamp(job.output, outStamp) && outStamp == job.prev.outputStamp;
+	return job.outputValid && job.stamp == job.prev.input;
+}
+
+/**
+ * Decodes the bytes read for job and, unless the pixels are as
+ * recorded, compresses them and starts writing the result.
+ */
+void BatchCompressor::Compress(Job& job, const IOResult& input, const CompressParams& params, const string& key, BatchStats& stats) {
+	PNG img;
+	if (!input.ok) {
+		cerr << "BatchCompressor: cannot read " << job.input << ": " << strerror(input.error) << endl;
+		stats.failed++;
+		return;
+	}
+	if (!img.readFromBuffer(input.bytes.data(), input.bytes.size())) {
+		stats.failed++;
+		return;
+	}
+
+	ManifestEntry& entry = job.entry;
+	entry.input = job.stamp;
+	entry.content = contentHash128(img);
+	entry.params = key;
+	entry.output = job.output;
+
+	if (job.outputValid && entry.content == job.prev.content) {
+		// touched but not changed: only the recorded time moves on
+		entry.outputStamp = job.prev.outputStamp;
+		entry.outputHash = job.prev.outputHash;
+		stats.rehashed++;
+		lock_guard<mutex> guard(lock);
+		manifest[job.name] = entry;
+		return;
+	}
+
+	job.encoded = cache.Encoded(img, params);
+	if (!job.encoded || !MakeParents(job.output)) {
+		stats.failed++;
+		return;
+	}
+	job.entry.outputHash = bytesHash128(job.encoded->data(), job.encoded->size());
+	job.written = io.Write(job.output, job.encoded);
+}
+
+/**
+ * Waits for the output of job to be written, records it, and drops the
+ * job's hold on the encoded bytes.
+ */
+void BatchCompressor::Finish(Job& job, BatchStats& stats) {
+	IOResult written = job.written.get();
+	job.encoded.reset();
+	if (!written.ok) {
+		cerr << "BatchCompressor: cannot write " << job.output << ": " << strerror(written.error) << endl;
+		stats.failed++;
+		return;
+	}
+	if (!Stamp(job.output, job.entry.outputStamp)) {
+		stats.failed++;
+		return;
+	}
+	stats.compressed++;
+
+	lock_guard<mutex> guard(lock);
+	manifest[job.name] = job.entry;
+}
+
+/**
+ * Estimates the relative time it takes to compress an image with the
+ * given header.
+ */
+uint64_t BatchCompressor::PredictCost(const PNGHeader& header, const CompressParams& params) {
+	uint64_t pixels = (uint64_t) header.width * header.height;
+	// decoding inflates and unfilters bitsPerPixel per pixel, interlaced
+	// images in seven passes, and then expands every pixel to RGBA
+	uint64_t decode = pixels * (header.bitsPerPixel + (header.interlaced ? 16 : 0) + 32) / 8;
+	// building, pruning and turning the tree visit about 4/3 nodes per
+	// pixel; rendering and encoding touch every output pixel
+	uint64_t tree = pixels * 16;
+	uint64_t render = pixels * params.scale * params.scale * 8;
+	return decode + tree + render;
+}
+
+/**
+ * Returns the manifest's text form of params.
+ */
+string BatchCompressor::ParamsKey(const CompressParams& params) {
+	char text[96];
+	snprintf(text, sizeof(text), "tol=%.17g scale=%u rot=%u flip=%d",
+	         params.tolerance < 0 ? -1.0 : params.tolerance, params.scale, params.rotations % 4, params.flip ? 1 : 0);
+	return text;
+}
+
+/**
+ * Reads the size and modification time of path.
+ * @return false if path does not exist or is not a regular file.
+ */
+bool BatchCompressor::Stamp(const string& path, FileStamp& stamp) {
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+		return false;
+	}
+
+	stamp.size = (uint64_t) info.st_size;
+	stamp.mtime = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+	return true;
+}
+
+/**
+ * Appends the path of every .png file under dir, relative to dir.
+ */
+void BatchCompressor::ListPNGs(const string& dir, const string& prefix, vector<string>& found) {
+	string path = prefix.empty() ? dir : dir + "/" + prefix;
+	DIR* handle = opendir(path.c_str());
+	if (!handle) {
+		cerr << "BatchCompressor: cannot open directory " << path << endl;
+		return;
+	}
+
+	while (dirent* item = readdir(handle)) {
+		string name = item->d_name;
+		if (name == "." || name == "..") {
+			continue;
+		}
+		// tabs and newlines would break the manifest's lines
+		if (name.find_first_of("\t\n") != string::npos) {
+			cerr << "BatchCompressor: skipping " << path << "/" << name << endl;
+			continue;
+		}
+
+		string rel = prefix.empty() ? name : prefix + "/" + name;
+		struct stat info;
+		if (stat((dir + "/" + rel).c_str(), &info) != 0) {
+			continue;
+		}
+		if (S_ISDIR(info.st_mode)) {
+			ListPNGs(dir, rel, found);
+		} else if (S_ISREG(info.st_mode) && name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0) {
+			found.push_back(rel);
+		}
+	}
+	closedir(handle);
+}
+
+/**
+ * Creates every missing directory leading up to the file path.
+ */
+bool BatchCompressor::MakeParents(const string& path) {
+	for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1)) {
+		string dir = path.substr(0, slash);
+		if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+			return false;
+		}
+	}
+	return true;
+}
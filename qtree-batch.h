@@ -0,0 +1,200 @@
+/**
+ * @file qtree-batch.h
+ * @description declaration of BatchCompressor, which compresses every PNG
+ *              under a directory and skips the ones already up to date
+ */
+
+#ifndef _QTREE_BATCH_H_
+#define _QTREE_BATCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "qtree-cache.h"
+#include "qtree-io.h"
+#include "qtree-memory.h"
+
+/**
+ * Counts from one BatchCompressor::Run.
+ */
+struct BatchStats {
+    size_t files;      // PNG files found under the input directory
+    size_t compressed; // files compressed and written
+    size_t skipped;    // files skipped on size and modification time alone
+    size_t rehashed;   // files whose time changed but whose pixels did not
+    size_t failed;     // files that could not be read, compressed or written
+};
+
+/**
+ * BatchCompressor: runs every PNG under a directory through the
+ * compression pipeline, writing each result to the same relative path
+ * under an output directory.
+ *
+ * A manifest file remembers, for every input by its path under the
+ * input directory, its size, modification time and content hash, the
+ * parameters it was compressed with, and the size, modification time
+ * and hash of the output written for it; inputs gone from the directory
+ * are forgotten. A manifest therefore serves one input directory. On the
+ * next run an input is skipped outright if its size and time are as
+ * recorded and its output is still in place; if only its time changed
+ * it is decoded and hashed, and skipped if the pixels are the same. Only
+ * inputs that are new, changed, or wanted with other parameters are
+ * compressed again.
+ *
+ * Files are processed in parallel, and repeated images within a run are
+ * compressed once through a ResultCache. Every input is stat'ed first.
+ * The header alone is then read of each that must be decoded, so that
+ * files that would not decode are turned away early and the rest can
+ * be started largest first. Those are read ahead of the workers, and
+ * outputs written behind them, through AsyncIO, so that the workers
+ * spend their time compressing rather than waiting on storage.
+ *
+ * A MemoryGovernor decides how many run at once: each job's peak memory
+ * is predicted from its header, and a worker takes the first job, of
+ * those read ahead, that fits beside the ones running. If none does it
+ * waits for the first, and the other workers fill in around it with
+ * smaller jobs. The cache's entries and the inputs read ahead belong to
+ * no job, so the governor leaves them out of what it measures.
+ */
+class BatchCompressor {
+public:
+    /**
+     * Loads the manifest at manifestPath, if there is one.
+     * @param manifestPath file the manifest is read from and saved to.
+     * @param cacheBytes budget of the ResultCache shared by the workers.
+     * @param memoryBytes memory the jobs running at once may take
+     *        together; 0 for half of the physical memory.
+     * @param useRing false to read and write through AsyncIO's thread
+     *        pool even if io_uring works.
+     */
+    BatchCompressor(const string& manifestPath, size_t cacheBytes = 256 << 20, uint64_t memoryBytes = 0,
+                    bool useRing = true);
+
+    /**
+     * Compresses every PNG under inputDir that is not already up to date
+     * in outputDir, then saves the manifest, forgetting inputs that are
+     * no longer there.
+     * @param inputDir directory searched, recursively, for .png files.
+     * @param outputDir directory the results are written under; created
+     *        if missing.
+     * @param params what to do to each image.
+     * @return counts of what was done.
+     */
+    BatchStats Run(const string& inputDir, const string& outputDir, const CompressParams& params);
+
+    /**
+     * Writes the manifest to its file, replacing the old one only once
+     * the new one is complete.
+     * @return true if the manifest was written successfully.
+     */
+    bool SaveManifest() const;
+
+    /**
+     * Returns a snapshot of the memory governor's counters.
+     */
+    GovernorStats MemoryStats() const { return governor.Stats(); }
+
+    /**
+     * Returns true if files are read and written through io_uring.
+     */
+    bool UsingRing() const { return io.UsingRing(); }
+
+private:
+    // size and modification time of a file, as returned by stat
+    struct FileStamp {
+        uint64_t size;
+        int64_t mtime; // nanoseconds since the epoch
+
+        bool operator==(const FileStamp& other) const { return size == other.size && mtime == other.mtime; }
+    };
+
+    struct ManifestEntry {
+        FileStamp input;
+        Hash128 content; // contentHash128 of the decoded input
+        string params;   // ParamsKey of the parameters used
+        string output;   // path the result was written to
+        FileStamp outputStamp;
+        Hash128 outputHash; // bytesHash128 of the written file
+    };
+
+    // an input, and what became of it during a Run
+    struct Job {
+        string name;          // path under the input directory
+        string input;
+        string output;
+        FileStamp stamp;
+        bool outputValid;     // the recorded output is there, made the same way
+        ManifestEntry prev;   // what the manifest held, if anything
+        ManifestEntry entry;  // what it will hold
+        shared_ptr<const vector<unsigned char> > encoded; // held until the output is written
+        future<IOResult> written; // valid while the output is being written
+        PNGHeader header;     // of the input, once inspected
+        uint64_t cost;        // PredictCost of the input
+        uint64_t memory;      // MemoryGovernor::PredictPNG of the input
+    };
+
+    string manifestPath;
+    unordered_map<string, ManifestEntry> manifest; // by path under the input directory
+    mutable mutex lock;
+    ResultCache cache;
+    AsyncIO io;
+    atomic<uint64_t> readAhead; // bytes of inputs read and not yet taken by a worker
+    MemoryGovernor governor;
+
+    BatchCompressor(const BatchCompressor&) = delete;
+    BatchCompressor& operator=(const BatchCompressor&) = delete;
+
+    void LoadManifest();
+
+    /**
+     * Looks job's input up in the manifest, and decides whether its output
+     * can be left as it is on the strength of its stamp alone.
+     * @return true if the output is up to date.
+     */
+    bool UpToDate(const string& key, Job& job);
+
+    /**
+     * Decodes the bytes read for job and, unless the pixels are as
+     * recorded, compresses them and starts writing the result.
+     */
+    void Compress(Job& job, const IOResult& input, const CompressParams& params, const string& key, BatchStats& stats);
+
+    /**
+     * Waits for the output of job to be written, records it, and drops
+     * the job's hold on the encoded bytes.
+     */
+    void Finish(Job& job, BatchStats& stats);
+
+    /**
+     * Estimates the relative time it takes to compress an image with the
+     * given header.
+     */
+    static uint64_t PredictCost(const PNGHeader& header, const CompressParams& params);
+
+    /**
+     * Returns the manifest's text form of params.
+     */
+    static string ParamsKey(const CompressParams& params);
+
+    /**
+     * Reads the size and modification time of path.
+     * @return false if path does not exist or is not a regular file.
+     */
+    static bool Stamp(const string& path, FileStamp& stamp);
+
+    /**
+     * Appends the path of every .png file under dir, relative to dir.
+     */
+    static void ListPNGs(const string& dir, const string& prefix, vector<string>& found);
+
+    /**
+     * Creates every missing directory leading up to the file path.
+     */
+    static bool MakeParents(const string& path);
+};
+
+#endif
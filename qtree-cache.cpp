@@ -0,0 +1,244 @@
+/**
+ * @file qtree-cache.cpp
+ * @description implementation of ResultCache
+ */
+
+#include <cstring>
+
+#include "qtree-cache.h"
+
+CompressParams::CompressParams(double tol, unsigned int scale, unsigned int rotations, bool flip)
+	: tolerance(tol), scale(scale), rotations(rotations), flip(flip) {
+}
+
+bool ResultCache::Key::operator==(const Key& other) const {
+	return content == other.content && stage == other.stage && params.tolerance == other.params.tolerance
+	       && params.scale == other.params.scale && params.rotations == other.params.rotations && params.flip == other.params.flip;
+}
+
+size_t ResultCache::KeyHash::operator()(const Key& key) const {
+	// the content hash is already well mixed; fold the parameters into it
+	double tolerance = key.params.tolerance + 0.0;
+	uint64_t tolBits;
+	memcpy(&tolBits, &tolerance, sizeof(tolBits));
+
+	uint64_t h = key.content.low ^ (key.content.high * 0x9E3779B97F4A7C15ULL);
+	h ^= tolBits * 0xC2B2AE3D27D4EB4FULL;
+	h ^= ((uint64_t) key.params.scale << 8 | key.params.rotations << 2 | (key.params.flip ? 2 : 0) | key.stage) * 0x165667B19E3779F9ULL;
+	return (size_t) (h ^ (h >> 29));
+}
+
+/**
+ * Creates an empty cache.
+ * @param maxBytes budget for the estimated size of all entries.
+ */
+ResultCache::ResultCache(size_t maxBytes)
+	: maxBytes(maxBytes), bytes(0), hits(0), misses(0), joined(0), evictions(0) {
+}
+
+/**
+ * Returns the tree built from img.
+ */
+QTree ResultCache::Built(const ImageView& img) {
+	return QTree(*BuiltValue(img, contentHash128(img)).tree);
+}
+
+/**
+ * Returns the tree built from img, pruned with tolerance; a negative
+ * tolerance returns the unpruned tree.
+ */
+QTree ResultCache::Pruned(const ImageView& img, double tolerance) {
+	return QTree(*PrunedValue(img, contentHash128(img), tolerance).tree);
+}
+
+/**
+ * Returns img run through the whole pipeline and encoded as a PNG.
+ * @return the encoded bytes, or nullptr if encoding failed; failures
+ *         are not cached.
+ */
+shared_ptr<const vector<unsigned char> > ResultCache::Encoded(const ImageView& img, const CompressParams& params) {
+	if (params.scale == 0) {
+		cerr << "ResultCache::Encoded: scale must be at least 1" << endl;
+		return nullptr;
+	}
+	if (!QTree::RenderFits(img.width(), img.height(), params.scale)) {
+		cerr << "ResultCache::Encoded: scale " << params.scale << " is too large for a "
+		     << img.width() << "x" << img.height() << " image" << endl;
+		return nullptr;
+	}
+
+	return EncodedValue(img, contentHash128(img), params).bytes;
+}
+
+/**
+ * Returns a snapshot of the cache's counters.
+ */
+CacheStats ResultCache::Stats() const {
+	lock_guard<mutex> guard(lock);
+	CacheStats stats;
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.joined = joined;
+	stats.evictions = evictions;
+	stats.entries = entries.size();
+	stats.bytes = bytes;
+	return stats;
+}
+
+/**
+ * Drops every entry. Lookups in progress still complete.
+ */
+void ResultCache::Clear() {
+	list<Entry> dropped;
+	{
+		lock_guard<mutex> guard(lock);
+		dropped.swap(entries);
+		index.clear();
+		bytes = 0;
+	}
+}
+
+ResultCache::Value ResultCache::BuiltValue(const ImageView& img, const Hash128& content) {
+	Key key = { content, STAGE_BUILT, CompressParams(0.0, 0) };
+	return Lookup(key, [&img]() {
+		// a tree is freed wherever its last user lets go of it, often a
+		// request that evicted it; its copies inherit the setting
+		shared_ptr<QTree> tree = make_shared<QTree>(img);
+		tree->SetDeferredClear(true);
+
+		Value value;
+		value.tree = tree;
+		return value;
+	});
+}
+
+ResultCache::Value ResultCache::PrunedValue(const ImageView& img, const Hash128& content, double tolerance) {
+	if (tolerance < 0) {
+		return BuiltValue(img, content);
+	}
+
+	Key key = { content, STAGE_PRUNED, CompressParams(tolerance, 0) };
+	return Lookup(key, [this, &img, &content, tolerance]() {
+		shared_ptr<QTree> tree = make_shared<QTree>(*BuiltValue(img, content).tree);
+		tree->Prune(tolerance);
+
+		Value value;
+		value.tree = tree;
+		return value;
+	});
+}
+
+ResultCache::Value ResultCache::EncodedValue(const ImageView& img, const Hash128& content, const CompressParams& params) {
+	CompressParams normal(params.tolerance < 0 ? -1.0 : params.tolerance, params.scale, params.rotations % 4, params.flip);
+	Key key = { content, STAGE_ENCODED, normal };
+	return Lookup(key, [this, &img, &content, normal]() {
+		QTree tree(*PrunedValue(img, content, normal.tolerance).tree);
+		for (unsigned int i = 0; i < normal.rotations; i++) {
+			tree.RotateCCW();
+		}
+		if (normal.flip) {
+			tree.FlipHorizontal();
+		}
+
+		shared_ptr<vector<unsigned char> > encoded = make_shared<vector<unsigned char> >();
+		Value value;
+		if (tree.Render(normal.scale).writeToBuffer(*encoded)) {
+			value.bytes = encoded;
+		}
+		return value;
+	});
+}
+
+/**
+ * Returns the value for key, computing it with compute if it is
+ * neither cached nor being computed by another lookup. The lock is not
+ * held while computing, so computations for different keys, including
+ * the nested lookups of earlier stages, run in parallel. If compute
+ * throws, so does every lookup that was waiting for it.
+ */
+template <typename Compute>
+ResultCache::Value ResultCache::Lookup(const Key& key, Compute compute) {
+	unique_lock<mutex> guard(lock);
+
+	auto found = index.find(key);
+	if (found != index.end()) {
+		hits++;
+		entries.splice(entries.begin(), entries, found->second);
+		return found->second->value;
+	}
+
+	auto running = inflight.find(key);
+	if (running != inflight.end()) {
+		joined++;
+		Pending pending = running->second;
+		guard.unlock();
+		return pending.get();
+	}
+
+	misses++;
+	promise<Value> result;
+	inflight[key] = result.get_future().share();
+	guard.unlock();
+
+	Value value;
+	size_t size;
+	try {
+		value = compute();
+		size = (value.tree || value.bytes) ? SizeOf(value) : 0;
+	} catch (...) {
+		// the lookups waiting on this one fail with it, and the next one
+		// computes afresh instead of waiting for a result that never comes
+		guard.lock();
+		inflight.erase(key);
+		guard.unlock();
+		result.set_exception(current_exception());
+		throw;
+	}
+
+	vector<Value> dropped;
+	guard.lock();
+	inflight.erase(key);
+	if ((value.tree || value.bytes) && size <= maxBytes && index.find(key) == index.end()) {
+		entries.push_front(Entry{ key, value, size });
+		index[key] = entries.begin();
+		bytes += size;
+		Evict(dropped);
+	}
+	guard.unlock();
+
+	result.set_value(value);
+	return value;
+}
+
+/**
+ * Estimates the memory held by value. Trees count every node, including
+ * nodes they share with other entries, so the estimate errs on the high
+ * side. The cache deduplicates none of its trees, within which every
+ * node appears once, so CountNodes gives the count of CountUniqueNodes
+ * without building a set of every node.
+ */
+size_t ResultCache::SizeOf(const Value& value) {
+	size_t size = sizeof(Entry) + 4 * sizeof(void*); // the entry, its list links and its index node
+	if (value.tree) {
+		size += sizeof(QTree) + value.tree->CountNodes() * sizeof(Node);
+	}
+	if (value.bytes) {
+		size += sizeof(vector<unsigned char>) + value.bytes->capacity();
+	}
+	return size;
+}
+
+/**
+ * Drops least recently used entries until the cache fits its budget,
+ * moving them to dropped so they are freed after the lock is released.
+ */
+void ResultCache::Evict(vector<Value>& dropped) {
+	while (bytes > maxBytes && !entries.empty()) {
+		Entry& last = entries.back();
+		dropped.push_back(last.value);
+		bytes -= last.size;
+		index.erase(last.key);
+		entries.pop_back();
+		evictions++;
+	}
+}
@@ -0,0 +1,171 @@
+/**
+ * @file qtree-cache.h
+ * @description declaration of ResultCache, which keeps the results of
+ *              recent compressions in memory keyed by input and parameters
+ */
+
+#ifndef _QTREE_CACHE_H_
+#define _QTREE_CACHE_H_
+
+#include <cstddef>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "imgUtil/ContentHash.h"
+#include "qtree.h"
+
+/**
+ * What to do with an image: build its tree, Prune it with tolerance,
+ * turn it, Render it at scale and encode the result as a PNG.
+ */
+struct CompressParams {
+    double tolerance;       // Prune tolerance; negative to skip pruning
+    unsigned int scale;     // Render scale, at least 1
+    unsigned int rotations; // number of RotateCCW calls after pruning
+    bool flip;              // whether to FlipHorizontal after rotating
+
+    CompressParams(double tol = -1.0, unsigned int scale = 1, unsigned int rotations = 0, bool flip = false);
+};
+
+/**
+ * Snapshot of a ResultCache's counters.
+ */
+struct CacheStats {
+    std::size_t hits;      // lookups answered from the cache
+    std::size_t misses;    // lookups that had to compute their result
+    std::size_t joined;    // lookups that waited for an identical lookup already computing
+    std::size_t evictions; // entries dropped to stay within the byte budget
+    std::size_t entries;   // entries held now
+    std::size_t bytes;     // estimated size of the entries held now
+};
+
+/**
+ * ResultCache: a bounded, thread-safe cache of the results of the
+ * compression pipeline. Each stage is cached separately, keyed by the
+ * 128-bit content hash of the input image and the parameters that stage
+ * depends on:
+ *   - the built tree, by content alone;
+ *   - the pruned tree, by content and tolerance;
+ *   - the encoded PNG, by content and every CompressParams field.
+ * Later stages are computed from the cached earlier ones, so a new
+ * tolerance for a known image skips the build.
+ *
+ * Entries are evicted least recently used first once their estimated
+ * size exceeds the budget. Concurrent lookups of the same missing key
+ * share a single computation: the first computes, the others wait for
+ * its result.
+ *
+ * Trees are returned as copies that share nodes with the cached tree, so
+ * callers may modify them freely. The cache's trees, and so their
+ * copies, free their nodes on the NodeReclaimer (see SetDeferredClear),
+ * so that neither an eviction nor the end of a job pays for it.
+ */
+class ResultCache {
+public:
+    /**
+     * Creates an empty cache.
+     * @param maxBytes budget for the estimated size of all entries.
+     */
+    ResultCache(size_t maxBytes);
+
+    /**
+     * Returns the tree built from img.
+     */
+    QTree Built(const ImageView& img);
+
+    /**
+     * Returns the tree built from img, pruned with tolerance; a negative
+     * tolerance returns the unpruned tree.
+     */
+    QTree Pruned(const ImageView& img, double tolerance);
+
+    /**
+     * Returns img run through the whole pipeline and encoded as a PNG.
+     * @return the encoded bytes, or nullptr if encoding failed; failures
+     *         are not cached.
+     */
+    shared_ptr<const vector<unsigned char> > Encoded(const ImageView& img, const CompressParams& params);
+
+    /**
+     * Returns a snapshot of the cache's counters.
+     */
+    CacheStats Stats() const;
+
+    /**
+     * Drops every entry. Lookups in progress still complete.
+     */
+    void Clear();
+
+private:
+    enum Stage { STAGE_BUILT, STAGE_PRUNED, STAGE_ENCODED };
+
+    struct Key {
+        Hash128 content;
+        Stage stage;
+        CompressParams params; // only the fields the stage depends on; the rest are zero
+
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    // a cached result: a tree for the first two stages, bytes for the last
+    struct Value {
+        shared_ptr<const QTree> tree;
+        shared_ptr<const vector<unsigned char> > bytes;
+    };
+
+    struct Entry {
+        Key key;
+        Value value;
+        size_t size;
+    };
+
+    typedef shared_future<Value> Pending;
+
+    size_t maxBytes;
+    size_t bytes;
+    list<Entry> entries; // most recently used first
+    unordered_map<Key, list<Entry>::iterator, KeyHash> index;
+    unordered_map<Key, Pending, KeyHash> inflight;
+    mutable mutex lock;
+
+    size_t hits;
+    size_t misses;
+    size_t joined;
+    size_t evictions;
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    Value BuiltValue(const ImageView& img, const Hash128& content);
+    Value PrunedValue(const ImageView& img, const Hash128& content, double tolerance);
+    Value EncodedValue(const ImageView& img, const Hash128& content, const CompressParams& params);
+
+    /**
+     * Returns the value for key, computing it with compute if it is
+     * neither cached nor being computed by another lookup. If compute
+     * throws, so does every lookup that was waiting for it.
+     */
+    template <typename Compute>
+    Value Lookup(const Key& key, Compute compute);
+
+    /**
+     * Estimates the memory held by value.
+     */
+    static size_t SizeOf(const Value& value);
+
+    /**
+     * Drops least recently used entries until the cache fits its budget,
+     * moving them to dropped so they are freed after the lock is released.
+     */
+    void Evict(vector<Value>& dropped);
+};
+
+#endif
@@ -0,0 +1,919 @@
+/**
+ * @file qtree-daemon.cpp
+ * @description implementation of CompressDaemon and DaemonClient
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "qtree-daemon.h"
+
+/**
+ * Most jobs waiting for a worker; requests beyond it are rejected, so a
+ * client that outruns the workers learns of it instead of filling memory.
+ */
+static const size_t MAX_QUEUED_JOBS = 4096;
+
+/**
+ * Longest request line accepted; a client sending more is disconnected.
+ */
+static const size_t MAX_LINE = 16 << 10;
+
+/**
+ * Most descriptors taken from one message, and most a client may leave
+ * unclaimed by its requests; a client holding more is disconnected.
+ */
+static const size_t MAX_FDS = 16;
+
+/**
+ * Longest a reply waits for a client to make room for it; a client that
+ * reads no faster is cut off, so that it cannot hold up a worker.
+ */
+static const int REPLY_TIMEOUT_SECONDS = 10;
+
+static bool parseDouble(const string& text, double& v) {
+	if (text.empty()) {
+		return false;
+	}
+	char* end;
+	errno = 0;
+	v = strtod(text.c_str(), &end);
+	return errno == 0 && *end == '\0';
+}
+
+static bool parseUnsigned(const string& text, unsigned int& v) {
+	if (text.empty() || text[0] == '-') {
+		return false;
+	}
+	char* end;
+	errno = 0;
+	unsigned long parsed = strtoul(text.c_str(), &end, 10);
+	v = (unsigned int) parsed;
+	return errno == 0 && *end == '\0' && parsed == v;
+}
+
+static bool parseU64(const string& text, uint64_t& v) {
+	if (text.empty() || text[0] == '-') {
+		return false;
+	}
+	char* end;
+	errno = 0;
+	v = strtoull(text.c_str(), &end, 10);
+	return errno == 0 && *end == '\0';
+}
+
+/**
+ * Reads the four CompressParams fields starting at fields[first].
+ * @return what is wrong with them, or an empty string.
+ */
+static string parseParams(const vector<string>& fields, size_t first, CompressParams& params) {
+	unsigned int flip = 0;
+	if (!parseDouble(fields[first], params.tolerance) || !parseUnsigned(fields[first + 1], params.scale)
+	    || !parseUnsigned(fields[first + 2], params.rotations) || !parseUnsigned(fields[first + 3], flip) || flip > 1) {
+		return "bad parameters";
+	}
+	if (params.scale < 1) {
+		return "scale must be at least 1";
+	}
+	params.flip = flip == 1;
+	return "";
+}
+
+static uint64_t microsSince(chrono::steady_clock::time_point then, chrono::steady_clock::time_point now) {
+	return (uint64_t) chrono::duration_cast<chrono::microseconds>(now - then).count();
+}
+
+static bool fillAddress(const string& path, sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+		return false;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size());
+	return true;
+}
+
+static bool readAll(int fd, vector<unsigned char>& bytes) {
+	unsigned char chunk[64 << 10];
+	while (true) {
+		ssize_t n = read(fd, chunk, sizeof(chunk));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return false;
+		}
+		if (n == 0) {
+			return true;
+		}
+		bytes.insert(bytes.end(), chunk, chunk + n);
+	}
+}
+
+static bool writeAll(int fd, const unsigned char* data, size_t size) {
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/**
+ * Part of a shared segment mapped into memory, unmapped on destruction.
+ */
+struct SegmentMapping {
+	void* base;
+	size_t length;
+	unsigned char* data; // the first byte asked for
+
+	SegmentMapping() : base(MAP_FAILED), length(0), data(nullptr) {}
+
+	~SegmentMapping() {
+		if (base != MAP_FAILED) {
+			munmap(base, length);
+		}
+	}
+
+	/**
+	 * Maps size bytes of fd from offset on.
+	 * @return false, with error set, if fd is not a segment sealed against
+	 *         shrinking or does not hold that many bytes.
+	 */
+	bool Map(int fd, uint64_t offset, uint64_t size, bool writable, string& error) {
+		const char* which = writable ? "output" : "input";
+		// a segment that could shrink would turn our reads into SIGBUS
+		int seals = fcntl(fd, F_GET_SEALS);
+		struct stat info;
+		if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &info) != 0) {
+			error = string(which) + " segment is not sealed against shrinking";
+			return false;
+		}
+		if (size == 0 || offset > (uint64_t) info.st_size || size > (uint64_t) info.st_size - offset) {
+			error = string(which) + " does not fit its segment";
+			return false;
+		}
+
+		uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+		uint64_t skip = offset % page;
+		length = (size_t) (size + skip);
+		base = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, (off_t) (offset - skip));
+		if (base == MAP_FAILED) {
+			error = string("cannot map ") + which + ": " + strerror(errno);
+			return false;
+		}
+		data = (unsigned char*) base + skip;
+		return true;
+	}
+};
+
+/**
+ * Creates a memfd of size bytes, sealed so that it cannot shrink, to
+ * hand to CompressDaemon as a SharedImage or a SharedSegment.
+ * @return the descriptor, or -1 on failure.
+ */
+int CreateSharedSegment(const string& name, size_t size) {
+	int fd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, (off_t) size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+CompressDaemon::Connection::Connection(int fd) : fd(fd), requests(0) {
+}
+
+CompressDaemon::Connection::~Connection() {
+	for (int passed : fds) {
+		close(passed);
+	}
+	close(fd);
+}
+
+/**
+ * Creates a daemon; nothing is listened on until Listen.
+ * @param socketPath path of the Unix domain socket to listen on.
+ * @param threads number of workers; 0 for one per core.
+ * @param cacheBytes budget of the ResultCache shared by the workers.
+ * @param memoryBytes memory the jobs running at once may take
+ *        together; 0 for half of the physical memory.
+ */
+CompressDaemon::CompressDaemon(const string& socketPath, unsigned int threads, size_t cacheBytes, uint64_t memoryBytes)
+	: socketPath(socketPath), threads(threads ? threads : max(1u, thread::hardware_concurrency())),
+	  listenFd(-1), stopping(false), cache(cacheBytes),
+	  governor(memoryBytes, [this]() { return (uint64_t) cache.Stats().bytes; }), draining(false) {
+	memset(&stats, 0, sizeof(stats));
+	if (pipe2(wakeFds, O_CLOEXEC | O_NONBLOCK) != 0) {
+		cerr << "CompressDaemon: cannot create wake-up pipe" << endl;
+		wakeFds[0] = wakeFds[1] = -1;
+	}
+}
+
+CompressDaemon::~CompressDaemon() {
+	if (listenFd >= 0) {
+		close(listenFd);
+		unlink(socketPath.c_str());
+	}
+	if (wakeFds[0] >= 0) {
+		close(wakeFds[0]);
+		close(wakeFds[1]);
+	}
+}
+
+/**
+ * Binds and listens on the socket, replacing a stale socket file left
+ * at its path.
+ * @return true if the daemon is ready to Serve.
+ */
+bool CompressDaemon::Listen() {
+	sockaddr_un address;
+	if (!fillAddress(socketPath, address)) {
+		cerr << "CompressDaemon: socket path " << socketPath << " is empty or too long" << endl;
+		return false;
+	}
+	if (wakeFds[0] < 0) {
+		return false;
+	}
+
+	// a socket file left by a daemon that died is in the way; one that a
+	// live daemon still answers on, or anything else at the path, is not
+	// ours to remove
+	struct stat info;
+	if (lstat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+		DaemonClient probe;
+		if (probe.Connect(socketPath)) {
+			cerr << "CompressDaemon: another daemon is listening on " << socketPath << endl;
+			return false;
+		}
+		unlink(socketPath.c_str());
+	}
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd < 0 || bind(listenFd, (sockaddr*) &address, sizeof(address)) != 0 || listen(listenFd, 64) != 0) {
+		cerr << "CompressDaemon: cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+		if (listenFd >= 0) {
+			close(listenFd);
+			listenFd = -1;
+		}
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Accepts connections and runs jobs until Stop is called, then
+ * finishes the jobs already queued, answers them, and removes the
+ * socket file.
+ */
+void CompressDaemon::Serve() {
+	if (listenFd < 0) {
+		cerr << "CompressDaemon: Serve called before Listen" << endl;
+		return;
+	}
+
+	vector<thread> workers;
+	for (unsigned int w = 0; w < threads; w++) {
+		workers.emplace_back(&CompressDaemon::Work, this);
+	}
+
+	// one thread does all the reading, the workers do all the replying
+	vector<shared_ptr<Connection> > clients;
+	vector<pollfd> polled;
+	while (!stopping) {
+		polled.clear();
+		polled.push_back({ wakeFds[0], POLLIN, 0 });
+		polled.push_back({ listenFd, POLLIN, 0 });
+		for (const shared_ptr<Connection>& client : clients) {
+			polled.push_back({ client->fd, POLLIN, 0 });
+		}
+
+		if (poll(polled.data(), polled.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cerr << "CompressDaemon: poll failed: " << strerror(errno) << endl;
+			break;
+		}
+
+		if (polled[1].revents & POLLIN) {
+			int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd >= 0) {
+				timeval timeout = { REPLY_TIMEOUT_SECONDS, 0 };
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				clients.push_back(make_shared<Connection>(fd));
+			}
+		}
+
+		// clients accepted just now were not polled; they are past the end
+		size_t kept = 0;
+		for (size_t i = 0; i < clients.size(); i++) {
+			bool open = true;
+			if (i + 2 < polled.size() && polled[i + 2].revents) {
+				open = Receive(clients[i]);
+			}
+			if (open) {
+				clients[kept++] = clients[i];
+			}
+		}
+		clients.resize(kept);
+	}
+
+	close(listenFd);
+	listenFd = -1;
+	unlink(socketPath.c_str());
+
+	{
+		lock_guard<mutex> guard(lock);
+		draining = true;
+	}
+	ready.notify_all();
+	for (thread& worker : workers) {
+		worker.join();
+	}
+}
+
+/**
+ * Asks Serve to return. Safe to call from any thread or from a
+ * signal handler.
+ */
+void CompressDaemon::Stop() {
+	stopping = true;
+	if (wakeFds[1] >= 0) {
+		char wake = 0;
+		ssize_t ignored = write(wakeFds[1], &wake, 1);
+		(void) ignored;
+	}
+}
+
+/**
+ * Returns a snapshot of the daemon's counters.
+ */
+DaemonStats CompressDaemon::Stats() const {
+	lock_guard<mutex> guard(lock);
+	DaemonStats snapshot = stats;
+	snapshot.queued = jobs.size();
+	return snapshot;
+}
+
+/**
+ * Reads what a client has sent, handling every complete line.
+ * @return false once the client has hung up or misbehaved.
+ */
+bool CompressDaemon::Receive(const shared_ptr<Connection>& client) {
+	char data[4096];
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	iovec part = { data, sizeof(data) };
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t n = recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC);
+	if (n < 0 && errno == EINTR) {
+		return true;
+	}
+
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+			size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < count; i++) {
+				int passed;
+				memcpy(&passed, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+				client->fds.push_back(passed);
+			}
+		}
+	}
+	if (n <= 0 || (message.msg_flags & MSG_CTRUNC)) {
+		// hung up, or sent more descriptors than fit, which would leave
+		// the rest of its requests matched to the wrong ones
+		return false;
+	}
+
+	client->pending.append(data, n);
+	size_t start = 0;
+	for (size_t end = client->pending.find('\n'); end != string::npos; end = client->pending.find('\n', start)) {
+		Request(client, client->pending.substr(start, end - start));
+		start = end + 1;
+	}
+	client->pending.erase(0, start);
+	return client->pending.size() <= MAX_LINE && client->fds.size() <= MAX_FDS;
+}
+
+/**
+ * Handles one request line from client.
+ */
+void CompressDaemon::Request(const shared_ptr<Connection>& client, const string& line) {
+	uint64_t id = ++client->requests;
+	vector<string> fields;
+	stringstream split(line);
+	string field;
+	while (getline(split, field, '\t')) {
+		fields.push_back(field);
+	}
+
+	if (fields.size() == 1 && fields[0] == "STATS") {
+		DaemonStats now = Stats();
+		size_t finished = now.completed + now.failed;
+		Answer(client, "STATS\t" + to_string(id) + "\t" + to_string(now.completed) + "\t" + to_string(now.failed)
+		               + "\t" + to_string(now.rejected) + "\t" + to_string(now.queued) + "\t" + to_string(now.running)
+		               + "\t" + to_string(finished ? now.queueMicros / finished : 0)
+		               + "\t" + to_string(finished ? now.runMicros / finished : 0));
+		return;
+	}
+
+	Job job;
+	job.client = client;
+	job.id = id;
+	job.inputFd = job.outputFd = -1;
+	job.shared = false;
+	string error;
+	if (fields.empty() || (fields[0] != "COMPRESS" && fields[0] != "SHARED")) {
+		error = "unknown request";
+	} else if (fields[0] == "COMPRESS" && fields.size() != 7) {
+		error = "COMPRESS takes 6 fields";
+	} else if (fields[0] == "SHARED" && fields.size() != 13) {
+		error = "SHARED takes 12 fields";
+	} else if (fields[0] == "COMPRESS") {
+		job.input = fields[1];
+		job.output = fields[2];
+		// claim the descriptors even if the rest is wrong, so that the
+		// next request gets its own
+		if (job.input == "-" && !client->fds.empty()) {
+			job.inputFd = client->fds.front();
+			client->fds.pop_front();
+		}
+		if (job.output == "-" && !client->fds.empty()) {
+			job.outputFd = client->fds.front();
+			client->fds.pop_front();
+		}
+
+		error = parseParams(fields, 3, job.params);
+		if (error.empty() && ((job.input == "-" && job.inputFd < 0) || (job.output == "-" && job.outputFd < 0))) {
+			error = "no descriptor sent for -";
+		}
+	} else {
+		job.shared = true;
+		for (int* fd : { &job.inputFd, &job.outputFd }) {
+			if (!client->fds.empty()) {
+				*fd = client->fds.front();
+				client->fds.pop_front();
+			}
+		}
+
+		SharedImage& image = job.image;
+		SharedSegment& result = job.result;
+		image.fd = result.fd = -1;
+		image.png = fields[1] == "PNG";
+		if (fields[1] != "PNG" && fields[1] != "RGBA8") {
+			error = "format must be RGBA8 or PNG";
+		} else if (!parseU64(fields[2], image.offset) || !parseU64(fields[3], image.size)
+		           || !parseUnsigned(fields[4], image.width) || !parseUnsigned(fields[5], image.height)
+		           || !parseU64(fields[6], image.stride) || !parseU64(fields[7], result.offset)
+		           || !parseU64(fields[8], result.capacity)) {
+			error = "bad layout";
+		} else if (job.inputFd < 0 || job.outputFd < 0) {
+			error = "SHARED needs two descriptors";
+		} else if (image.size == 0 || result.capacity == 0) {
+			error = "empty segment";
+		} else if (!image.png && (image.width == 0 || image.height == 0 || image.stride / 4 < image.width
+		                          || image.size < (uint64_t) image.width * 4
+		                          || (image.size - (uint64_t) image.width * 4) / image.stride < image.height - 1)) {
+			// the last row ends at (height - 1) * stride + 4 * width
+			error = "raw image does not fit its size";
+		} else {
+			error = parseParams(fields, 9, job.params);
+		}
+		if (error.empty() && !image.png && !QTree::RenderFits(image.width, image.height, job.params.scale)) {
+			error = "scale too large for the image";
+		}
+	}
+
+	{
+		lock_guard<mutex> guard(lock);
+		if (error.empty() && jobs.size() >= MAX_QUEUED_JOBS) {
+			error = "queue full";
+		}
+		if (!error.empty()) {
+			stats.rejected++;
+		} else {
+			job.depth = jobs.size();
+			job.queuedAt = chrono::steady_clock::now();
+			jobs.push_back(job);
+		}
+	}
+
+	if (!error.empty()) {
+		if (job.inputFd >= 0) {
+			close(job.inputFd);
+		}
+		if (job.outputFd >= 0) {
+			close(job.outputFd);
+		}
+		Answer(client, "ERR\t" + to_string(id) + "\t" + error);
+		return;
+	}
+	ready.notify_one();
+}
+
+/**
+ * Sends the queued replies, and runs the queued jobs, until both queues
+ * are empty and draining.
+ */
+void CompressDaemon::Work() {
+	while (true) {
+		Job job;
+		pair<shared_ptr<Connection>, string> reply;
+		{
+			unique_lock<mutex> guard(lock);
+			ready.wait(guard, [this]() { return !jobs.empty() || !replies.empty() || draining; });
+			if (!replies.empty()) {
+				reply = move(replies.front());
+				replies.pop_front();
+			} else if (jobs.empty()) {
+				return;
+			} else {
+				job = jobs.front();
+				jobs.pop_front();
+				stats.running++;
+			}
+		}
+		if (reply.first) {
+			Reply(*reply.first, reply.second);
+		} else {
+			Run(job);
+		}
+	}
+}
+
+/**
+ * Runs one job and answers it. A job that throws, most likely for
+ * want of memory, is answered with ERR.
+ */
+void CompressDaemon::Run(Job& job) {
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+	string error;
+	size_t outBytes = 0;
+	try {
+		outBytes = job.shared ? RunShared(job, error) : RunFiles(job, error);
+	} catch (const exception& e) {
+		// most likely bad_alloc; the job fails, and the daemon carries on
+		error = string("cannot compress: ") + e.what();
+	}
+	if (job.inputFd >= 0) {
+		close(job.inputFd);
+	}
+	if (job.outputFd >= 0) {
+		close(job.outputFd);
+	}
+
+	chrono::steady_clock::time_point finished = chrono::steady_clock::now();
+	uint64_t queued = microsSince(job.queuedAt, started);
+	uint64_t ran = microsSince(started, finished);
+	{
+		lock_guard<mutex> guard(lock);
+		stats.running--;
+		if (error.empty()) {
+			stats.completed++;
+		} else {
+			stats.failed++;
+		}
+		stats.queueMicros += queued;
+		stats.runMicros += ran;
+	}
+
+	if (error.empty()) {
+		Reply(*job.client, "OK\t" + to_string(job.id) + "\t" + to_string(outBytes) + "\t" + to_string(queued)
+		                   + "\t" + to_string(ran) + "\t" + to_string(job.depth));
+	} else {
+		Reply(*job.client, "ERR\t" + to_string(job.id) + "\t" + error);
+	}
+}
+
+/**
+ * Compresses the input of job, a path or a descriptor, into its output.
+ * @return the size of the result, or 0 with error set.
+ */
+size_t CompressDaemon::RunFiles(Job& job, string& error) {
+	vector<unsigned char> bytes;
+	int fd = job.inputFd >= 0 ? job.inputFd : open(job.input.c_str(), O_RDONLY | O_CLOEXEC);
+	bool loaded = fd >= 0 && readAll(fd, bytes);
+	if (fd >= 0 && fd != job.inputFd) {
+		close(fd);
+	}
+
+	// the pixels are only decoded once there is memory for them
+	PNGHeader header;
+	if (!loaded || !inspectPNG(bytes.data(), bytes.size(), header)) {
+		error = job.inputFd >= 0 ? "cannot read input" : "cannot read " + job.input;
+		return 0;
+	}
+	if (!QTree::RenderFits(header.width, header.height, job.params.scale)) {
+		error = "scale too large for the image";
+		return 0;
+	}
+	MemoryReservation memory(governor, MemoryGovernor::PredictPNG(header, bytes.size(), job.params));
+
+	PNG img;
+	if (!img.readFromBuffer(bytes.data(), bytes.size())) {
+		error = job.inputFd >= 0 ? "cannot read input" : "cannot read " + job.input;
+		return 0;
+	}
+
+	shared_ptr<const vector<unsigned char> > encoded = cache.Encoded(img, job.params);
+	if (!encoded) {
+		error = "cannot encode";
+		return 0;
+	}
+
+	if (job.outputFd >= 0) {
+		if (!writeAll(job.outputFd, encoded->data(), encoded->size())) {
+			error = "cannot write output";
+			return 0;
+		}
+	} else {
+		ofstream out(job.output.c_str(), ios::binary | ios::trunc);
+		out.write((const char*) encoded->data(), encoded->size());
+		out.flush();
+		if (!out) {
+			error = "cannot write " + job.output;
+			return 0;
+		}
+	}
+	return encoded->size();
+}
+
+/**
+ * Compresses a shared input of job into its shared output.
+ * @return the size of the result, or 0 with error set.
+ */
+size_t CompressDaemon::RunShared(Job& job, string& error) {
+	SegmentMapping input;
+	if (!input.Map(job.inputFd, job.image.offset, job.image.size, false, error)) {
+		return 0;
+	}
+
+	// the encoded input stays in the segment, so only what is made from
+	// it is counted
+	uint64_t peak;
+	if (job.image.png) {
+		PNGHeader header;
+		if (!inspectPNG(input.data, job.image.size, header)) {
+			error = "cannot decode input";
+			return 0;
+		}
+		if (!QTree::RenderFits(header.width, header.height, job.params.scale)) {
+			error = "scale too large for the image";
+			return 0;
+		}
+		peak = MemoryGovernor::PredictPNG(header, 0, job.params);
+	} else {
+		peak = MemoryGovernor::PredictPixels(job.image.width, job.image.height, job.params);
+	}
+	MemoryReservation memory(governor, peak);
+
+	shared_ptr<const vector<unsigned char> > encoded;
+	if (job.image.png) {
+		PNG img;
+		if (!img.readFromBuffer(input.data, job.image.size)) {
+			error = "cannot decode input";
+			return 0;
+		}
+		encoded = cache.Encoded(img, job.params);
+	} else {
+		// the tree is built straight from the producer's pixels; the
+		// mapping is read-only, and nothing writes through the view
+		encoded = cache.Encoded(ImageView(input.data, job.image.width, job.image.height, job.image.stride), job.params);
+	}
+	if (!encoded) {
+		error = "cannot encode";
+		return 0;
+	}
+	if (encoded->size() > job.result.capacity) {
+		error = "output segment too small; " + to_string(encoded->size()) + " bytes needed";
+		return 0;
+	}
+
+	SegmentMapping output;
+	if (!output.Map(job.outputFd, job.result.offset, encoded->size(), true, error)) {
+		return 0;
+	}
+	memcpy(output.data, encoded->data(), encoded->size());
+	return encoded->size();
+}
+
+/**
+ * Queues a line for a worker to send to client, so that a client slow
+ * to read cannot stall the thread that serves the others.
+ */
+void CompressDaemon::Answer(const shared_ptr<Connection>& client, const string& line) {
+	{
+		lock_guard<mutex> guard(lock);
+		replies.emplace_back(client, line);
+	}
+	ready.notify_one();
+}
+
+/**
+ * Sends a line to client; a client that has gone away, or reads too
+ * slowly, is cut off.
+ */
+void CompressDaemon::Reply(Connection& client, const string& line) {
+	string text = line + "\n";
+	lock_guard<mutex> guard(client.writeLock);
+	size_t sent = 0;
+	while (sent < text.size()) {
+		ssize_t n = send(client.fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			// the rest of its replies then fail at once, and the poll
+			// thread drops the connection
+			shutdown(client.fd, SHUT_RDWR);
+			return;
+		}
+		sent += n;
+	}
+}
+
+DaemonClient::DaemonClient() : fd(-1) {
+}
+
+DaemonClient::~DaemonClient() {
+	Close();
+}
+
+/**
+ * Connects to the daemon listening at socketPath.
+ * @return true if connected.
+ */
+bool DaemonClient::Connect(const string& socketPath) {
+	Close();
+	sockaddr_un address;
+	if (!fillAddress(socketPath, address)) {
+		return false;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (sockaddr*) &address, sizeof(address)) != 0) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Sends a COMPRESS request. Does not wait for the reply.
+ * @param input path of the image to compress; ignored if inputFd is given.
+ * @param output path to write the result to; ignored if outputFd is given.
+ * @param params what to do to the image.
+ * @param inputFd descriptor to read the image from instead, or -1.
+ * @param outputFd descriptor to write the result to instead, or -1.
+ * @return true if the request was sent.
+ */
+bool DaemonClient::Compress(const string& input, const string& output, const CompressParams& params,
+                            int inputFd, int outputFd) {
+	vector<int> fds;
+	if (inputFd >= 0) {
+		fds.push_back(inputFd);
+	}
+	if (outputFd >= 0) {
+		fds.push_back(outputFd);
+	}
+
+	char numbers[96];
+	snprintf(numbers, sizeof(numbers), "%.17g\t%u\t%u\t%d", params.tolerance, params.scale, params.rotations,
+	         params.flip ? 1 : 0);
+	return Send(string("COMPRESS\t") + (inputFd >= 0 ? "-" : input) + "\t" + (outputFd >= 0 ? "-" : output) + "\t"
+	            + numbers, fds);
+}
+
+/**
+ * Sends a SHARED request, passing both descriptors. Does not wait for
+ * the reply. The input must stay unchanged until the reply comes.
+ * @return true if the request was sent.
+ */
+bool DaemonClient::CompressShared(const SharedImage& input, const SharedSegment& output, const CompressParams& params) {
+	char fields[256];
+	snprintf(fields, sizeof(fields), "%s\t%llu\t%llu\t%u\t%u\t%llu\t%llu\t%llu\t%.17g\t%u\t%u\t%d",
+	         input.png ? "PNG" : "RGBA8", (unsigned long long) input.offset, (unsigned long long) input.size,
+	         input.width, input.height, (unsigned long long) input.stride, (unsigned long long) output.offset,
+	         (unsigned long long) output.capacity, params.tolerance, params.scale, params.rotations, params.flip ? 1 : 0);
+	vector<int> fds;
+	fds.push_back(input.fd);
+	fds.push_back(output.fd);
+	return Send(string("SHARED\t") + fields, fds);
+}
+
+/**
+ * Sends a STATS request. Does not wait for the reply.
+ * @return true if the request was sent.
+ */
+bool DaemonClient::RequestStats() {
+	return Send("STATS", vector<int>());
+}
+
+/**
+ * Waits for the next reply line, without its newline.
+ * @return false if the connection was closed first.
+ */
+bool DaemonClient::ReadReply(string& reply) {
+	while (true) {
+		size_t end = pending.find('\n');
+		if (end != string::npos) {
+			reply = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			return true;
+		}
+		if (fd < 0) {
+			return false;
+		}
+
+		char data[4096];
+		ssize_t n = recv(fd, data, sizeof(data), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		pending.append(data, n);
+	}
+}
+
+/**
+ * Closes the connection.
+ */
+void DaemonClient::Close() {
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	pending.clear();
+}
+
+bool DaemonClient::Send(const string& line, const vector<int>& fds) {
+	if (fd < 0 || fds.size() > MAX_FDS || line.size() > MAX_LINE) {
+		return false;
+	}
+	string text = line + "\n";
+
+	// the descriptors ride on the first byte, so the daemon has them by
+	// the time it reads the end of the line
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	memset(control, 0, sizeof(control));
+	size_t sent = 0;
+	while (sent < text.size()) {
+		iovec part = { (void*) (text.data() + sent), text.size() - sent };
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &part;
+		message.msg_iovlen = 1;
+		if (sent == 0 && !fds.empty()) {
+			message.msg_control = control;
+			message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+			cmsghdr* header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+			memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+		}
+
+		ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
@@ -0,0 +1,311 @@
+/**
+ * @file qtree-daemon.h
+ * @description declaration of CompressDaemon, which takes compression jobs
+ *              over a Unix domain socket and runs them on a worker pool
+ *              that lives as long as the process
+ */
+
+#ifndef _QTREE_DAEMON_H_
+#define _QTREE_DAEMON_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "qtree-cache.h"
+#include "qtree-memory.h"
+
+/**
+ * Snapshot of a CompressDaemon's counters.
+ */
+struct DaemonStats {
+    size_t completed;      // jobs whose output was written
+    size_t failed;         // jobs that could not be read, compressed or written
+    size_t rejected;       // requests turned away: malformed, or the queue was full
+    size_t queued;         // jobs waiting for a worker now
+    size_t running;        // jobs being processed now
+    uint64_t queueMicros;  // total time finished jobs spent waiting for a worker
+    uint64_t runMicros;    // total time workers spent on finished jobs
+};
+
+/**
+ * An image held in a shared memory segment, such as a memfd, for
+ * CompressDaemon to read in place.
+ */
+struct SharedImage {
+    int fd;          // the segment; sealed with F_SEAL_SHRINK
+    uint64_t offset; // where the image starts in the segment
+    uint64_t size;   // bytes the image takes from offset on
+    bool png;        // an encoded PNG, rather than raw pixels
+    unsigned int width;  // raw pixels only: 4 bytes each, in RGBA order
+    unsigned int height;
+    uint64_t stride;     // raw pixels only: bytes from one row to the next
+};
+
+/**
+ * Where in a shared memory segment CompressDaemon writes a result.
+ */
+struct SharedSegment {
+    int fd;            // the segment; sealed with F_SEAL_SHRINK
+    uint64_t offset;   // where the result goes in the segment
+    uint64_t capacity; // bytes available from offset on
+};
+
+/**
+ * Creates a memfd of size bytes, sealed so that it cannot shrink, to
+ * hand to CompressDaemon as a SharedImage or a SharedSegment.
+ * @return the descriptor, or -1 on failure.
+ */
+int CreateSharedSegment(const string& name, size_t size);
+
+/**
+ * CompressDaemon: a long-running compressor that accepts jobs over a
+ * Unix domain socket, so that callers do not pay for starting a process
+ * per image and the ResultCache stays warm between images.
+ *
+ * The protocol is text, one request per line, fields separated by tabs:
+ *
+ *   COMPRESS <input> <output> <tolerance> <scale> <rotations> <flip>
+ *   SHARED <format> <offset> <size> <width> <height> <stride> <out offset> <out capacity>
+ *          <tolerance> <scale> <rotations> <flip>
+ *   STATS
+ *
+ * <input> and <output> are paths, or "-" for a file descriptor sent with
+ * the request as SCM_RIGHTS ancillary data: the input's first, then the
+ * output's. The remaining fields are those of CompressParams, flip being
+ * 0 or 1.
+ *
+ * SHARED takes the fields of a SharedImage and a SharedSegment, <format>
+ * being RGBA8 or PNG, and always comes with two descriptors: the input
+ * segment's, then the output's. The image is compressed where it lies,
+ * without being copied, and the result is written straight into the
+ * output segment; nothing but the request line goes through the socket.
+ * Both segments must be sealed against shrinking, as CreateSharedSegment
+ * does, so that a producer cannot pull the memory out from under a job.
+ *
+ * Each request on a connection is numbered from 1, and answered
+ * with one line that carries its number:
+ *
+ *   OK <n> <output bytes> <queue microseconds> <run microseconds> <queue depth>
+ *   ERR <n> <message>
+ *   STATS <n> <completed> <failed> <rejected> <queued> <running> <mean queue us> <mean run us>
+ *
+ * The queue depth is the number of jobs that were waiting when the job
+ * was queued. A connection may send many requests without waiting; jobs
+ * are answered as they finish, so replies may come back out of order.
+ *
+ * A MemoryGovernor keeps the jobs running at once within a memory
+ * budget: a worker reads its job's input, predicts the job's peak from
+ * the header, and waits if it does not fit beside the running jobs,
+ * while the other workers go on with jobs small enough to. The cache's
+ * entries belong to no job, so the governor leaves them out of what it
+ * measures.
+ */
+class CompressDaemon {
+public:
+    /**
+     * Creates a daemon; nothing is listened on until Listen.
+     * @param socketPath path of the Unix domain socket to listen on.
+     * @param threads number of workers; 0 for one per core.
+     * @param cacheBytes budget of the ResultCache shared by the workers.
+     * @param memoryBytes memory the jobs running at once may take
+     *        together; 0 for half of the physical memory.
+     */
+    CompressDaemon(const string& socketPath, unsigned int threads = 0, size_t cacheBytes = 256 << 20,
+                   uint64_t memoryBytes = 0);
+
+    ~CompressDaemon();
+
+    /**
+     * Binds and listens on the socket, replacing a stale socket file left
+     * at its path.
+     * @return true if the daemon is ready to Serve.
+     */
+    bool Listen();
+
+    /**
+     * Accepts connections and runs jobs until Stop is called, then
+     * finishes the jobs already queued, answers them, and removes the
+     * socket file.
+     */
+    void Serve();
+
+    /**
+     * Asks Serve to return. Safe to call from any thread or from a
+     * signal handler.
+     */
+    void Stop();
+
+    /**
+     * Returns a snapshot of the daemon's counters.
+     */
+    DaemonStats Stats() const;
+
+    /**
+     * Returns a snapshot of the memory governor's counters.
+     */
+    GovernorStats MemoryStats() const { return governor.Stats(); }
+
+private:
+    // one client; closed once the client hangs up and its last job is answered
+    struct Connection {
+        int fd;
+        string pending;     // bytes received after the last complete line
+        deque<int> fds;     // descriptors received and not yet claimed by a request
+        uint64_t requests;  // number of requests received so far
+        mutex writeLock;    // one reply at a time
+
+        Connection(int fd);
+        ~Connection();
+    };
+
+    struct Job {
+        shared_ptr<Connection> client;
+        uint64_t id;
+        string input;
+        string output;
+        int inputFd;  // -1 to read input
+        int outputFd; // -1 to write output
+        bool shared;  // read and write the segments passed as inputFd and outputFd
+        SharedImage image;     // layout of a shared input; its fd is unused
+        SharedSegment result;  // layout of a shared output; its fd is unused
+        CompressParams params;
+        chrono::steady_clock::time_point queuedAt;
+        size_t depth;
+    };
+
+    string socketPath;
+    unsigned int threads;
+    int listenFd;
+    int wakeFds[2]; // Stop writes to the second, Serve polls the first
+    atomic<bool> stopping;
+    ResultCache cache;
+    MemoryGovernor governor;
+
+    deque<Job> jobs;
+    deque<pair<shared_ptr<Connection>, string> > replies; // answers to requests that run no job
+    mutable mutex lock;
+    condition_variable ready;
+    bool draining;
+    DaemonStats stats;
+
+    CompressDaemon(const CompressDaemon&) = delete;
+    CompressDaemon& operator=(const CompressDaemon&) = delete;
+
+    /**
+     * Reads what a client has sent, handling every complete line.
+     * @return false once the client has hung up or misbehaved.
+     */
+    bool Receive(const shared_ptr<Connection>& client);
+
+    /**
+     * Handles one request line from client.
+     */
+    void Request(const shared_ptr<Connection>& client, const string& line);
+
+    /**
+     * Sends the queued replies, and runs the queued jobs, until both
+     * queues are empty and draining.
+     */
+    void Work();
+
+    /**
+     * Runs one job and answers it. A job that throws, most likely for
+     * want of memory, is answered with ERR.
+     */
+    void Run(Job& job);
+
+    /**
+     * Compresses the input of job, a path or a descriptor, into its output.
+     * @return the size of the result, or 0 with error set.
+     */
+    size_t RunFiles(Job& job, string& error);
+
+    /**
+     * Compresses a shared input of job into its shared output.
+     * @return the size of the result, or 0 with error set.
+     */
+    size_t RunShared(Job& job, string& error);
+
+    /**
+     * Queues a line for a worker to send to client, so that a client
+     * slow to read cannot stall the thread that serves the others.
+     */
+    void Answer(const shared_ptr<Connection>& client, const string& line);
+
+    /**
+     * Sends a line to client; a client that has gone away, or reads too
+     * slowly, is cut off.
+     */
+    static void Reply(Connection& client, const string& line);
+};
+
+/**
+ * DaemonClient: the client side of CompressDaemon's protocol.
+ */
+class DaemonClient {
+public:
+    DaemonClient();
+    ~DaemonClient();
+
+    /**
+     * Connects to the daemon listening at socketPath.
+     * @return true if connected.
+     */
+    bool Connect(const string& socketPath);
+
+    /**
+     * Sends a COMPRESS request. Does not wait for the reply.
+     * @param input path of the image to compress; ignored if inputFd is given.
+     * @param output path to write the result to; ignored if outputFd is given.
+     * @param params what to do to the image.
+     * @param inputFd descriptor to read the image from instead, or -1.
+     * @param outputFd descriptor to write the result to instead, or -1.
+     * @return true if the request was sent.
+     */
+    bool Compress(const string& input, const string& output, const CompressParams& params,
+                  int inputFd = -1, int outputFd = -1);
+
+    /**
+     * Sends a SHARED request, passing both descriptors. Does not wait for
+     * the reply. The input must stay unchanged until the reply comes.
+     * @return true if the request was sent.
+     */
+    bool CompressShared(const SharedImage& input, const SharedSegment& output, const CompressParams& params);
+
+    /**
+     * Sends a STATS request. Does not wait for the reply.
+     * @return true if the request was sent.
+     */
+    bool RequestStats();
+
+    /**
+     * Waits for the next reply line, without its newline.
+     * @return false if the connection was closed first.
+     */
+    bool ReadReply(string& reply);
+
+    /**
+     * Closes the connection.
+     */
+    void Close();
+
+private:
+    int fd;
+    string pending; // bytes received after the last complete reply
+
+    DaemonClient(const DaemonClient&) = delete;
+    DaemonClient& operator=(const DaemonClient&) = delete;
+
+    bool Send(const string& line, const vector<int>& fds);
+};
+
+#endif
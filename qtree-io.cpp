@@ -0,0 +1,516 @@
+/**
+ * @file qtree-io.cpp
+ * @description implementation of AsyncIO
+ *
+ * The ring is driven with the raw io_uring system calls, as laid out in
+ * <linux/io_uring.h>, so that nothing beyond the kernel headers is needed.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "qtree-io.h"
+
+/**
+ * Most bytes moved by one read or write step; larger files take several.
+ */
+static const size_t MAX_TRANSFER = 1 << 30;
+
+/**
+ * Files created by Write get these permissions, less the umask.
+ */
+static const mode_t FILE_MODE = 0644;
+
+/**
+ * Threads of the fallback pool per core, and at least: each spends most
+ * of its time blocked on storage, so a few more than the cores keep it
+ * busy without a thread per file in progress.
+ */
+static const unsigned int POOL_THREADS_PER_CORE = 2;
+static const unsigned int MIN_POOL_THREADS = 4;
+
+// user_data of the read that wakes the ring thread for new requests
+static const uint64_t WAKE_TAG = 0;
+
+struct AsyncIO::Request {
+	enum Step { OPEN, SIZE, TRANSFER, CLOSE, DONE };
+
+	bool write;
+	string path;
+	int fd;
+	Step step;
+	size_t done;                 // bytes moved so far
+	size_t limit;                // most bytes to read
+	vector<unsigned char> bytes; // read into
+	shared_ptr<const vector<unsigned char> > data; // written from
+	struct statx info;
+	int error;
+	promise<IOResult> result;
+
+	size_t Total() const { return write ? data->size() : bytes.size(); }
+
+	/**
+	 * Moves on to the next step, given what the current one returned:
+	 * a count or descriptor, or minus an errno. Any failure closes the
+	 * file, if open, and ends the request.
+	 */
+	void Advance(long res) {
+		if (res < 0 && step != CLOSE) {
+			error = (int) -res;
+			step = fd >= 0 ? CLOSE : DONE;
+			return;
+		}
+
+		switch (step) {
+			case OPEN:
+				fd = (int) res;
+				step = write ? (data->empty() ? CLOSE : TRANSFER) : SIZE;
+				break;
+			case SIZE:
+				bytes.resize((size_t) min<uint64_t>(info.stx_size, limit));
+				step = bytes.empty() ? CLOSE : TRANSFER;
+				break;
+			case TRANSFER:
+				if (res == 0) {
+					// the file shrank while being read; keep what there was
+					if (write) {
+						error = EIO;
+					}
+					bytes.resize(done);
+					step = CLOSE;
+					break;
+				}
+				done += res;
+				if (done >= Total()) {
+					step = CLOSE;
+				}
+				break;
+			case CLOSE:
+				if (res < 0 && !error) {
+					error = (int) -res;
+				}
+				fd = -1;
+				step = DONE;
+				break;
+			case DONE:
+				break;
+		}
+	}
+
+	/**
+	 * Does the current step with an ordinary blocking call.
+	 * @return what the matching ring operation would have.
+	 */
+	long Block() {
+		long res = 0;
+		switch (step) {
+			case OPEN:
+				res = open(path.c_str(), write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC, FILE_MODE);
+				break;
+			case SIZE: {
+				struct stat st;
+				res = fstat(fd, &st);
+				info.stx_size = (uint64_t) st.st_size;
+				break;
+			}
+			case TRANSFER: {
+				size_t count = min(Total() - done, MAX_TRANSFER);
+				res = write ? pwrite(fd, data->data() + done, count, (off_t) done)
+							: pread(fd, bytes.data() + done, count, (off_t) done);
+				break;
+			}
+			case CLOSE:
+				res = close(fd);
+				break;
+			case DONE:
+				break;
+		}
+		return res < 0 ? -errno : res;
+	}
+
+	/**
+	 * Fills sqe with the current step.
+	 */
+	void Prepare(io_uring_sqe* sqe) {
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->user_data = (uint64_t) (uintptr_t) this;
+		switch (step) {
+			case OPEN:
+				sqe->opcode = IORING_OP_OPENAT;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = (uint64_t) (uintptr_t) path.c_str();
+				sqe->open_flags = write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+				sqe->len = FILE_MODE;
+				break;
+			case SIZE:
+				sqe->opcode = IORING_OP_STATX;
+				sqe->fd = fd;
+				sqe->addr = (uint64_t) (uintptr_t) "";
+				sqe->statx_flags = AT_EMPTY_PATH;
+				sqe->len = STATX_SIZE;
+				sqe->off = (uint64_t) (uintptr_t) &info;
+				break;
+			case TRANSFER:
+				sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+				sqe->fd = fd;
+				sqe->addr = (uint64_t) (uintptr_t) (write ? data->data() + done : bytes.data() + done);
+				sqe->len = (uint32_t) min(Total() - done, MAX_TRANSFER);
+				sqe->off = done;
+				break;
+			case CLOSE:
+				sqe->opcode = IORING_OP_CLOSE;
+				sqe->fd = fd;
+				break;
+			case DONE:
+				break;
+		}
+	}
+
+	/**
+	 * Hands the outcome to whoever is waiting for it.
+	 */
+	void Finish() {
+		IOResult outcome;
+		outcome.ok = error == 0;
+		outcome.error = error;
+		outcome.bytes.swap(bytes);
+		result.set_value(move(outcome));
+	}
+};
+
+/**
+ * The submission and completion queues shared with the kernel.
+ */
+struct AsyncIO::Ring {
+	int fd;
+	void* sqMap;
+	size_t sqMapSize;
+	void* cqMap;
+	size_t cqMapSize;
+	io_uring_sqe* sqes;
+	size_t sqesSize;
+
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	io_uring_cqe* cqes;
+
+	/**
+	 * Sets up a ring with room for entries operations at once.
+	 * @return the ring, or null if io_uring, or one of the operations
+	 *         AsyncIO needs, is not available.
+	 */
+	static Ring* Open(unsigned int entries) {
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+		if (fd < 0) {
+			return nullptr;
+		}
+
+		// the operations arrived in different kernels; ask for each
+		vector<unsigned char> probeSpace(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+		io_uring_probe* probe = (io_uring_probe*) probeSpace.data();
+		bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+		for (int op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+			supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+		}
+		if (!supported) {
+			close(fd);
+			return nullptr;
+		}
+
+		Ring* ring = new Ring();
+		ring->fd = fd;
+		ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single) {
+			ring->sqMapSize = ring->cqMapSize = max(ring->sqMapSize, ring->cqMapSize);
+		}
+		ring->sqMap = mmap(nullptr, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		ring->cqMap = single ? ring->sqMap
+							 : mmap(nullptr, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		ring->sqes = (io_uring_sqe*) mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+			delete ring;
+			return nullptr;
+		}
+
+		char* sq = (char*) ring->sqMap;
+		char* cq = (char*) ring->cqMap;
+		ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+		ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+		ring->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+		ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+		ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+		ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+		ring->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+		ring->cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+		return ring;
+	}
+
+	~Ring() {
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, sqesSize);
+		}
+		if (cqMap != MAP_FAILED && cqMap != sqMap) {
+			munmap(cqMap, cqMapSize);
+		}
+		if (sqMap != MAP_FAILED) {
+			munmap(sqMap, sqMapSize);
+		}
+		close(fd);
+	}
+
+	/**
+	 * Returns the next free submission entry, or null if all are taken.
+	 * It is handed to the kernel by the next Enter.
+	 */
+	io_uring_sqe* Next() {
+		unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		unsigned tail = *sqTail;
+		if (tail - head > *sqMask) {
+			return nullptr;
+		}
+		unsigned index = tail & *sqMask;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		return &sqes[index];
+	}
+
+	/**
+	 * Submits every entry taken since the last call and waits for at
+	 * least one completion.
+	 */
+	void Enter() {
+		unsigned waiting = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		while (syscall(__NR_io_uring_enter, fd, waiting, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				cerr << "AsyncIO: io_uring_enter failed: " << strerror(errno) << endl;
+				return;
+			}
+			waiting = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	/**
+	 * Calls handle(user_data, res) for each completion, oldest first.
+	 */
+	template <typename Handle>
+	void Reap(Handle handle) {
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			io_uring_cqe& cqe = cqes[head & *cqMask];
+			handle(cqe.user_data, cqe.res);
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+};
+
+/**
+ * Starts the I/O thread or threads.
+ * @param depth most files in progress at once.
+ * @param useRing false to use the thread pool even if io_uring works.
+ */
+AsyncIO::AsyncIO(unsigned int depth, bool useRing)
+	: depth(max(1u, depth)), ring(nullptr), wakeFd(-1), stopping(false) {
+	if (useRing) {
+		wakeFd = eventfd(0, EFD_CLOEXEC);
+		// one entry per file in progress, and one for the wake-up read
+		ring = wakeFd >= 0 ? Ring::Open(this->depth + 1) : nullptr;
+	}
+
+	if (ring) {
+		threads.emplace_back(&AsyncIO::RingLoop, this);
+	} else {
+		unsigned int cores = max(1u, thread::hardware_concurrency());
+		unsigned int pool = min(this->depth, max(MIN_POOL_THREADS, POOL_THREADS_PER_CORE * cores));
+		for (unsigned int i = 0; i < pool; i++) {
+			threads.emplace_back(&AsyncIO::PoolLoop, this);
+		}
+	}
+}
+
+/**
+ * Finishes every operation already started, then stops.
+ */
+AsyncIO::~AsyncIO() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	if (ring) {
+		uint64_t one = 1;
+		ssize_t ignored = write(wakeFd, &one, sizeof(one));
+		(void) ignored;
+	}
+	ready.notify_all();
+	for (thread& t : threads) {
+		t.join();
+	}
+
+	delete ring;
+	if (wakeFd >= 0) {
+		close(wakeFd);
+	}
+}
+
+/**
+ * Starts reading the file at path.
+ * @param limit most bytes to read from the start of the file.
+ */
+future<IOResult> AsyncIO::Read(const string& path, size_t limit) {
+	Request* request = new Request();
+	request->write = false;
+	request->path = path;
+	request->limit = limit;
+	return Start(request);
+}
+
+/**
+ * Starts replacing the file at path with bytes. The file is created
+ * if missing; its directory must exist.
+ */
+future<IOResult> AsyncIO::Write(const string& path, shared_ptr<const vector<unsigned char> > bytes) {
+	Request* request = new Request();
+	request->write = true;
+	request->path = path;
+	request->data = bytes;
+	return Start(request);
+}
+
+future<IOResult> AsyncIO::Start(Request* request) {
+	request->fd = -1;
+	request->step = Request::OPEN;
+	request->done = 0;
+	request->error = 0;
+	future<IOResult> result = request->result.get_future();
+
+	{
+		lock_guard<mutex> guard(lock);
+		incoming.push_back(request);
+	}
+	if (ring) {
+		uint64_t one = 1;
+		ssize_t ignored = write(wakeFd, &one, sizeof(one));
+		(void) ignored;
+	} else {
+		ready.notify_one();
+	}
+	return result;
+}
+
+/**
+ * Drives every request through the ring until stopping and idle.
+ */
+void AsyncIO::RingLoop() {
+	deque<Request*> waiting; // requests whose next step found the ring full
+	unsigned int active = 0;
+	uint64_t wakeCount = 0;
+	bool wakeArmed = false;
+
+	while (true) {
+		bool stop;
+		{
+			lock_guard<mutex> guard(lock);
+			while (!incoming.empty() && active < depth) {
+				waiting.push_back(incoming.front());
+				incoming.pop_front();
+				active++;
+			}
+			stop = stopping && incoming.empty() && active == 0;
+		}
+		if (stop) {
+			break;
+		}
+
+		// every step that is ready goes to the kernel in the same call; a
+		// full ring has completions coming, so the wake-up read can wait
+		io_uring_sqe* sqe = wakeArmed ? nullptr : ring->Next();
+		if (sqe) {
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = wakeFd;
+			sqe->addr = (uint64_t) (uintptr_t) &wakeCount;
+			sqe->len = sizeof(wakeCount);
+			sqe->user_data = WAKE_TAG;
+			wakeArmed = true;
+		}
+		while (!waiting.empty() && (sqe = ring->Next())) {
+			waiting.front()->Prepare(sqe);
+			waiting.pop_front();
+		}
+
+		ring->Enter();
+		ring->Reap([&](uint64_t tag, int res) {
+			if (tag == WAKE_TAG) {
+				wakeArmed = false;
+				return;
+			}
+			Request* request = (Request*) (uintptr_t) tag;
+			request->Advance(res);
+			if (request->step == Request::DONE) {
+				request->Finish();
+				delete request;
+				active--;
+			} else {
+				waiting.push_back(request);
+			}
+		});
+	}
+
+	// the wake-up read writes into wakeCount, so see it finish first
+	while (wakeArmed) {
+		uint64_t one = 1;
+		ssize_t ignored = write(wakeFd, &one, sizeof(one));
+		(void) ignored;
+		ring->Enter();
+		ring->Reap([&](uint64_t tag, int) {
+			if (tag == WAKE_TAG) {
+				wakeArmed = false;
+			}
+		});
+	}
+}
+
+/**
+ * Runs requests one at a time with blocking calls until stopping and
+ * idle.
+ */
+void AsyncIO::PoolLoop() {
+	while (true) {
+		Request* request;
+		{
+			unique_lock<mutex> guard(lock);
+			ready.wait(guard, [this]() { return !incoming.empty() || stopping; });
+			if (incoming.empty()) {
+				return;
+			}
+			request = incoming.front();
+			incoming.pop_front();
+		}
+
+		while (request->step != Request::DONE) {
+			request->Advance(request->Block());
+		}
+		request->Finish();
+		delete request;
+	}
+}
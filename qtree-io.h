@@ -0,0 +1,108 @@
+/**
+ * @file qtree-io.h
+ * @description declaration of AsyncIO, which reads and writes whole files
+ *              in the background, many at a time
+ */
+
+#ifndef _QTREE_IO_H_
+#define _QTREE_IO_H_
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Outcome of one AsyncIO operation.
+ */
+struct IOResult {
+    bool ok;
+    int error;                   // errno of the step that failed, or 0
+    vector<unsigned char> bytes; // contents of the file, for reads
+};
+
+/**
+ * AsyncIO: whole-file reads and writes that run while the caller does
+ * something else, so that time spent waiting on slow storage overlaps
+ * with compression instead of adding to it.
+ *
+ * Every file goes through open, size (for reads), read or write, and
+ * close; many files are at some step at once. On Linux with io_uring,
+ * one thread drives all of them through a single ring, handing the
+ * kernel every step that is ready in one system call. Where io_uring is
+ * unavailable, a pool of threads, a couple per core, does the same steps
+ * with ordinary blocking calls, one file per thread.
+ */
+class AsyncIO {
+public:
+    /**
+     * Most files in progress at once, unless the caller says otherwise.
+     */
+    static const unsigned int DEFAULT_DEPTH = 64;
+
+    /**
+     * Starts the I/O thread or threads.
+     * @param depth most files in progress at once.
+     * @param useRing false to use the thread pool even if io_uring works.
+     */
+    AsyncIO(unsigned int depth = DEFAULT_DEPTH, bool useRing = true);
+
+    /**
+     * Finishes every operation already started, then stops.
+     */
+    ~AsyncIO();
+
+    /**
+     * Starts reading the file at path.
+     * @param limit most bytes to read from the start of the file.
+     */
+    future<IOResult> Read(const string& path, size_t limit = (size_t) -1);
+
+    /**
+     * Starts replacing the file at path with bytes. The file is created
+     * if missing; its directory must exist.
+     */
+    future<IOResult> Write(const string& path, shared_ptr<const vector<unsigned char> > bytes);
+
+    /**
+     * Returns true if operations go through io_uring.
+     */
+    bool UsingRing() const { return ring != nullptr; }
+
+private:
+    struct Request;
+    struct Ring;
+
+    unsigned int depth;
+    Ring* ring;                      // null when the thread pool is used
+    int wakeFd;                      // eventfd the ring thread waits on with its completions
+    deque<Request*> incoming;        // started and not yet taken by an I/O thread
+    mutex lock;
+    condition_variable ready;        // for the thread pool
+    bool stopping;
+    vector<thread> threads;
+
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+
+    future<IOResult> Start(Request* request);
+
+    /**
+     * Drives every request through the ring until stopping and idle.
+     */
+    void RingLoop();
+
+    /**
+     * Runs requests one at a time with blocking calls until stopping and
+     * idle.
+     */
+    void PoolLoop();
+};
+
+#endif
@@ -0,0 +1,351 @@
+/**
+ * @file qtree-memory.cpp
+ * @description implementation of MemoryGovernor
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "qtree-memory.h"
+
+/**
+ * Smallest prediction a measured peak is fed back for; below it, thread
+ * stacks and the allocator's slack outweigh the jobs themselves.
+ */
+static const uint64_t MIN_SAMPLE_BYTES = 16 << 20;
+
+/**
+ * Bounds of the correction, so that one odd sample cannot stall the
+ * governor or switch it off.
+ */
+static const double MIN_CORRECTION = 0.5;
+static const double MAX_CORRECTION = 4.0;
+
+const chrono::milliseconds MemoryGovernor::SAMPLE_INTERVAL(1000);
+
+/**
+ * Bytes each Node takes: the node, and the allocator's header in front
+ * of it.
+ */
+static const uint64_t NODE_BYTES = sizeof(Node) + sizeof(void*);
+
+/**
+ * Bytes per output pixel of encoding a render: the RGBA copy handed to
+ * lodepng, its filtered scanlines, and the deflated result, each at most
+ * 4 bytes a pixel.
+ */
+static const uint64_t ENCODE_BYTES = 12;
+
+/**
+ * Returns the number of nodes BuildNode makes for a width by height
+ * rectangle: it halves each side, the first half taking the odd pixel,
+ * down to single pixels. Only a handful of distinct sizes occur at each
+ * level, so they are counted once each.
+ */
+static uint64_t treeNodes(unsigned int width, unsigned int height, unordered_map<uint64_t, uint64_t>& counted) {
+	if (width <= 1 && height <= 1) {
+		return 1;
+	}
+	uint64_t key = (uint64_t) width << 32 | height;
+	auto found = counted.find(key);
+	if (found != counted.end()) {
+		return found->second;
+	}
+
+	unsigned int left = (width + 1) / 2;
+	unsigned int top = (height + 1) / 2;
+	uint64_t nodes = 1 + treeNodes(left, top, counted);
+	if (width == 1) {
+		nodes += treeNodes(1, height - top, counted);
+	} else {
+		nodes += treeNodes(width - left, top, counted);
+		if (height > 1) {
+			nodes += treeNodes(left, height - top, counted) + treeNodes(width - left, height - top, counted);
+		}
+	}
+	counted[key] = nodes;
+	return nodes;
+}
+
+/**
+ * Reads a size in kB from /proc/self/status, such as "VmRSS".
+ * @return the size in bytes, or 0 if it cannot be read.
+ */
+static uint64_t statusBytes(const string& field) {
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line)) {
+		if (line.compare(0, field.size(), field) == 0 && line.size() > field.size() && line[field.size()] == ':') {
+			return (uint64_t) strtoull(line.c_str() + field.size() + 1, nullptr, 10) << 10;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Resets the process's peak resident size to its resident size now.
+ * @return false if it cannot be reset.
+ */
+static bool resetPeak() {
+	ofstream reset("/proc/self/clear_refs");
+	reset << "5";
+	reset.flush();
+	return (bool) reset;
+}
+
+/**
+ * Creates a governor.
+ * @param budgetBytes bytes the running jobs may take together; 0 for
+ *        half of the physical memory.
+ * @param outsideBytes returns the bytes the process holds for none of
+ *        the jobs, and which may grow while they run, such as a cache's
+ *        entries; taken to be 0 when the governor is created.
+ */
+MemoryGovernor::MemoryGovernor(uint64_t budgetBytes, function<uint64_t()> outsideBytes)
+	: budget(budgetBytes), reserved(0), predicted(0), windowPredicted(0), baseline(0), running(0), measuring(false),
+	  correction(1.0), outside(outsideBytes), windowStart(chrono::steady_clock::now()) {
+	memset(&counts, 0, sizeof(counts));
+	if (budget == 0) {
+		long pages = sysconf(_SC_PHYS_PAGES);
+		long pageSize = sysconf(_SC_PAGE_SIZE);
+		budget = pages > 0 && pageSize > 0 ? (uint64_t) pages * pageSize / 2 : UINT64_MAX;
+	}
+	// without a reset the peak is the process's all-time one, and useless
+	if (resetPeak()) {
+		baseline = statusBytes("VmRSS");
+	}
+}
+
+/**
+ * Predicts the peak memory of compressing an encoded PNG.
+ * @param header the PNG's header, as read by inspectPNG.
+ * @param encodedBytes size of the encoded PNG.
+ * @param params what is to be done to the image.
+ */
+uint64_t MemoryGovernor::PredictPNG(const PNGHeader& header, uint64_t encodedBytes, const CompressParams& params) {
+	uint64_t pixels = (uint64_t) header.width * header.height;
+	// lodepng inflates the scanlines, a filter byte in front of each, and
+	// unfilters them into RGBA; interlaced images go through a second
+	// buffer as big as the first
+	uint64_t scanlines = header.height * (1 + ((uint64_t) header.width * header.bitsPerPixel + 7) / 8);
+	uint64_t decode = scanlines * (header.interlaced ? 2 : 1) + pixels * 4;
+	// the PNG it all ends up in stays alive beside the tree
+	uint64_t decoded = pixels * sizeof(RGBAPixel);
+	return encodedBytes + decode + decoded + PredictPixels(header.width, header.height, params);
+}
+
+/**
+ * Predicts the peak memory of compressing pixels already in memory,
+ * such as an ImageView over a shared segment.
+ */
+uint64_t MemoryGovernor::PredictPixels(unsigned int width, unsigned int height, const CompressParams& params) {
+	unordered_map<uint64_t, uint64_t> counted;
+	uint64_t tree = width && height ? treeNodes(width, height, counted) * NODE_BYTES : 0;
+	uint64_t rendered = (uint64_t) width * height * params.scale * params.scale;
+	return tree + rendered * (sizeof(RGBAPixel) + ENCODE_BYTES);
+}
+
+/**
+ * Waits until a job with the predicted peak can run, and sets memory
+ * aside for it.
+ * @return what was set aside, to hand back to Release.
+ */
+MemoryGrant MemoryGovernor::Admit(uint64_t peak) {
+	unique_lock<mutex> guard(lock);
+	Waiter self = { { peak, (uint64_t) (peak * correction) }, 0, false };
+	if (StartNow(self.grant)) {
+		return self.grant;
+	}
+
+	waiting.push_back(&self);
+	counts.waited++;
+	admitted.wait(guard, [&self]() { return self.admitted; });
+	return self.grant;
+}
+
+/**
+ * Sets memory aside for a job with the predicted peak only if it can
+ * run now.
+ * @return true if grant was filled in and the job may run.
+ */
+bool MemoryGovernor::TryAdmit(uint64_t peak, MemoryGrant& grant) {
+	lock_guard<mutex> guard(lock);
+	MemoryGrant asked = { peak, (uint64_t) (peak * correction) };
+	if (!StartNow(asked)) {
+		return false;
+	}
+	grant = asked;
+	return true;
+}
+
+/**
+ * Hands back the memory set aside for a job that has finished, and
+ * admits what was waiting for it.
+ */
+void MemoryGovernor::Release(const MemoryGrant& grant) {
+	unique_lock<mutex> guard(lock);
+	reserved -= grant.reserved;
+	predicted -= grant.predicted;
+	running--;
+	Wake();
+	Measure(guard);
+}
+
+/**
+ * Returns a snapshot of the governor's counters.
+ */
+GovernorStats MemoryGovernor::Stats() const {
+	lock_guard<mutex> guard(lock);
+	GovernorStats stats = counts;
+	stats.budget = budget;
+	stats.reserved = reserved;
+	stats.running = running;
+	stats.correction = correction;
+	return stats;
+}
+
+/**
+ * Returns true if a job reserving bytes fits beside the running ones,
+ * whatever is waiting.
+ */
+bool MemoryGovernor::Fits(uint64_t bytes) const {
+	// a job bigger than the whole budget still runs, alone
+	return running == 0 || (reserved <= budget && bytes <= budget - reserved);
+}
+
+/**
+ * Starts a job that has just asked, if it fits and may go ahead of what
+ * is waiting. The lock must be held.
+ * @return true if the job was started.
+ */
+bool MemoryGovernor::StartNow(const MemoryGrant& grant) {
+	if (!Fits(grant.reserved) || (!waiting.empty() && waiting.front()->overtaken >= MAX_OVERTAKES)) {
+		return false;
+	}
+	if (!waiting.empty()) {
+		waiting.front()->overtaken++;
+		counts.overtaken++;
+	}
+	Start(grant);
+	return true;
+}
+
+/**
+ * Records a job as running. The lock must be held.
+ */
+void MemoryGovernor::Start(const MemoryGrant& grant) {
+	running++;
+	reserved += grant.reserved;
+	predicted += grant.predicted;
+	windowPredicted = max(windowPredicted, predicted);
+	counts.peakReserved = max(counts.peakReserved, reserved);
+}
+
+/**
+ * Admits the waiting jobs that can run now, in order, letting jobs
+ * behind the first overtake it while it does not fit. The lock must
+ * be held.
+ */
+void MemoryGovernor::Wake() {
+	bool any = false;
+	while (!waiting.empty() && Fits(waiting.front()->grant.reserved)) {
+		Waiter* front = waiting.front();
+		waiting.pop_front();
+		Start(front->grant);
+		front->admitted = true;
+		any = true;
+	}
+
+	if (!waiting.empty()) {
+		Waiter* front = waiting.front();
+		for (auto it = next(waiting.begin()); it != waiting.end() && front->overtaken < MAX_OVERTAKES;) {
+			if (!Fits((*it)->grant.reserved)) {
+				++it;
+				continue;
+			}
+			Start((*it)->grant);
+			(*it)->admitted = true;
+			it = waiting.erase(it);
+			front->overtaken++;
+			counts.overtaken++;
+			any = true;
+		}
+	}
+
+	if (any) {
+		admitted.notify_all();
+	}
+}
+
+/**
+ * Samples the peak resident size if the last sample is at least
+ * SAMPLE_INTERVAL old, and starts the next window; when idle, returns
+ * free heap to the system first. The lock must be held; it is let go
+ * while /proc is read and written.
+ */
+void MemoryGovernor::Measure(unique_lock<mutex>& guard) {
+	if (measuring || chrono::steady_clock::now() - windowStart < SAMPLE_INTERVAL) {
+		return;
+	}
+	measuring = true;
+	bool idle = running == 0;
+	uint64_t window = windowPredicted;
+	guard.unlock();
+
+	uint64_t peak = statusBytes("VmHWM");
+	// a cache fills up as the process warms up, and what it holds is no
+	// running job's
+	uint64_t held = outside ? outside() : 0;
+#if defined(__GLIBC__)
+	// otherwise memory freed by the last jobs still counts as resident,
+	// and the next ones, reusing it, seem to need none
+	malloc_trim(0);
+#endif
+	bool reset = resetPeak();
+	uint64_t resident = statusBytes("VmRSS");
+
+	guard.lock();
+	Sample(peak, held, window);
+	if (!reset) {
+		baseline = 0;
+	} else if (idle && running == 0) {
+		baseline = resident > held ? resident - held : 0;
+	}
+	// the jobs that started meanwhile count towards the next window
+	windowPredicted = predicted;
+	windowStart = chrono::steady_clock::now();
+	measuring = false;
+}
+
+/**
+ * Feeds a peak resident size back into the correction. The lock must be
+ * held.
+ * @param peak the process's peak resident size over the window.
+ * @param held the outside bytes at its end.
+ * @param window the most predicted for the jobs running at once.
+ */
+void MemoryGovernor::Sample(uint64_t peak, uint64_t held, uint64_t window) {
+	if (baseline == 0 || peak <= baseline + held || window < MIN_SAMPLE_BYTES) {
+		return;
+	}
+
+	double ratio = (double) (peak - baseline - held) / window;
+	// running short of memory is worse than leaving some unused, so a
+	// larger error is believed at once and a smaller one slowly
+	if (ratio > correction) {
+		correction = ratio;
+	} else {
+		correction += (ratio - correction) / 8;
+	}
+	correction = min(MAX_CORRECTION, max(MIN_CORRECTION, correction));
+	counts.samples++;
+}
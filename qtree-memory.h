@@ -0,0 +1,220 @@
+/**
+ * @file qtree-memory.h
+ * @description declaration of MemoryGovernor, which keeps the jobs running
+ *              at once within a memory budget
+ */
+
+#ifndef _QTREE_MEMORY_H_
+#define _QTREE_MEMORY_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+
+#include "qtree-cache.h"
+
+/**
+ * Memory set aside for one job by MemoryGovernor::Admit.
+ */
+struct MemoryGrant {
+    uint64_t predicted; // the job's peak as the model predicts it
+    uint64_t reserved;  // what was set aside: predicted, corrected by what was measured
+};
+
+/**
+ * Snapshot of a MemoryGovernor's counters.
+ */
+struct GovernorStats {
+    uint64_t budget;       // bytes the running jobs may take together
+    uint64_t reserved;     // bytes set aside for the jobs running now
+    uint64_t peakReserved; // most bytes ever set aside at once
+    size_t running;        // jobs admitted and not yet released
+    size_t waited;         // jobs that had to wait to be admitted
+    size_t overtaken;      // jobs admitted ahead of a bigger one that was waiting
+    size_t samples;        // peaks measured and fed back into the correction
+    double correction;     // measured peak over predicted peak, as learned so far
+};
+
+/**
+ * MemoryGovernor: admits compression jobs only while the memory they
+ * are predicted to need, added up, fits within a budget, so that a run
+ * of large images waits for memory rather than exhausting it.
+ *
+ * A job's peak is predicted from its header alone, from what the
+ * pipeline holds at once: the encoded input, the decoded PNG and the
+ * decoder's scratch, every Node of the tree, and the rendered and
+ * re-encoded output. The tree's node count follows BuildNode's splits
+ * exactly, so images whose sides are not powers of two are not
+ * underestimated.
+ *
+ * A job that does not fit waits, and smaller jobs that do fit are
+ * admitted around it, though only MAX_OVERTAKES of them before it
+ * comes first. A job bigger than the whole budget runs once nothing
+ * else is.
+ *
+ * The model does not know everything, so what the jobs really take is
+ * measured and fed back. At most once a SAMPLE_INTERVAL, as a job is
+ * released, the governor reads the process's peak resident size and
+ * resets it: the peak, less the resident size when the governor was
+ * last idle and less what the caller's outside bytes (a cache, say) have
+ * grown by, over the most that was predicted for the jobs running at
+ * once, is a sample of the model's error, and every later prediction is
+ * scaled by it. A larger error is taken at once, and a smaller one only
+ * gradually. /proc is read and written, and the heap trimmed, with no
+ * lock held. The peak resident size belongs to the whole process, so
+ * the samples are only meaningful with one busy governor per process.
+ */
+class MemoryGovernor {
+public:
+    /**
+     * Most jobs admitted ahead of the job at the front of the queue.
+     */
+    static const size_t MAX_OVERTAKES = 16;
+
+    /**
+     * Shortest time between two samples of the peak resident size.
+     */
+    static const chrono::milliseconds SAMPLE_INTERVAL;
+
+    /**
+     * Creates a governor.
+     * @param budgetBytes bytes the running jobs may take together; 0 for
+     *        half of the physical memory.
+     * @param outsideBytes returns the bytes the process holds for none of
+     *        the jobs, and which may grow while they run, such as a
+     *        cache's entries; taken to be 0 when the governor is created.
+     */
+    MemoryGovernor(uint64_t budgetBytes = 0, function<uint64_t()> outsideBytes = nullptr);
+
+    /**
+     * Predicts the peak memory of compressing an encoded PNG.
+     * @param header the PNG's header, as read by inspectPNG.
+     * @param encodedBytes size of the encoded PNG.
+     * @param params what is to be done to the image.
+     */
+    static uint64_t PredictPNG(const PNGHeader& header, uint64_t encodedBytes, const CompressParams& params);
+
+    /**
+     * Predicts the peak memory of compressing pixels already in memory,
+     * such as an ImageView over a shared segment.
+     */
+    static uint64_t PredictPixels(unsigned int width, unsigned int height, const CompressParams& params);
+
+    /**
+     * Waits until a job with the predicted peak can run, and sets memory
+     * aside for it.
+     * @return what was set aside, to hand back to Release.
+     */
+    MemoryGrant Admit(uint64_t peak);
+
+    /**
+     * Sets memory aside for a job with the predicted peak only if it can
+     * run now.
+     * @return true if grant was filled in and the job may run.
+     */
+    bool TryAdmit(uint64_t peak, MemoryGrant& grant);
+
+    /**
+     * Hands back the memory set aside for a job that has finished, and
+     * admits what was waiting for it.
+     */
+    void Release(const MemoryGrant& grant);
+
+    /**
+     * Returns a snapshot of the governor's counters.
+     */
+    GovernorStats Stats() const;
+
+private:
+    // a job waiting in Admit
+    struct Waiter {
+        MemoryGrant grant; // corrected when the job asked, and not again
+        size_t overtaken;  // jobs admitted ahead of this one while it waited
+        bool admitted;
+    };
+
+    uint64_t budget;
+    uint64_t reserved;
+    uint64_t predicted;       // sum of the running jobs' predicted peaks
+    uint64_t windowPredicted; // most of predicted since the last sample
+    uint64_t baseline;        // resident size less outside bytes when the governor was last idle; 0 if unknown
+    size_t running;
+    bool measuring;           // a thread is sampling, with the lock let go
+    double correction;
+    function<uint64_t()> outside;
+    chrono::steady_clock::time_point windowStart; // of the last sample
+    list<Waiter*> waiting;
+    mutable mutex lock;
+    condition_variable admitted;
+    GovernorStats counts; // waited, overtaken, samples and peakReserved only
+
+    MemoryGovernor(const MemoryGovernor&) = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+    /**
+     * Returns true if a job reserving bytes fits beside the running ones,
+     * whatever is waiting.
+     */
+    bool Fits(uint64_t bytes) const;
+
+    /**
+     * Starts a job that has just asked, if it fits and may go ahead of
+     * what is waiting. The lock must be held.
+     * @return true if the job was started.
+     */
+    bool StartNow(const MemoryGrant& grant);
+
+    /**
+     * Records a job as running. The lock must be held.
+     */
+    void Start(const MemoryGrant& grant);
+
+    /**
+     * Admits the waiting jobs that can run now, in order, letting jobs
+     * behind the first overtake it while it does not fit. The lock must
+     * be held.
+     */
+    void Wake();
+
+    /**
+     * Samples the peak resident size if the last sample is at least
+     * SAMPLE_INTERVAL old, and starts the next window; when idle, returns
+     * free heap to the system first. The lock must be held; it is let go
+     * while /proc is read and written.
+     */
+    void Measure(unique_lock<mutex>& guard);
+
+    /**
+     * Feeds a peak resident size back into the correction. The lock
+     * must be held.
+     * @param peak the process's peak resident size over the window.
+     * @param held the outside bytes at its end.
+     * @param window the most predicted for the jobs running at once.
+     */
+    void Sample(uint64_t peak, uint64_t held, uint64_t window);
+};
+
+/**
+ * MemoryReservation: memory set aside by a MemoryGovernor for one job,
+ * for as long as the reservation lives.
+ */
+class MemoryReservation {
+public:
+    /**
+     * Waits until a job with the predicted peak can run.
+     */
+    MemoryReservation(MemoryGovernor& governor, uint64_t peak) : governor(governor), grant(governor.Admit(peak)) {}
+    ~MemoryReservation() { governor.Release(grant); }
+
+private:
+    MemoryGovernor& governor;
+    MemoryGrant grant;
+
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+};
+
+#endif
@@ -3,17 +3,89 @@
  * @description declaration of private QTree functions
  */
 
-void renderNode(Node* nd, PNG& img, unsigned int scale) const;
-void draw(PNG& img, unsigned int startX, unsigned int startY, unsigned int scale, RGBAPixel color) const;
+static unsigned int nodeWidth(Node* nd);
+static unsigned int nodeHeight(Node* nd);
+static void childCorners(Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> corners[4]);
 
-void flipHorizontal(Node* node);
+void renderNode(Node* nd, ImageView img, unsigned int scale, pair<unsigned int, unsigned int> ul, unsigned int bandTop, unsigned int bandBottom) const;
+void draw(const ImageView& img, unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY, RGBAPixel color) const;
 
-void rotateCCW(Node* node);
+Node* flipHorizontal(Node* node, pair<unsigned int, unsigned int> ul, bool shared);
 
-void clear(Node* node);
-Node* copy(Node* node) const;
+Node* rotateCCW(Node* node, pair<unsigned int, unsigned int> ul, bool shared);
 
-void pruneSt(Node* nd, double tol);
+Node* updateNode(Node* node, const ImageView& img, pair<unsigned int, unsigned int> ul,
+                 pair<unsigned int, unsigned int> dirtyUL, pair<unsigned int, unsigned int> dirtyLR, bool shared);
+template <bool Opaque = false>
+static RGBAPixel averageOf(Node* nd);
+
+// summed-area tables counting the pixels with non-zero alpha in a
+// rectangle, and totalling the red, green and blue of all its pixels
+struct VisibleTable {
+    pair<unsigned int, unsigned int> origin;
+    unsigned int stride;
+    vector<unsigned int> sums;
+    vector<unsigned long long> colorSums; // red, green and blue, three per entry of sums
+};
+
+template <bool Opaque>
+Node* buildNode(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, const VisibleTable& visible);
+static bool isOpaque(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+static void countVisible(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, VisibleTable& visible);
+static unsigned int visibleIn(const VisibleTable& visible, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+static RGBAPixel transparentAverage(const VisibleTable& visible, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+
+Node* resampleNode(Node* src, pair<unsigned int, unsigned int> srcUL, pair<unsigned int, unsigned int> ul,
+                   pair<unsigned int, unsigned int> lr, unsigned int scale, pair<unsigned int, unsigned int> offset) const;
+static Node* containing(Node* nd, pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int> regionUL,
+                        pair<unsigned int, unsigned int> regionLR);
+RGBAPixel regionAverage(Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> regionUL,
+                        pair<unsigned int, unsigned int> regionLR) const;
+void regionTotals(Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> regionUL,
+                  pair<unsigned int, unsigned int> regionLR, unsigned long long totals[4], double& totalA) const;
+
+Node* overlayNode(Node* node, pair<unsigned int, unsigned int> ul, const QTree& top, pair<unsigned int, unsigned int> at, bool shared);
+static Node* expandLeaf(Node* leaf, pair<unsigned int, unsigned int> ul);
+static RGBAPixel blendOver(const RGBAPixel& top, const RGBAPixel& bottom);
+
+Node* dedupNode(Node* node, unordered_map<uint64_t, Node*>& seen, bool shared);
+bool sameNode(Node* a, Node* b) const;
+void countUnique(Node* node, unordered_set<Node*>& seen) const;
+
+static void clear(Node* node);
+static Node* retain(Node* node);
+static Node* unshare(Node* node, bool shared);
+static void replaceChild(Node*& slot, Node* nd);
+static void releaseReplaced(Node* old, Node* nd);
+void replaceRoot(Node* nd);
+
+// buffers reused by every leavesUnderTol call of one Prune, and the error
+// of collapsing the subtree leavesUnderTol last accepted; worst also
+// covers the subtrees pruned before it
+struct PruneScratch {
+    PixelBatch leaves;
+    vector<Node*> pending;
+    unsigned long long area;
+    double sse;
+    double worst;
+};
+
+Node* pruneSt(Node* nd, double tol, bool shared, PruneScratch& scratch);
 bool shouldPrune(Node* nd, RGBAPixel avg, double tol);
-bool leavesUnderTol(Node* node, double tolerance, RGBAPixel avg) const;
-void clearSt(Node* nd);
\ No newline at end of file
+bool leavesUnderTol(Node* node, double tolerance, PruneScratch& scratch) const;
+void clearSt(Node* nd);
+void resetPruneStats();
+
+// every node of the tree in preorder, with the smallest tolerance at which
+// Prune collapses it (-infinity for leaves) and the squared error of doing so;
+// this is exact, so Prune's result for any tolerance can be read off it
+struct PruneProfile {
+    vector<double> threshold;
+    vector<double> sse;
+    vector<unsigned int> nodeEnd; // preorder index just past the node's subtree
+};
+
+void buildProfile(Node* node, PixelBatch& leaves, PruneProfile& profile) const;
+static void profileAt(const PruneProfile& profile, double tol, double& sse, unsigned int& leaves);
+static vector<double> profileTolerances(const PruneProfile& profile);
+size_t encodedSize(double tol) const;
\ No newline at end of file
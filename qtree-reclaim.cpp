@@ -0,0 +1,143 @@
+/**
+ * @file qtree-reclaim.cpp
+ * @description implementation of NodeReclaimer
+ */
+
+#include <vector>
+
+#include "qtree.h"
+#include "qtree-reclaim.h"
+
+/**
+ * Returns the process-wide reclaimer, starting its thread on first use.
+ */
+NodeReclaimer& NodeReclaimer::Instance() {
+	static NodeReclaimer reclaimer;
+	return reclaimer;
+}
+
+NodeReclaimer::NodeReclaimer()
+	: busy(false), held(false), stopping(false), reclaimedTrees(0), reclaimedNodes(0), rejectedTrees(0) {
+	worker = thread(&NodeReclaimer::Run, this);
+}
+
+/**
+ * Frees anything still queued before the process exits.
+ */
+NodeReclaimer::~NodeReclaimer() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_one();
+	worker.join();
+}
+
+/**
+ * Queues the subtree rooted at nd for deletion on the reclaimer thread.
+ * @param nd root of the subtree to free; ownership passes to the reclaimer.
+ * @return false if the queue is full, in which case ownership stays
+ *         with the caller.
+ */
+bool NodeReclaimer::Defer(Node* nd) {
+	if (!nd) {
+		return true;
+	}
+
+	{
+		lock_guard<mutex> guard(lock);
+		if (queue.size() >= MAX_PENDING_TREES) {
+			rejectedTrees++;
+			return false;
+		}
+		queue.push_back(nd);
+	}
+	wake.notify_one();
+	return true;
+}
+
+/**
+ * Blocks until every queued subtree has been freed. Must not be called
+ * while the reclaimer is held.
+ */
+void NodeReclaimer::Drain() {
+	unique_lock<mutex> guard(lock);
+	idle.wait(guard, [this] { return queue.empty() && !busy; });
+}
+
+/**
+ * Holds the reclaimer thread, or lets it go again: while held it frees
+ * nothing, so subtrees queue up until Defer refuses them, as it would
+ * behind a reclaimer that cannot keep up.
+ */
+void NodeReclaimer::Hold(bool hold) {
+	{
+		lock_guard<mutex> guard(lock);
+		held = hold;
+	}
+	wake.notify_one();
+}
+
+/**
+ * Returns a snapshot of the reclaimer's counters.
+ */
+ReclaimStats NodeReclaimer::Stats() const {
+	ReclaimStats stats;
+	{
+		lock_guard<mutex> guard(lock);
+		stats.pendingTrees = queue.size() + (busy ? 1 : 0);
+	}
+	stats.reclaimedTrees = reclaimedTrees;
+	stats.reclaimedNodes = reclaimedNodes;
+	stats.rejectedTrees = rejectedTrees;
+	return stats;
+}
+
+void NodeReclaimer::Run() {
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		// what is still queued is freed on the way out, held or not
+		wake.wait(guard, [this] { return stopping || (!held && !queue.empty()); });
+		if (queue.empty()) {
+			return;
+		}
+
+		Node* nd = queue.front();
+		queue.pop_front();
+		busy = true;
+
+		guard.unlock();
+		reclaimedNodes += Free(nd);
+		reclaimedTrees++;
+		guard.lock();
+
+		busy = false;
+		if (queue.empty()) {
+			idle.notify_all();
+		}
+	}
+}
+
+std::size_t NodeReclaimer::Free(Node* nd) {
+	std::size_t freed = 0;
+	vector<Node*> pending(1, nd);
+
+	while (!pending.empty()) {
+		Node* curr = pending.back();
+		pending.pop_back();
+
+		if (--curr->refs > 0) {
+			continue;
+		}
+
+		if (curr->NW) pending.push_back(curr->NW);
+		if (curr->NE) pending.push_back(curr->NE);
+		if (curr->SW) pending.push_back(curr->SW);
+		if (curr->SE) pending.push_back(curr->SE);
+
+		delete curr;
+		freed++;
+	}
+
+	return freed;
+}
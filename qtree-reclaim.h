@@ -0,0 +1,108 @@
+/**
+ * @file qtree-reclaim.h
+ * @description declaration of NodeReclaimer, a background thread that frees
+ *              QTree nodes off the caller's thread
+ */
+
+#ifndef _QTREE_RECLAIM_H_
+#define _QTREE_RECLAIM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+class Node;
+
+/**
+ * Snapshot of the reclaimer's counters.
+ */
+struct ReclaimStats {
+    std::size_t pendingTrees;   // roots queued but not yet freed
+    std::size_t reclaimedTrees; // roots fully freed by the background thread
+    std::size_t reclaimedNodes; // nodes freed by the background thread
+    std::size_t rejectedTrees;  // roots refused because the queue was full
+};
+
+/**
+ * NodeReclaimer: a single process-wide worker that deletes whole subtrees
+ * handed to it by QTrees using deferred destruction.
+ *
+ * The queue is bounded; when it is full Defer() refuses the root and the
+ * caller must free it itself, so deferred memory can never grow without
+ * limit behind a slow reclaimer.
+ */
+class NodeReclaimer {
+public:
+    /**
+     * Maximum number of roots that may wait in the queue at once.
+     */
+    static const std::size_t MAX_PENDING_TREES = 64;
+
+    /**
+     * Returns the process-wide reclaimer, starting its thread on first use.
+     */
+    static NodeReclaimer& Instance();
+
+    /**
+     * Queues the subtree rooted at nd for deletion on the reclaimer thread.
+     * @param nd root of the subtree to free; ownership passes to the reclaimer.
+     * @return false if the queue is full, in which case ownership stays
+     *         with the caller.
+     */
+    bool Defer(Node* nd);
+
+    /**
+     * Blocks until every queued subtree has been freed. Must not be
+     * called while the reclaimer is held.
+     */
+    void Drain();
+
+    /**
+     * Holds the reclaimer thread, or lets it go again: while held it
+     * frees nothing, so subtrees queue up until Defer refuses them, as
+     * it would behind a reclaimer that cannot keep up.
+     */
+    void Hold(bool hold);
+
+    /**
+     * Returns a snapshot of the reclaimer's counters.
+     */
+    ReclaimStats Stats() const;
+
+    ~NodeReclaimer();
+
+private:
+    NodeReclaimer();
+    NodeReclaimer(const NodeReclaimer&) = delete;
+    NodeReclaimer& operator=(const NodeReclaimer&) = delete;
+
+    /**
+     * Body of the reclaimer thread.
+     */
+    void Run();
+
+    /**
+     * Frees the subtree rooted at nd without recursion.
+     * @return the number of nodes freed.
+     */
+    std::size_t Free(Node* nd);
+
+    std::deque<Node*> queue;
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool busy;
+    bool held;
+    bool stopping;
+
+    std::atomic<std::size_t> reclaimedTrees;
+    std::atomic<std::size_t> reclaimedNodes;
+    std::atomic<std::size_t> rejectedTrees;
+
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,429 @@
+/**
+ * @file qtree-sequence.cpp
+ * @description implementation of QTreeSequence
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "imgUtil/ContentHash.h"
+#include "qtree-sequence.h"
+
+/**
+ * Tag written at the start of every delta.
+ */
+static const char DELTA_MAGIC[4] = { 'Q', 'T', 'D', '2' };
+
+static void writeU32(ostream& out, uint32_t v) {
+	unsigned char bytes[4] = { (unsigned char) v, (unsigned char) (v >> 8), (unsigned char) (v >> 16), (unsigned char) (v >> 24) };
+	out.write((const char*) bytes, 4);
+}
+
+static uint32_t readU32(istream& in) {
+	unsigned char bytes[4] = { 0, 0, 0, 0 };
+	in.read((char*) bytes, 4);
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+// a double's bits, as two 32-bit halves, low first
+static void writeDouble(ostream& out, double v) {
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	writeU32(out, (uint32_t) bits);
+	writeU32(out, (uint32_t) (bits >> 32));
+}
+
+static double readDouble(istream& in) {
+	uint64_t bits = readU32(in);
+	bits |= (uint64_t) readU32(in) << 32;
+	double v;
+	memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+QTreeSequence::QTreeSequence() : tree(nullptr), width(0), height(0), frames(0) {
+}
+
+QTreeSequence::~QTreeSequence() {
+	delete tree;
+}
+
+/**
+ * Builds the tree for the next frame, reusing every subtree of the
+ * previous frame's tree whose region did not change. A frame whose
+ * size differs from the previous one is built from scratch.
+ * @param frame the next image in the sequence.
+ * @return the tree for frame; valid until the next Push or ApplyDelta.
+ */
+const QTree& QTreeSequence::Push(const ImageView& frame) {
+	bool sameSize = tree && frame.width() == width && frame.height() == height;
+	width = frame.width();
+	height = frame.height();
+	HashTiles(frame, sameSize);
+
+	changed.clear();
+	changedNodes.clear();
+
+	QTree* next;
+	if (sameSize) {
+		next = new QTree(Reuse(tree->root, frame, make_pair(0u, 0u)), width, height);
+	} else {
+		next = new QTree(frame);
+		changed.push_back(Region(make_pair(0u, 0u), make_pair(width - 1, height - 1)));
+		changedNodes.push_back(next->root);
+	}
+
+	delete tree;
+	tree = next;
+	frames++;
+
+	return *tree;
+}
+
+/**
+ * Returns the tree of the latest frame.
+ * @pre Push or ApplyDelta has been called at least once.
+ */
+const QTree& QTreeSequence::Current() const {
+	return *tree;
+}
+
+/**
+ * Returns the regions whose subtrees were rebuilt for the latest frame.
+ */
+const vector<QTreeSequence::Region>& QTreeSequence::ChangedRegions() const {
+	return changed;
+}
+
+/**
+ * Returns the number of frames pushed or applied so far.
+ */
+unsigned int QTreeSequence::FrameCount() const {
+	return frames;
+}
+
+/**
+ * Writes the subtrees rebuilt for the latest frame to out.
+ *
+ * The delta is the tag "QTD2", then the frame's width, height and index
+ * and the number of regions, followed by each region's corners and its
+ * subtree in preorder. Each node is a byte whose low four bits say which
+ * of NW, NE, SW, SE are present; leaves (no bits set) are followed by
+ * their red, green and blue bytes and their alpha as an IEEE double,
+ * exactly as the encoder's tree holds it, so that the decoder's tree
+ * renders and prunes the same. All integers, and the double's bits, are
+ * 32-bit little-endian.
+ *
+ * @return true if the delta was written successfully.
+ */
+bool QTreeSequence::WriteDelta(ostream& out) const {
+	if (!tree) {
+		return false;
+	}
+
+	out.write(DELTA_MAGIC, sizeof(DELTA_MAGIC));
+	writeU32(out, width);
+	writeU32(out, height);
+	writeU32(out, frames - 1);
+	writeU32(out, changed.size());
+
+	for (unsigned int i = 0; i < changed.size(); i++) {
+		writeU32(out, changed[i].first.first);
+		writeU32(out, changed[i].first.second);
+		writeU32(out, changed[i].second.first);
+		writeU32(out, changed[i].second.second);
+		WriteNode(out, changedNodes[i]);
+	}
+
+	return out.good();
+}
+
+/**
+ * Reads a delta written by WriteDelta and applies it to the current
+ * tree, advancing this sequence by one frame.
+ * @return false if the delta is malformed or does not follow on from
+ *         the current frame; the current tree is then unchanged.
+ */
+bool QTreeSequence::ApplyDelta(istream& in) {
+	char magic[sizeof(DELTA_MAGIC)];
+	in.read(magic, sizeof(magic));
+	unsigned int w = readU32(in);
+	unsigned int h = readU32(in);
+	unsigned int index = readU32(in);
+	unsigned int count = readU32(in);
+	if (!in.good() || !equal(magic, magic + sizeof(magic), DELTA_MAGIC) || index != frames || w == 0 || h == 0) {
+		return false;
+	}
+
+	bool sameSize = tree && w == width && h == height;
+	Region whole(make_pair(0u, 0u), make_pair(w - 1, h - 1));
+
+	QTree* next = sameSize ? new QTree(*tree) : nullptr;
+	vector<Region> regions;
+	vector<Node*> nodes;
+
+	for (unsigned int i = 0; i < count; i++) {
+		Region region;
+		region.first.first = readU32(in);
+		region.first.second = readU32(in);
+		region.second.first = readU32(in);
+		region.second.second = readU32(in);
+
+		bool valid = in.good() && region.first.first <= region.second.first && region.first.second <= region.second.second &&
+		             region.second.first < w && region.second.second < h && (next || region == whole);
+		Node* sub = valid ? ReadNode(in, region.first, region.second) : nullptr;
+		if (!sub) {
+			delete next;
+			return false;
+		}
+
+		if (!next) {
+			next = new QTree(sub, w, h);
+		} else {
+			Node* root = Splice(next->root, make_pair(0u, 0u), region, sub, false);
+			if (!root) {
+				QTree::clear(sub);
+				delete next;
+				return false;
+			}
+			next->replaceRoot(root);
+		}
+
+		regions.push_back(region);
+		nodes.push_back(sub);
+	}
+
+	if (!next) {
+		return false;
+	}
+
+	delete tree;
+	tree = next;
+	width = w;
+	height = h;
+	frames++;
+	changed = regions;
+	changedNodes = nodes;
+	tileHashes.clear();
+
+	return true;
+}
+
+/**
+ * Hashes every tile of frame and fills in the changed-tile prefix sums.
+ * @return the number of tiles whose hash changed.
+ */
+unsigned int QTreeSequence::HashTiles(const ImageView& frame, bool sameSize) {
+	unsigned int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	// one hasher per tile of a band of tiles, fed a row at a time so the
+	// frame is read in memory order
+	vector<uint64_t> hashes(tilesX * tilesY);
+	vector<ContentHasher> hashers(tilesX);
+	vector<ImageView> tiles(tilesX);
+	unsigned int tileSize = TILE_SIZE; // min takes references
+	for (unsigned int ty = 0; ty < tilesY; ty++) {
+		unsigned int top = ty * TILE_SIZE;
+		unsigned int rows = min(tileSize, height - top);
+		for (unsigned int tx = 0; tx < tilesX; tx++) {
+			tiles[tx] = frame.sub(tx * TILE_SIZE, top, min(tileSize, width - tx * TILE_SIZE), rows);
+			hashers[tx].reset();
+		}
+		for (unsigned int y = 0; y < rows; y++) {
+			for (unsigned int tx = 0; tx < tilesX; tx++) {
+				hashers[tx].addRow(tiles[tx], y);
+			}
+		}
+		for (unsigned int tx = 0; tx < tilesX; tx++) {
+			hashes[ty * tilesX + tx] = hashers[tx].digest();
+		}
+	}
+
+	sameSize = sameSize && tileHashes.size() == hashes.size();
+
+	unsigned int total = 0;
+	dirty.assign((tilesX + 1) * (tilesY + 1), 0);
+	for (unsigned int ty = 0; ty < tilesY; ty++) {
+		for (unsigned int tx = 0; tx < tilesX; tx++) {
+			unsigned int i = ty * tilesX + tx;
+			unsigned int isDirty = (!sameSize || hashes[i] != tileHashes[i]) ? 1 : 0;
+			total += isDirty;
+			dirty[(ty + 1) * (tilesX + 1) + tx + 1] = isDirty + dirty[ty * (tilesX + 1) + tx + 1]
+			                                          + dirty[(ty + 1) * (tilesX + 1) + tx] - dirty[ty * (tilesX + 1) + tx];
+		}
+	}
+
+	tileHashes.swap(hashes);
+	return total;
+}
+
+/**
+ * Returns the number of changed tiles overlapping [ul, lr].
+ */
+unsigned int QTreeSequence::DirtyTiles(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const {
+	unsigned int stride = (width + TILE_SIZE - 1) / TILE_SIZE + 1;
+	unsigned int x0 = ul.first / TILE_SIZE;
+	unsigned int y0 = ul.second / TILE_SIZE;
+	unsigned int x1 = lr.first / TILE_SIZE + 1;
+	unsigned int y1 = lr.second / TILE_SIZE + 1;
+
+	return dirty[y1 * stride + x1] - dirty[y0 * stride + x1] - dirty[y1 * stride + x0] + dirty[y0 * stride + x0];
+}
+
+/**
+ * Returns the subtree for [ul, lr] of frame, sharing prev's subtrees
+ * wherever no tile under them changed.
+ */
+Node* QTreeSequence::Reuse(Node* prev, const ImageView& frame, pair<unsigned int, unsigned int> ul) {
+	pair<unsigned int, unsigned int> lr(ul.first + QTree::nodeWidth(prev) - 1, ul.second + QTree::nodeHeight(prev) - 1);
+
+	unsigned int count = DirtyTiles(ul, lr);
+	if (count == 0) {
+		return QTree::retain(prev);
+	}
+
+	unsigned int tiles = (lr.first / TILE_SIZE - ul.first / TILE_SIZE + 1) * (lr.second / TILE_SIZE - ul.second / TILE_SIZE + 1);
+	if (count == tiles || (!prev->NW && !prev->NE && !prev->SW && !prev->SE)) {
+		Node* nd = tree->BuildNode(frame, ul, lr);
+		changed.push_back(Region(ul, lr));
+		changedNodes.push_back(nd);
+		return nd;
+	}
+
+	pair<unsigned int, unsigned int> corners[4];
+	QTree::childCorners(prev, ul, corners);
+
+	Node* nd = new Node(ul, lr, RGBAPixel());
+	nd->NW = prev->NW ? Reuse(prev->NW, frame, corners[0]) : nullptr;
+	nd->NE = prev->NE ? Reuse(prev->NE, frame, corners[1]) : nullptr;
+	nd->SW = prev->SW ? Reuse(prev->SW, frame, corners[2]) : nullptr;
+	nd->SE = prev->SE ? Reuse(prev->SE, frame, corners[3]) : nullptr;
+	nd->avg = QTree::averageOf(nd);
+	nd->Rehash();
+
+	return nd;
+}
+
+/**
+ * Replaces the subtree covering region in the tree rooted at nd with
+ * sub, recomputing the averages of its ancestors.
+ * @return the replacement for nd, or nullptr if region is not a node.
+ */
+Node* QTreeSequence::Splice(Node* nd, pair<unsigned int, unsigned int> ul, const Region& region, Node* sub, bool shared) {
+	if (!nd) {
+		return nullptr;
+	}
+
+	pair<unsigned int, unsigned int> lr(ul.first + QTree::nodeWidth(nd) - 1, ul.second + QTree::nodeHeight(nd) - 1);
+	if (Region(ul, lr) == region) {
+		return sub;
+	}
+
+	shared = shared || nd->refs > 1;
+
+	pair<unsigned int, unsigned int> corners[4];
+	QTree::childCorners(nd, ul, corners);
+
+	Node** children[4] = { &nd->NW, &nd->NE, &nd->SW, &nd->SE };
+	for (int i = 0; i < 4; i++) {
+		Node* child = *children[i];
+		if (!child) {
+			continue;
+		}
+
+		pair<unsigned int, unsigned int> childLR(corners[i].first + QTree::nodeWidth(child) - 1, corners[i].second + QTree::nodeHeight(child) - 1);
+		if (region.first.first < corners[i].first || region.first.second < corners[i].second ||
+		    region.second.first > childLR.first || region.second.second > childLR.second) {
+			continue;
+		}
+
+		Node* replacement = Splice(child, corners[i], region, sub, shared);
+		if (!replacement) {
+			return nullptr;
+		}
+
+		Node* out = QTree::unshare(nd, shared);
+		Node** slots[4] = { &out->NW, &out->NE, &out->SW, &out->SE };
+		QTree::replaceChild(*slots[i], replacement);
+		out->avg = QTree::averageOf(out);
+		out->Rehash();
+		return out;
+	}
+
+	return nullptr;
+}
+
+void QTreeSequence::WriteNode(ostream& out, Node* nd) const {
+	unsigned char mask = (nd->NW ? 1 : 0) | (nd->NE ? 2 : 0) | (nd->SW ? 4 : 0) | (nd->SE ? 8 : 0);
+	out.put(mask);
+
+	if (mask == 0) {
+		out.put(nd->avg.r);
+		out.put(nd->avg.g);
+		out.put(nd->avg.b);
+		writeDouble(out, nd->avg.a);
+		return;
+	}
+
+	Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+	for (Node* child : children) {
+		if (child) {
+			WriteNode(out, child);
+		}
+	}
+}
+
+Node* QTreeSequence::ReadNode(istream& in, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const {
+	int mask = in.get();
+	if (!in.good() || mask > 15) {
+		return nullptr;
+	}
+
+	if (mask == 0) {
+		unsigned char rgb[3];
+		in.read((char*) rgb, 3);
+		double alpha = readDouble(in);
+		if (!in.good() || !(alpha >= 0.0 && alpha <= 1.0)) {
+			return nullptr;
+		}
+		return new Node(ul, lr, RGBAPixel(rgb[0], rgb[1], rgb[2], alpha));
+	}
+
+	// children follow the same split as QTree::BuildNode, which makes
+	// exactly the children the region's shape allows: any other mask
+	// would leave part of the region uncovered, or cover nothing
+	unsigned int midX = (ul.first + lr.first) / 2;
+	unsigned int midY = (ul.second + lr.second) / 2;
+	bool wide = lr.first != ul.first;
+	bool tall = lr.second != ul.second;
+	int expected = 1 | (wide ? 2 : 0) | (tall ? 4 : 0) | (wide && tall ? 8 : 0);
+	if (mask != expected || (!wide && !tall)) {
+		return nullptr;
+	}
+
+	Node* nd = new Node(ul, lr, RGBAPixel());
+	nd->NW = ReadNode(in, ul, make_pair(midX, midY));
+	bool ok = nd->NW != nullptr;
+	if (ok && (mask & 2)) {
+		nd->NE = ReadNode(in, make_pair(midX + 1, ul.second), make_pair(lr.first, midY));
+		ok = nd->NE != nullptr;
+	}
+	if (ok && (mask & 4)) {
+		nd->SW = ReadNode(in, make_pair(ul.first, midY + 1), make_pair(midX, lr.second));
+		ok = nd->SW != nullptr;
+	}
+	if (ok && (mask & 8)) {
+		nd->SE = ReadNode(in, make_pair(midX + 1, midY + 1), lr);
+		ok = nd->SE != nullptr;
+	}
+
+	if (!ok) {
+		QTree::clear(nd);
+		return nullptr;
+	}
+
+	nd->avg = QTree::averageOf(nd);
+	nd->Rehash();
+	return nd;
+}
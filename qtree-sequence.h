@@ -0,0 +1,124 @@
+/**
+ * @file qtree-sequence.h
+ * @description declaration of QTreeSequence, which builds QTrees for
+ *              consecutive frames while reusing unchanged subtrees
+ */
+
+#ifndef _QTREE_SEQUENCE_H_
+#define _QTREE_SEQUENCE_H_
+
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "qtree.h"
+
+/**
+ * QTreeSequence: builds one QTree per frame of an image sequence.
+ *
+ * Each frame is cut into TILE_SIZE x TILE_SIZE tiles and a content hash is
+ * kept for every tile. When the next frame arrives, only the subtrees of
+ * the previous frame's tree that overlap a tile whose hash changed are
+ * rebuilt; all others are shared by reference with the previous tree.
+ *
+ * The rebuilt subtrees of the latest frame can be written out as a delta
+ * with WriteDelta, and a second QTreeSequence can follow along by
+ * applying those deltas with ApplyDelta.
+ */
+class QTreeSequence {
+public:
+    /**
+     * Side length, in pixels, of the tiles whose hashes are compared.
+     */
+    static const unsigned int TILE_SIZE = 16;
+
+    /**
+     * A rectangle, as its upper left and lower right points.
+     */
+    typedef pair<pair<unsigned int, unsigned int>, pair<unsigned int, unsigned int> > Region;
+
+    QTreeSequence();
+    ~QTreeSequence();
+
+    /**
+     * Builds the tree for the next frame, reusing every subtree of the
+     * previous frame's tree whose region did not change. A frame whose
+     * size differs from the previous one is built from scratch.
+     * @param frame the next image in the sequence.
+     * @return the tree for frame; valid until the next Push or ApplyDelta.
+     */
+    const QTree& Push(const ImageView& frame);
+
+    /**
+     * Returns the tree of the latest frame.
+     * @pre Push or ApplyDelta has been called at least once.
+     */
+    const QTree& Current() const;
+
+    /**
+     * Returns the regions whose subtrees were rebuilt for the latest frame.
+     */
+    const vector<Region>& ChangedRegions() const;
+
+    /**
+     * Returns the number of frames pushed or applied so far.
+     */
+    unsigned int FrameCount() const;
+
+    /**
+     * Writes the subtrees rebuilt for the latest frame to out.
+     * @return true if the delta was written successfully.
+     */
+    bool WriteDelta(ostream& out) const;
+
+    /**
+     * Reads a delta written by WriteDelta and applies it to the current
+     * tree, advancing this sequence by one frame.
+     * @return false if the delta is malformed or does not follow on from
+     *         the current frame; the current tree is then unchanged.
+     */
+    bool ApplyDelta(istream& in);
+
+private:
+    QTree* tree;                 // tree of the latest frame, or nullptr
+    unsigned int width;          // width of the latest frame
+    unsigned int height;         // height of the latest frame
+    unsigned int frames;         // number of frames seen so far
+    vector<uint64_t> tileHashes; // content hash of every tile of the latest frame
+    vector<unsigned int> dirty;  // prefix sums over the changed-tile grid
+    vector<Region> changed;      // regions rebuilt for the latest frame
+    vector<Node*> changedNodes;  // roots of the subtrees rebuilt for the latest frame
+
+    QTreeSequence(const QTreeSequence&) = delete;
+    QTreeSequence& operator=(const QTreeSequence&) = delete;
+
+    /**
+     * Hashes every tile of frame and fills in the changed-tile prefix sums.
+     * @return the number of tiles whose hash changed.
+     */
+    unsigned int HashTiles(const ImageView& frame, bool sameSize);
+
+    /**
+     * Returns the number of changed tiles overlapping [ul, lr].
+     */
+    unsigned int DirtyTiles(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+    /**
+     * Returns the subtree for [ul, lr] of frame, sharing prev's subtrees
+     * wherever no tile under them changed.
+     */
+    Node* Reuse(Node* prev, const ImageView& frame, pair<unsigned int, unsigned int> ul);
+
+    /**
+     * Replaces the subtree covering region in the tree rooted at nd with
+     * sub, recomputing the averages of its ancestors.
+     * @return the replacement for nd, or nullptr if region is not a node.
+     */
+    Node* Splice(Node* nd, pair<unsigned int, unsigned int> ul, const Region& region, Node* sub, bool shared);
+
+    void WriteNode(ostream& out, Node* nd) const;
+    Node* ReadNode(istream& in, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+};
+
+#endif
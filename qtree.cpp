@@ -1,7 +1,26 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
 #include "qtree.h"
+#include "qtree-reclaim.h"
+#include "imgUtil/Bands.h"
+
+/**
+ * Minimum number of output rows handed to a single render worker. Bands
+ * thinner than this cost more to spawn than they save.
+ */
+static const unsigned int MIN_RENDER_BAND_ROWS = 64;
+
+// sizes of the first and largest chunks of leaves tested at once by leavesUnderTol
+static const size_t MIN_PRUNE_CHUNK = 4;
+static const size_t MAX_PRUNE_CHUNK = 1024;
 
 /**
- * Constructor that builds a QTree out of the given PNG.
+ * Constructor that builds a QTree out of the given image, which may
+ * be a PNG or a view of any other buffer of pixels.
  * Every leaf in the tree corresponds to a pixel in the PNG.
  * Every non-leaf node corresponds to a rectangle of pixels
  * in the original PNG, represented by an (x,y) pair for the
@@ -24,10 +43,15 @@
  * This way, each of the children's rectangles together will have coordinates
  * that when combined, completely cover the original rectangle's image
  * region and do not overlap.
+ *
+ * The one exception: a rectangle whose pixels are all fully transparent
+ * is stored as a single transparent leaf rather than split further.
  */
-QTree::QTree(const PNG& imIn) {
+QTree::QTree(const ImageView& imIn) {
 	width = imIn.width();
 	height = imIn.height();
+	deferClear = false;
+	resetPruneStats();
 
 	pair<unsigned int, unsigned int> ul(0, 0);
 	pair<unsigned int, unsigned int> lr(width - 1, height - 1);
@@ -60,15 +84,74 @@ QTree& QTree::operator=(const QTree& rhs) {
  * For up-scaled images, no color interpolation will be done;
  * each rectangle is fully rendered into a larger rectangular region.
  *
+ * The output canvas is split into horizontal bands, one per core, run
+ * by forEachBand. Each band only descends into subtrees whose rows
+ * intersect it, so no two bands ever write the same pixel.
+ *
+ * Node positions are worked out from the parent during the traversal,
+ * so subtrees shared between several places by Deduplicate are drawn
+ * at each of them.
+ *
  * @param scale multiplier for each horizontal/vertical dimension
  * @pre scale > 0
+ * @return the rendered image, or an empty PNG if scale is too large
+ *         for the result to be addressed (see RenderFits).
  */
 PNG QTree::Render(unsigned int scale) const {
+	if (!RenderFits(width, height, scale)) {
+		cerr << "QTree::Render: " << width << "x" << height << " at scale " << scale << " is too large" << endl;
+		return PNG();
+	}
+
 	PNG img(width * scale, height * scale);
-	renderNode(root, img, scale);
+	Render(scale, img);
 	return img;
 }
 
+/**
+ * Returns true if an image of width by height pixels can be rendered
+ * at scale: each side, and the number of pixels, must fit in an
+ * unsigned int, as the PNG indexes its pixels with one.
+ */
+bool QTree::RenderFits(unsigned int width, unsigned int height, unsigned int scale) {
+	const uint64_t limit = numeric_limits<unsigned int>::max();
+	uint64_t scaledWidth = (uint64_t) width * scale;
+	uint64_t scaledHeight = (uint64_t) height * scale;
+	return scale > 0 && scaledWidth <= limit && scaledHeight <= limit
+	       && (scaledHeight == 0 || scaledWidth <= limit / scaledHeight);
+}
+
+/**
+ * Render draws the tree into a caller-provided image instead of a new
+ * PNG, exactly as Render(scale) would.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param img destination; must be (width * scale) by (height * scale)
+ * @pre scale > 0
+ */
+void QTree::Render(unsigned int scale, const ImageView& img) const {
+	if (!RenderFits(width, height, scale)) {
+		cerr << "QTree::Render: " << width << "x" << height << " at scale " << scale << " is too large" << endl;
+		return;
+	}
+	if (img.width() != width * scale || img.height() != height * scale) {
+		cerr << "QTree::Render: destination is " << img.width() << "x" << img.height()
+		     << ", expected " << width * scale << "x" << height * scale << endl;
+		return;
+	}
+
+	unsigned int rows = img.height();
+	unsigned int bands = max(1u, thread::hardware_concurrency());
+	bands = min(bands, max(1u, rows / MIN_RENDER_BAND_ROWS));
+
+	// forEachBand joins every band it starts, however it is left, and
+	// keeps the threads of all the Renders at once within the core count
+	pair<unsigned int, unsigned int> origin(0, 0);
+	forEachBand(rows, bands, [&](unsigned int, unsigned int top, unsigned int bottom) {
+		renderNode(root, img, scale, origin, top, bottom);
+	});
+}
+
 /**
  *  Prune function trims subtrees as high as possible in the tree.
  *  A subtree is pruned (cleared) if all of the subtree's leaves are within
@@ -78,7 +161,243 @@ PNG QTree::Render(unsigned int scale) const {
  * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
  */
 void QTree::Prune(double tolerance) {
-	pruneSt(root, tolerance);
+	resetPruneStats();
+
+	PruneScratch scratch;
+	replaceRoot(pruneSt(root, tolerance, false, scratch));
+}
+
+/**
+ *  Returns the error introduced by the most recent Prune, gathered
+ *  while the subtrees were being collapsed, so judging a prune needs
+ *  no Render. Before any Prune every field but pixels is zero.
+ */
+PruneStats QTree::LastPruneStats() const {
+	return pruneStats;
+}
+
+double PruneStats::MSE() const {
+	return pixels == 0 ? 0.0 : sse / (3.0 * pixels);
+}
+
+double PruneStats::PSNR() const {
+	double mse = MSE();
+	if (mse == 0) {
+		return numeric_limits<double>::infinity();
+	}
+	return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+/**
+ *  Prunes the tree with the largest tolerance that keeps the PSNR
+ *  reported by LastPruneStats at or above minPSNR.
+ *
+ * @param minPSNR lowest acceptable PSNR, in dB
+ * @return the tolerance the tree was pruned with
+ * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+ */
+double QTree::PruneToPSNR(double minPSNR) {
+	PruneProfile profile;
+	PixelBatch leaves;
+	buildProfile(root, leaves, profile);
+
+	// PSNR >= minPSNR exactly when the squared error is at most maxSse
+	double maxSse = 3.0 * width * height * 255.0 * 255.0 / pow(10.0, minPSNR / 10.0);
+
+	// tolerance 0 only collapses subtrees without error, so it always qualifies
+	vector<double> tolerances = profileTolerances(profile);
+	double best = 0.0;
+	size_t lo = 0;
+	size_t hi = tolerances.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		double sse;
+		unsigned int count;
+		profileAt(profile, tolerances[mid], sse, count);
+		if (sse <= maxSse) {
+			best = max(best, tolerances[mid]);
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	Prune(best);
+	return best;
+}
+
+/**
+ *  Prunes the tree with the smallest tolerance for which Render(1),
+ *  encoded as a PNG, takes at most maxBytes.
+ *
+ * @param maxBytes largest acceptable size of the encoded PNG
+ * @return the tolerance the tree was pruned with
+ * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+ */
+double QTree::PruneToBytes(size_t maxBytes) {
+	PruneProfile profile;
+	PixelBatch leaves;
+	buildProfile(root, leaves, profile);
+
+	// the first encode is of the unpruned tree; tolerance 0 renders the same
+	double sse;
+	unsigned int measuredLeaves;
+	profileAt(profile, -1.0, sse, measuredLeaves);
+	size_t measuredBytes = encodedSize(-1.0);
+
+	vector<double> tolerances = profileTolerances(profile);
+	if (measuredBytes <= maxBytes || tolerances.empty()) {
+		Prune(0.0);
+		return 0.0;
+	}
+
+	vector<unsigned int> counts(tolerances.size());
+	for (size_t i = 0; i < tolerances.size(); i++) {
+		profileAt(profile, tolerances[i], sse, counts[i]);
+	}
+
+	// tolerances[fits] is known to fit, and every tolerance below
+	// tolerances[fails] is known not to. Sizes are modelled as a power of
+	// the leaf count, fitted through the smallest fit and the largest
+	// failure, or through the last two failures until something fits.
+	size_t fits = tolerances.size();
+	size_t fails = 0;
+	double failLeaves = measuredLeaves;
+	double failBytes = measuredBytes;
+	double fitLeaves = 0.0;
+	double fitBytes = 0.0;
+	double prevLeaves = 0.0;
+	double prevBytes = 0.0;
+
+	for (unsigned int round = 1; round < MAX_SIZE_ENCODES && fails < fits; round++) {
+		double fromLeaves = failLeaves;
+		double fromBytes = failBytes;
+		double power = 0.0;
+		if (fits < tolerances.size()) {
+			power = log(failBytes / fitBytes) / log(failLeaves / fitLeaves);
+			fromLeaves = fitLeaves;
+			fromBytes = fitBytes;
+		} else if (prevLeaves > 0) {
+			power = log(prevBytes / failBytes) / log(prevLeaves / failLeaves);
+		}
+		if (!(power > 0.05 && power < 20)) {
+			// no usable trend yet: assume the bytes per leaf stay the same
+			power = 1.0;
+		}
+		double aim = fromLeaves * pow(maxBytes / fromBytes, 1.0 / power);
+
+		// the first tolerance leaving no more than aim leaves
+		size_t guess = fails;
+		while (guess < fits - 1 && counts[guess] > aim) {
+			guess++;
+		}
+
+		measuredBytes = encodedSize(tolerances[guess]);
+		if (measuredBytes <= maxBytes) {
+			fits = guess;
+			fitLeaves = counts[guess];
+			fitBytes = measuredBytes;
+		} else {
+			fails = guess + 1;
+			prevLeaves = failLeaves;
+			prevBytes = failBytes;
+			failLeaves = counts[guess];
+			failBytes = measuredBytes;
+		}
+	}
+
+	double best = tolerances[min(fits, tolerances.size() - 1)];
+	Prune(best);
+	return best;
+}
+
+/**
+ * Fills in profile for the subtree rooted at node, appending its leaves to
+ * leaves in preorder.
+ */
+void QTree::buildProfile(Node* node, PixelBatch& leaves, PruneProfile& profile) const {
+	if (!node) {
+		return;
+	}
+
+	size_t at = profile.threshold.size();
+	size_t begin = leaves.size();
+	profile.threshold.push_back(-numeric_limits<double>::infinity());
+	profile.sse.push_back(0.0);
+	profile.nodeEnd.push_back(0);
+
+	if (!node->NW && !node->NE && !node->SW && !node->SE) {
+		leaves.push(node->avg, nodeWidth(node) * nodeHeight(node));
+	} else {
+		buildProfile(node->NW, leaves, profile);
+		buildProfile(node->NE, leaves, profile);
+		buildProfile(node->SW, leaves, profile);
+		buildProfile(node->SE, leaves, profile);
+
+		// Prune collapses the node once every leaf is within tolerance
+		double worst = 0.0;
+		leaves.addError(node->avg, begin, leaves.size(), profile.sse[at], worst);
+		profile.threshold[at] = worst;
+	}
+
+	profile.nodeEnd[at] = (unsigned int) profile.threshold.size();
+}
+
+/**
+ * Works out the squared error and leaf count Prune(tol) would give.
+ */
+void QTree::profileAt(const PruneProfile& profile, double tol, double& sse, unsigned int& leaves) {
+	sse = 0.0;
+	leaves = 0;
+
+	size_t i = 0;
+	while (i < profile.threshold.size()) {
+		if (profile.threshold[i] <= tol) {
+			sse += profile.sse[i];
+			leaves++;
+			i = profile.nodeEnd[i];
+		} else {
+			i++;
+		}
+	}
+}
+
+/**
+ * Returns the distinct tolerances at which some node collapses, in
+ * increasing order.
+ */
+vector<double> QTree::profileTolerances(const PruneProfile& profile) {
+	vector<double> tolerances;
+	for (size_t i = 0; i < profile.threshold.size(); i++) {
+		if (profile.nodeEnd[i] != i + 1) {
+			tolerances.push_back(profile.threshold[i]);
+		}
+	}
+
+	sort(tolerances.begin(), tolerances.end());
+	tolerances.erase(unique(tolerances.begin(), tolerances.end()), tolerances.end());
+	return tolerances;
+}
+
+/**
+ * Returns the size of Render(1) encoded as a PNG after Prune(tol), without
+ * changing this tree.
+ */
+size_t QTree::encodedSize(double tol) const {
+	QTree pruned(*this);
+	pruned.Prune(tol);
+
+	vector<unsigned char> encoded;
+	pruned.Render(1).writeToBuffer(encoded);
+	return encoded.size();
+}
+
+void QTree::resetPruneStats() {
+	pruneStats.pixels = (unsigned long long) width * height;
+	pruneStats.prunedPixels = 0;
+	pruneStats.prunedSubtrees = 0;
+	pruneStats.sse = 0.0;
+	pruneStats.maxError = 0.0;
 }
 
 /**
@@ -95,7 +414,7 @@ void QTree::Prune(double tolerance) {
  *
  */
 void QTree::FlipHorizontal() {
-	flipHorizontal(root);
+	replaceRoot(flipHorizontal(root, make_pair(0u, 0u), false));
 }
 
 /**
@@ -114,15 +433,136 @@ void QTree::RotateCCW() {
     unsigned int temp = height;
 	height = width;
 	width = temp;
-	rotateCCW(root);
+	replaceRoot(rotateCCW(root, make_pair(0u, 0u), false));
+}
+
+/**
+ *  Chooses how this tree releases its nodes when it is destroyed or
+ *  reassigned. When deferred, the root is handed to the background
+ *  NodeReclaimer instead of being deleted on the calling thread; if
+ *  the reclaimer's queue is full the nodes are freed immediately.
+ *
+ * @param deferred true to release nodes on the reclaimer thread
+ */
+void QTree::SetDeferredClear(bool deferred) {
+	deferClear = deferred;
+}
+
+/**
+ *  Deduplicate merges subtrees that describe identical regions of the
+ *  image (same sizes, same colors, same shape) wherever they occur, so
+ *  that each distinct region is stored only once and the tree becomes a
+ *  DAG. Subtrees are matched by their position-independent hash and
+ *  then compared exactly, so hash collisions never merge different
+ *  regions. Rendering is unaffected.
+ */
+void QTree::Deduplicate() {
+	unordered_map<uint64_t, Node*> seen;
+	replaceRoot(dedupNode(root, seen, false));
+}
+
+/**
+ *  Update brings the tree up to date after the pixels inside the
+ *  rectangle [ul, lr] of the source image have changed. Subtrees that
+ *  lie entirely inside the rectangle, and leaves that overlap it, are
+ *  rebuilt from img; the average colors of their ancestors are then
+ *  recomputed. Every other subtree is left untouched.
+ *
+ * @param img the changed image, in the tree's current orientation.
+ * @param ul upper left point of the changed rectangle.
+ * @param lr lower right point of the changed rectangle.
+ * @pre img has the same dimensions as the tree.
+ */
+void QTree::Update(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	if (ul.first >= width || ul.second >= height) {
+		return;
+	}
+
+	// rebuilt leaves may reach outside [ul, lr], so img must cover the tree
+	if (!img.contains(0, 0, width, height)) {
+		cerr << "QTree::Update: image is smaller than the tree" << endl;
+		return;
+	}
+
+	lr.first = min(lr.first, width - 1);
+	lr.second = min(lr.second, height - 1);
+	replaceRoot(updateNode(root, img, make_pair(0u, 0u), ul, lr, false));
+}
+
+/**
+ *  Crop returns a tree for the rectangle [ul, lr] of this tree's
+ *  image, without rendering. Subtrees of this tree that line up exactly
+ *  with a node of the cropped tree are shared rather than copied, and
+ *  regions covered by a single leaf stay a single leaf.
+ *
+ * @param ul upper left point of the rectangle to keep.
+ * @param lr lower right point of the rectangle to keep; clamped to the image.
+ * @pre ul lies inside the image and ul <= lr in both coordinates.
+ */
+QTree QTree::Crop(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const {
+	lr.first = min(lr.first, width - 1);
+	lr.second = min(lr.second, height - 1);
+
+	pair<unsigned int, unsigned int> outLR(lr.first - ul.first, lr.second - ul.second);
+	Node* nd = resampleNode(root, make_pair(0u, 0u), make_pair(0u, 0u), outLR, 1, ul);
+	return QTree(nd, outLR.first + 1, outLR.second + 1);
+}
+
+/**
+ *  Downscale returns a tree for this tree's image shrunk by a factor of
+ *  2^levels in each dimension (rounding up), without rendering. Each
+ *  pixel of the result is the average of the block of pixels it
+ *  replaces, read from the average colors stored in the tree.
+ *
+ * @param levels number of times to halve each dimension.
+ * @pre 2^levels does not overflow an unsigned int.
+ */
+QTree QTree::Downscale(unsigned int levels) const {
+	unsigned int factor = 1u << levels;
+	pair<unsigned int, unsigned int> outLR((width + factor - 1) / factor - 1, (height + factor - 1) / factor - 1);
+	Node* nd = resampleNode(root, make_pair(0u, 0u), make_pair(0u, 0u), outLR, factor, make_pair(0u, 0u));
+	return QTree(nd, outLR.first + 1, outLR.second + 1);
+}
+
+/**
+ *  Overlay composites the image of top over this tree's image, with
+ *  top's upper left corner placed at (x, y), without rendering either
+ *  tree. Wherever top is fully transparent this tree is left as is,
+ *  wherever top is fully opaque over a whole node that node is replaced
+ *  outright, and only the remaining regions are subdivided and blended.
+ *
+ * @param top the tree to draw on top of this one.
+ * @param x column of this tree's image where top's left edge lands.
+ * @param y row of this tree's image where top's top edge lands.
+ */
+void QTree::Overlay(const QTree& top, unsigned int x, unsigned int y) {
+	if (!top.root || x >= width || y >= height) {
+		return;
+	}
+
+	replaceRoot(overlayNode(root, make_pair(0u, 0u), top, make_pair(x, y), false));
+}
+
+/**
+ * Counts the number of distinct nodes stored for the tree. This is
+ * smaller than CountNodes once Deduplicate has merged repeated regions.
+ */
+unsigned int QTree::CountUniqueNodes() const {
+	unordered_set<Node*> seen;
+	countUnique(root, seen);
+	return seen.size();
 }
 
 /**
  * Destroys all dynamically allocated memory associated with the
- * current QTree object.
+ * current QTree object. With deferred clearing enabled the nodes are
+ * released on the reclaimer thread instead.
  */
 void QTree:: Clear() {
-	clear(root);
+	if (!deferClear || !NodeReclaimer::Instance().Defer(root)) {
+		clear(root);
+	}
+	root = nullptr;
 	height = 0;
 	width = 0;
 }
@@ -130,173 +570,332 @@ void QTree:: Clear() {
 /**
  * Copies the parameter other QTree into the current QTree.
  * Does not free any memory. Called by copy constructor and operator=.
+ * The copy shares every node with other; nodes are only duplicated
+ * when one of the trees later modifies them.
  * @param other The QTree to be copied.
  */
 void QTree::Copy(const QTree& other) {
 	width = other.width;
     height = other.height;
-	root = copy(other.root);
+	deferClear = other.deferClear;
+	pruneStats = other.pruneStats;
+	root = retain(other.root);
 }
 
 /**
  * Private helper function for the constructor. Recursively builds
  * the tree according to the specification of the constructor.
+ *
+ * The rectangle is scanned once up front: fully opaque rectangles are
+ * built by a variant that does no alpha arithmetic, and otherwise any
+ * fully transparent sub-rectangle becomes a single transparent leaf
+ * instead of being split down to pixels. The leaf keeps the average red,
+ * green and blue of the pixels it replaces, so that the averages of the
+ * nodes above it are as they would be had it been split.
+ *
  * @param img reference to the original input image.
  * @param ul upper left point of current node's rectangle.
  * @param lr lower right point of current node's rectangle.
  */
-Node* QTree::BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+Node* QTree::BuildNode(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	VisibleTable visible;
+	if (isOpaque(img, ul, lr)) {
+		return buildNode<true>(img, ul, lr, visible);
+	}
+
+	countVisible(img, ul, lr, visible);
+	return buildNode<false>(img, ul, lr, visible);
+}
+
+template <bool Opaque>
+Node* QTree::buildNode(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, const VisibleTable& visible) {
 	if (ul == lr) {
-		Node * nd = new Node(ul, lr, *img.getPixel(ul.first, ul.second));
+		Node * nd = new Node(ul, lr, img.pixel(ul.first, ul.second));
 		return nd;
 	}
 
+	if (!Opaque && visibleIn(visible, ul, lr) == 0) {
+		return new Node(ul, lr, transparentAverage(visible, ul, lr));
+	}
+
 	unsigned int midX = (ul.first + lr.first) / 2;
 	unsigned int midY = (ul.second + lr.second) / 2;
 
-	Node *NW = BuildNode(img, ul, pair<unsigned int, unsigned int>(midX, midY));
+	Node *NW = buildNode<Opaque>(img, ul, pair<unsigned int, unsigned int>(midX, midY), visible);
 	Node *NE = nullptr;
 	Node *SW = nullptr;
 	Node *SE = nullptr;
 
-	unsigned int areaNW;
-	unsigned int areaSW;
-	unsigned int areaNE;
-	unsigned int areaSE;
-
 	if (lr.first == ul.first){
-		SW = BuildNode(img, make_pair(ul.first, midY + 1), make_pair(midX, lr.second));
+		SW = buildNode<Opaque>(img, make_pair(ul.first, midY + 1), make_pair(midX, lr.second), visible);
 	} else {
-		NE = BuildNode(img, make_pair(midX + 1, ul.second), make_pair(lr.first, midY));
+		NE = buildNode<Opaque>(img, make_pair(midX + 1, ul.second), make_pair(lr.first, midY), visible);
 		if (ul.second != lr.second) {
-			SW = BuildNode(img, make_pair(ul.first, midY + 1), make_pair(midX, lr.second));
-			SE = BuildNode(img, make_pair(midX + 1, midY + 1), lr);
+			SW = buildNode<Opaque>(img, make_pair(ul.first, midY + 1), make_pair(midX, lr.second), visible);
+			SE = buildNode<Opaque>(img, make_pair(midX + 1, midY + 1), lr, visible);
 		}
 	}
 
-	areaNW = (midX - ul.first + 1) * (midY - ul.second + 1);
-	areaNE = (lr.first - (midX + 1) + 1) * (midY - ul.second + 1);
-	areaSW = (midX - ul.first + 1) * (lr.second - (midY + 1) + 1);
-	areaSE = (lr.first - (midX + 1) + 1) * (lr.second - (midY + 1) + 1);
+	Node *newNode = new Node(ul, lr, RGBAPixel());
+	newNode->NW = NW;
+	newNode->NE = NE;
+	newNode->SW = SW;
+	newNode->SE = SE;
+	newNode->avg = averageOf<Opaque>(newNode);
+	newNode->Rehash();
 
-	unsigned int totalArea = (lr.first - ul.first + 1) * (lr.second - ul.second + 1);
-	
-	int totalR = 0;
-	int totalB = 0;
-	int totalG = 0;
+	return newNode;
+}
+
+/**
+ * Computes the average color of nd's rectangle from the average colors of
+ * its children, weighting each child by its area. The Opaque variant
+ * assumes every child has alpha 1 and skips the alpha sum.
+ * @param nd a node with at least one child.
+ */
+template <bool Opaque>
+RGBAPixel QTree::averageOf(Node* nd) {
+	// 255 times the area outgrows an int beyond about 8 megapixels
+	unsigned long long totalArea = (unsigned long long) nodeWidth(nd) * nodeHeight(nd);
+
+	unsigned long long totalR = 0;
+	unsigned long long totalB = 0;
+	unsigned long long totalG = 0;
 	double totalA = 0.0;
 
-	if (NW != nullptr) {
-    	totalR += NW->avg.r * areaNW;
-    	totalB += NW->avg.b * areaNW;
-    	totalG += NW->avg.g * areaNW;
-    	totalA += NW->avg.a * areaNW;
+	Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+	for (Node* child : children) {
+		if (child != nullptr) {
+			unsigned long long area = (unsigned long long) nodeWidth(child) * nodeHeight(child);
+			totalR += child->avg.r * area;
+			totalB += child->avg.b * area;
+			totalG += child->avg.g * area;
+			if (!Opaque) {
+				totalA += child->avg.a * area;
+			}
+		}
 	}
 
-	if (NE != nullptr) {
-    	totalR += NE->avg.r * areaNE;
-    	totalB += NE->avg.b * areaNE;
-    	totalG += NE->avg.g * areaNE;
-    	totalA += NE->avg.a * areaNE;
+	int r = totalR / totalArea;
+	int g = totalG / totalArea;
+	int b = totalB / totalArea;
+	double a = Opaque ? 1.0 : totalA / totalArea;
+
+	return RGBAPixel(r, g, b, a);
+}
+
+template RGBAPixel QTree::averageOf<false>(Node* nd);
+
+bool QTree::isOpaque(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	if (img.format() == PIXEL_FORMAT_RGBA8) {
+		for (unsigned int y = ul.second; y <= lr.second; y++) {
+			unsigned char* row = img.rowBytes(y) + 4 * ul.first;
+			for (unsigned int x = 0; x <= lr.first - ul.first; x++) {
+				if (row[4 * x + 3] != 255) {
+					return false;
+				}
+			}
+		}
+		return true;
 	}
 
-	if (SW != nullptr) {
-    	totalR += SW->avg.r * areaSW;
-    	totalB += SW->avg.b * areaSW;
-    	totalG += SW->avg.g * areaSW;
-    	totalA += SW->avg.a * areaSW;
+	for (unsigned int y = ul.second; y <= lr.second; y++) {
+		RGBAPixel* row = img.row(y) + ul.first;
+		for (unsigned int x = 0; x <= lr.first - ul.first; x++) {
+			if (row[x].a != 1.0) {
+				return false;
+			}
+		}
 	}
 
-	if (SE != nullptr) {
-    	totalR += SE->avg.r * areaSE;
-    	totalB += SE->avg.b * areaSE;
-    	totalG += SE->avg.g * areaSE;
-    	totalA += SE->avg.a * areaSE;
+	return true;
+}
+
+void QTree::countVisible(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, VisibleTable& visible) {
+	unsigned int w = lr.first - ul.first + 1;
+	unsigned int h = lr.second - ul.second + 1;
+
+	visible.origin = ul;
+	visible.stride = w + 1;
+	visible.sums.assign((size_t) (w + 1) * (h + 1), 0);
+	visible.colorSums.assign((size_t) (w + 1) * (h + 1) * 3, 0);
+
+	for (unsigned int y = 0; y < h; y++) {
+		unsigned int rowCount = 0;
+		unsigned long long rowColor[3] = { 0, 0, 0 };
+		for (unsigned int x = 0; x < w; x++) {
+			RGBAPixel px = img.pixel(ul.first + x, ul.second + y);
+			rowCount += px.a != 0 ? 1 : 0;
+			rowColor[0] += px.r;
+			rowColor[1] += px.g;
+			rowColor[2] += px.b;
+
+			size_t at = (size_t) (y + 1) * visible.stride + x + 1;
+			size_t above = (size_t) y * visible.stride + x + 1;
+			visible.sums[at] = visible.sums[above] + rowCount;
+			for (unsigned int c = 0; c < 3; c++) {
+				visible.colorSums[3 * at + c] = visible.colorSums[3 * above + c] + rowColor[c];
+			}
+		}
 	}
+}
 
-	int r = totalR / totalArea;
-	int g = totalG / totalArea;
-	int b = totalB / totalArea;
-	double a = totalA / totalArea;
+unsigned int QTree::visibleIn(const VisibleTable& visible, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	unsigned int x0 = ul.first - visible.origin.first;
+	unsigned int y0 = ul.second - visible.origin.second;
+	unsigned int x1 = lr.first - visible.origin.first + 1;
+	unsigned int y1 = lr.second - visible.origin.second + 1;
+	unsigned int stride = visible.stride;
 
-	Node *newNode = new Node(ul, lr, RGBAPixel(r, g, b, a));
-	newNode->NW = NW;
-	newNode->NE = NE;
-	newNode->SW = SW;
-	newNode->SE = SE;
+	return visible.sums[y1 * stride + x1] - visible.sums[y0 * stride + x1] - visible.sums[y1 * stride + x0] + visible.sums[y0 * stride + x0];
+}
 
-	return newNode;
+/**
+ * Returns the color of a fully transparent rectangle: alpha 0, and the
+ * average red, green and blue of its pixels.
+ */
+RGBAPixel QTree::transparentAverage(const VisibleTable& visible, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	size_t x0 = ul.first - visible.origin.first;
+	size_t y0 = ul.second - visible.origin.second;
+	size_t x1 = lr.first - visible.origin.first + 1;
+	size_t y1 = lr.second - visible.origin.second + 1;
+	size_t stride = visible.stride;
+	unsigned long long area = (unsigned long long) (x1 - x0) * (y1 - y0);
+
+	int color[3];
+	for (unsigned int c = 0; c < 3; c++) {
+		const vector<unsigned long long>& sums = visible.colorSums;
+		unsigned long long total = sums[3 * (y1 * stride + x1) + c] - sums[3 * (y0 * stride + x1) + c]
+		                           - sums[3 * (y1 * stride + x0) + c] + sums[3 * (y0 * stride + x0) + c];
+		color[c] = (int) (total / area);
+	}
+	return RGBAPixel(color[0], color[1], color[2], 0.0);
 }
 
 /*********************************************************/
 /*** Helper functions ***/
 /*********************************************************/
 
-void QTree::renderNode(Node* nd, PNG& img, unsigned int scale) const {
+unsigned int QTree::nodeWidth(Node* nd) {
+	return nd->lowRight.first - nd->upLeft.first + 1;
+}
+
+unsigned int QTree::nodeHeight(Node* nd) {
+	return nd->lowRight.second - nd->upLeft.second + 1;
+}
+
+void QTree::childCorners(Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> corners[4]) {
+	unsigned int westW = nd->NW ? nodeWidth(nd->NW) : (nd->SW ? nodeWidth(nd->SW) : 0);
+	unsigned int northH = nd->NW ? nodeHeight(nd->NW) : (nd->NE ? nodeHeight(nd->NE) : 0);
+
+	corners[0] = ul;
+	corners[1] = make_pair(ul.first + westW, ul.second);
+	corners[2] = make_pair(ul.first, ul.second + northH);
+	corners[3] = make_pair(ul.first + westW, ul.second + northH);
+}
+
+void QTree::renderNode(Node* nd, ImageView img, unsigned int scale, pair<unsigned int, unsigned int> ul, unsigned int bandTop, unsigned int bandBottom) const {
 	if (nd != nullptr) {
+		unsigned int top = max(bandTop, ul.second * scale);
+		unsigned int bottom = min(bandBottom, (ul.second + nodeHeight(nd)) * scale);
+		if (top >= bottom) {
+			return;
+		}
+
 		if (!nd->NW && !nd->NE && !nd->SW && !nd->SE) {
-			draw(img, nd->upLeft.first * scale, nd->upLeft.second * scale, scale, nd->avg);
+			draw(img, ul.first * scale, top, (ul.first + nodeWidth(nd)) * scale, bottom, nd->avg);
 		}
 
 		else {
-			renderNode(nd->NW, img, scale);
-			renderNode(nd->NE, img, scale);
-			renderNode(nd->SW, img, scale);
-			renderNode(nd->SE, img, scale);
+			pair<unsigned int, unsigned int> corners[4];
+			childCorners(nd, ul, corners);
+			renderNode(nd->NW, img, scale, corners[0], bandTop, bandBottom);
+			renderNode(nd->NE, img, scale, corners[1], bandTop, bandBottom);
+			renderNode(nd->SW, img, scale, corners[2], bandTop, bandBottom);
+			renderNode(nd->SE, img, scale, corners[3], bandTop, bandBottom);
 		}
 	}
 }
 
-void QTree::draw(PNG& img, unsigned int startX, unsigned int startY, unsigned int scale, RGBAPixel color) const {
-    for (unsigned int x = 0; x < scale; x++) {
-        for (unsigned int y = 0; y < scale; y++) {
-            *img.getPixel(startX + x, startY + y) = color;
-        }
+void QTree::draw(const ImageView& img, unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY, RGBAPixel color) const {
+    for (unsigned int y = startY; y < endY; y++) {
+        img.fill(startX, y, endX - startX, color);
     }
 }
 
-void QTree::flipHorizontal(Node* nd) {
+Node* QTree::flipHorizontal(Node* nd, pair<unsigned int, unsigned int> ul, bool shared) {
 	if (nd != nullptr) {
+		shared = shared || nd->refs > 1;
+		Node* out = shared ? new Node(nd->upLeft, nd->lowRight, nd->avg) : nd;
 
-		swap(nd->NW, nd->NE);
-    	swap(nd->SW, nd->SE);
+		pair<unsigned int, unsigned int> lr(ul.first + nodeWidth(nd) - 1, ul.second + nodeHeight(nd) - 1);
+		pair<unsigned int, unsigned int> corners[4];
+		childCorners(nd, ul, corners);
 
-		unsigned int newLx = width - 1 - nd->lowRight.first;
-		unsigned int newRx = width - 1 - nd->upLeft.first;
-		nd->upLeft.first = newLx;
-		nd->lowRight.first = newRx;
-		if (nd->upLeft.first > nd->lowRight.first) {
-			swap(nd->upLeft.first, nd->lowRight.first);
+		Node* NW = flipHorizontal(nd->NE, corners[1], shared);
+		Node* NE = flipHorizontal(nd->NW, corners[0], shared);
+		Node* SW = flipHorizontal(nd->SE, corners[3], shared);
+		Node* SE = flipHorizontal(nd->SW, corners[2], shared);
+		if (out == nd) {
+			releaseReplaced(nd->NE, NW);
+			releaseReplaced(nd->NW, NE);
+			releaseReplaced(nd->SE, SW);
+			releaseReplaced(nd->SW, SE);
 		}
+		out->NW = NW;
+		out->NE = NE;
+		out->SW = SW;
+		out->SE = SE;
 
-		flipHorizontal(nd->NW);
-		flipHorizontal(nd->NE);
-		flipHorizontal(nd->SW);
-		flipHorizontal(nd->SE);
+		unsigned int newLx = width - 1 - lr.first;
+		unsigned int newRx = width - 1 - ul.first;
+		out->upLeft = make_pair(newLx, ul.second);
+		out->lowRight = make_pair(newRx, lr.second);
+		if (out->upLeft.first > out->lowRight.first) {
+			swap(out->upLeft.first, out->lowRight.first);
+		}
+		out->Rehash();
+
+		return out;
 	}
+
+	return nd;
 }
 
-void QTree::rotateCCW(Node *nd) {
+Node* QTree::rotateCCW(Node *nd, pair<unsigned int, unsigned int> ul, bool shared) {
 	if (nd) {
-		Node *NW = nd->NW;
-		Node *SW = nd->SW;
-		Node *NE = nd->NE;
-		Node *SE = nd->SE;
-		nd->NW = NE;
-		nd->SW = NW;
-		nd->SE = SW;
-		nd->NE = SE;
+		shared = shared || nd->refs > 1;
+		Node* out = shared ? new Node(nd->upLeft, nd->lowRight, nd->avg) : nd;
+
+		pair<unsigned int, unsigned int> lr(ul.first + nodeWidth(nd) - 1, ul.second + nodeHeight(nd) - 1);
+		pair<unsigned int, unsigned int> corners[4];
+		childCorners(nd, ul, corners);
+
+		Node *NW = rotateCCW(nd->NE, corners[1], shared);
+		Node *SW = rotateCCW(nd->NW, corners[0], shared);
+		Node *SE = rotateCCW(nd->SW, corners[2], shared);
+		Node *NE = rotateCCW(nd->SE, corners[3], shared);
+		if (out == nd) {
+			releaseReplaced(nd->NE, NW);
+			releaseReplaced(nd->NW, SW);
+			releaseReplaced(nd->SW, SE);
+			releaseReplaced(nd->SE, NE);
+		}
+		out->NW = NW;
+		out->SW = SW;
+		out->SE = SE;
+		out->NE = NE;
 
-		pair<unsigned int, unsigned int> uL = make_pair(nd->upLeft.second, height - nd->lowRight.first - 1);
-		pair<unsigned int, unsigned int> lR = make_pair(nd->lowRight.second, height - nd->upLeft.first - 1);
-		nd->upLeft = uL;
-		nd->lowRight = lR;
+		pair<unsigned int, unsigned int> uL = make_pair(ul.second, height - lr.first - 1);
+		pair<unsigned int, unsigned int> lR = make_pair(lr.second, height - ul.first - 1);
+		out->upLeft = uL;
+		out->lowRight = lR;
+		out->Rehash();
 
-		rotateCCW(nd->NW);
-		rotateCCW(nd->NE);
-		rotateCCW(nd->SE);
-		rotateCCW(nd->SW);
+		return out;
 	}
+
+	return nd;
 }
 
 void QTree::clear(Node* nd) {
@@ -304,61 +903,160 @@ void QTree::clear(Node* nd) {
 		return;
 	}
 
+	if (--nd->refs > 0) {
+		return;
+	}
+
 	clear(nd->NW);
 	clear(nd->NE);
 	clear(nd->SW);
 	clear(nd->SE);
 
 	delete nd;
-	nd = nullptr;
 }
 
-Node* QTree::copy(Node* nd) const {
-	if (!nd) {
+Node* QTree::retain(Node* nd) {
+	if (nd) {
+		nd->refs++;
+	}
+
+	return nd;
+}
+
+Node* QTree::unshare(Node* nd, bool shared) {
+	if (!shared) {
 		return nd;
 	}
 
-	Node* newRoot = new Node(nd->upLeft, nd->lowRight, nd->avg);
+	Node* cp = new Node(nd->upLeft, nd->lowRight, nd->avg);
+	cp->NW = retain(nd->NW);
+	cp->NE = retain(nd->NE);
+	cp->SW = retain(nd->SW);
+	cp->SE = retain(nd->SE);
+
+	return cp;
+}
 
-	newRoot->NW = copy(nd->NW);
-	newRoot->NE = copy(nd->NE);
-    newRoot->SW = copy(nd->SW);
-    newRoot->SE = copy(nd->SE);
+void QTree::replaceChild(Node*& slot, Node* nd) {
+	if (slot != nd) {
+		clear(slot);
+		slot = nd;
+	}
+}
+
+void QTree::releaseReplaced(Node* old, Node* nd) {
+	if (old != nd) {
+		clear(old);
+	}
+}
 
-	return newRoot;
+void QTree::replaceRoot(Node* nd) {
+	if (root != nd) {
+		clear(root);
+		root = nd;
+	}
 }
 
-void QTree::pruneSt(Node* node, double tolerance) {
+Node* QTree::pruneSt(Node* node, double tolerance, bool shared, PruneScratch& scratch) {
 	if (!node) {
-		return;
+		return node;
 	}
 
     if (!node->NW && !node->NE && !node->SW && !node->SE) {
-		return;
+		return node;
 	}
 
-    if (leavesUnderTol(node, tolerance, node->avg)) {
+	shared = shared || node->refs > 1;
+
+    if (leavesUnderTol(node, tolerance, scratch)) {
+		pruneStats.prunedPixels += scratch.area;
+		pruneStats.prunedSubtrees++;
+		pruneStats.sse += scratch.sse;
+		pruneStats.maxError = max(pruneStats.maxError, scratch.worst);
+
+		if (shared) {
+			return new Node(node->upLeft, node->lowRight, node->avg);
+		}
         clearSt(node);
-        return;
+		node->Rehash();
+        return node;
     }
 	
-    pruneSt(node->NW, tolerance);
-    pruneSt(node->NE, tolerance);
-    pruneSt(node->SW, tolerance);
-    pruneSt(node->SE, tolerance);
+    Node* NW = pruneSt(node->NW, tolerance, shared, scratch);
+    Node* NE = pruneSt(node->NE, tolerance, shared, scratch);
+    Node* SW = pruneSt(node->SW, tolerance, shared, scratch);
+    Node* SE = pruneSt(node->SE, tolerance, shared, scratch);
+
+	if (NW == node->NW && NE == node->NE && SW == node->SW && SE == node->SE) {
+		return node;
+	}
+
+	Node* out = unshare(node, shared);
+	replaceChild(out->NW, NW);
+	replaceChild(out->NE, NE);
+	replaceChild(out->SW, SW);
+	replaceChild(out->SE, SE);
+	out->Rehash();
+
+	return out;
 }
 
-bool QTree::leavesUnderTol(Node* node, double tolerance, RGBAPixel avg) const {
-	if (!node) {
-		return true;
+/**
+ * Tests whether every leaf under node is within tolerance of node's average.
+ * Leaves are collected in preorder into scratch.leaves and tested a chunk
+ * at a time; the first chunk is small so that a subtree which fails early
+ * costs little, and the chunks then double in size. When the whole
+ * subtree passes, the error of collapsing it is left in scratch.
+ */
+bool QTree::leavesUnderTol(Node* node, double tolerance, PruneScratch& scratch) const {
+	scratch.area = (unsigned long long) nodeWidth(node) * nodeHeight(node);
+	scratch.sse = 0.0;
+	scratch.worst = pruneStats.maxError; // lets addError skip chunks that cannot raise it
+
+	// every fully transparent pixel is the same distance from avg, and
+	// looks the same as avg
+	if (node->avg.a == 0) {
+		double dist = RGBAPixel(0, 0, 0, 0.0).distanceTo(node->avg);
+		scratch.worst = max(scratch.worst, dist);
+		return (dist <= tolerance);
 	}
 
-    if (!node->NW && !node->NE && !node->SW && !node->SE) {
-        return (node->avg.distanceTo(avg) <= tolerance);
-    }
+	PixelBatch& leaves = scratch.leaves;
+	vector<Node*>& pending = scratch.pending;
+	size_t tested = 0;
+	size_t chunk = MIN_PRUNE_CHUNK;
+
+	leaves.clear();
+	pending.clear();
+	pending.push_back(node);
+
+	while (!pending.empty()) {
+		Node* curr = pending.back();
+		pending.pop_back();
+
+		if (!curr->NW && !curr->NE && !curr->SW && !curr->SE) {
+			leaves.push(curr->avg, nodeWidth(curr) * nodeHeight(curr));
+			if (leaves.size() - tested == chunk) {
+				if (!leaves.allWithin(node->avg, tolerance, tested, leaves.size())) {
+					return false;
+				}
+				tested = leaves.size();
+				chunk = min(chunk * 2, MAX_PRUNE_CHUNK);
+			}
+			continue;
+		}
+
+		if (curr->SE) pending.push_back(curr->SE);
+		if (curr->SW) pending.push_back(curr->SW);
+		if (curr->NE) pending.push_back(curr->NE);
+		if (curr->NW) pending.push_back(curr->NW);
+	}
 
-    return (leavesUnderTol(node->NW, tolerance, avg) && leavesUnderTol(node->NE, tolerance, avg) &&
-           leavesUnderTol(node->SW, tolerance, avg) && leavesUnderTol(node->SE, tolerance, avg));
+	if (!leaves.allWithin(node->avg, tolerance, tested, leaves.size())) {
+		return false;
+	}
+	leaves.addError(node->avg, 0, leaves.size(), scratch.sse, scratch.worst);
+	return true;
 }
 
 void QTree::clearSt(Node* node) {
@@ -366,19 +1064,315 @@ void QTree::clearSt(Node* node) {
 		return;
 	}
 
-    clearSt(node->NW);
-    clearSt(node->NE);
-    clearSt(node->SW);
-    clearSt(node->SE);
-	printf("My age is ");
-
-    delete node->NW;
-    delete node->NE;
-    delete node->SW;
-    delete node->SE;
+    clear(node->NW);
+    clear(node->NE);
+    clear(node->SW);
+    clear(node->SE);
 
     node->NW = nullptr;
     node->NE = nullptr;
     node->SW = nullptr;
     node->SE = nullptr;
-}
\ No newline at end of file
+}
+
+Node* QTree::dedupNode(Node* node, unordered_map<uint64_t, Node*>& seen, bool shared) {
+	if (!node) {
+		return node;
+	}
+
+	shared = shared || node->refs > 1;
+
+	Node* NW = dedupNode(node->NW, seen, shared);
+	Node* NE = dedupNode(node->NE, seen, shared);
+	Node* SW = dedupNode(node->SW, seen, shared);
+	Node* SE = dedupNode(node->SE, seen, shared);
+
+	Node* out = node;
+	if (NW != node->NW || NE != node->NE || SW != node->SW || SE != node->SE) {
+		out = unshare(node, shared);
+		replaceChild(out->NW, NW);
+		replaceChild(out->NE, NE);
+		replaceChild(out->SW, SW);
+		replaceChild(out->SE, SE);
+	}
+
+	unordered_map<uint64_t, Node*>::iterator match = seen.find(out->hash);
+	if (match == seen.end()) {
+		seen[out->hash] = out;
+		return out;
+	}
+
+	if (match->second == out || !sameNode(match->second, out)) {
+		return out;
+	}
+
+	if (out != node) {
+		clear(out);
+	}
+	return retain(match->second);
+}
+
+bool QTree::sameNode(Node* a, Node* b) const {
+	// children have already been merged, so equal subtrees share child pointers
+	return nodeWidth(a) == nodeWidth(b) && nodeHeight(a) == nodeHeight(b) &&
+	       a->avg.r == b->avg.r && a->avg.g == b->avg.g && a->avg.b == b->avg.b && a->avg.a == b->avg.a &&
+	       a->NW == b->NW && a->NE == b->NE && a->SW == b->SW && a->SE == b->SE;
+}
+
+void QTree::countUnique(Node* node, unordered_set<Node*>& seen) const {
+	if (!node || !seen.insert(node).second) {
+		return;
+	}
+
+	countUnique(node->NW, seen);
+	countUnique(node->NE, seen);
+	countUnique(node->SW, seen);
+	countUnique(node->SE, seen);
+}
+
+Node* QTree::updateNode(Node* node, const ImageView& img, pair<unsigned int, unsigned int> ul,
+                        pair<unsigned int, unsigned int> dirtyUL, pair<unsigned int, unsigned int> dirtyLR, bool shared) {
+	if (!node) {
+		return node;
+	}
+
+	pair<unsigned int, unsigned int> lr(ul.first + nodeWidth(node) - 1, ul.second + nodeHeight(node) - 1);
+	if (lr.first < dirtyUL.first || ul.first > dirtyLR.first || lr.second < dirtyUL.second || ul.second > dirtyLR.second) {
+		return node;
+	}
+
+	bool inside = ul.first >= dirtyUL.first && ul.second >= dirtyUL.second && lr.first <= dirtyLR.first && lr.second <= dirtyLR.second;
+	if (inside || (!node->NW && !node->NE && !node->SW && !node->SE)) {
+		return BuildNode(img, ul, lr);
+	}
+
+	shared = shared || node->refs > 1;
+
+	pair<unsigned int, unsigned int> corners[4];
+	childCorners(node, ul, corners);
+	Node* NW = updateNode(node->NW, img, corners[0], dirtyUL, dirtyLR, shared);
+	Node* NE = updateNode(node->NE, img, corners[1], dirtyUL, dirtyLR, shared);
+	Node* SW = updateNode(node->SW, img, corners[2], dirtyUL, dirtyLR, shared);
+	Node* SE = updateNode(node->SE, img, corners[3], dirtyUL, dirtyLR, shared);
+
+	Node* out = unshare(node, shared);
+	replaceChild(out->NW, NW);
+	replaceChild(out->NE, NE);
+	replaceChild(out->SW, SW);
+	replaceChild(out->SE, SE);
+	out->avg = averageOf(out);
+	out->Rehash();
+
+	return out;
+}
+
+Node* QTree::resampleNode(Node* src, pair<unsigned int, unsigned int> srcUL, pair<unsigned int, unsigned int> ul,
+                          pair<unsigned int, unsigned int> lr, unsigned int scale, pair<unsigned int, unsigned int> offset) const {
+	// region of this tree's image covered by the output rectangle [ul, lr]
+	pair<unsigned int, unsigned int> regionUL(offset.first + ul.first * scale, offset.second + ul.second * scale);
+	pair<unsigned int, unsigned int> regionLR(min(offset.first + (lr.first + 1) * scale, width) - 1,
+	                                          min(offset.second + (lr.second + 1) * scale, height) - 1);
+
+	src = containing(src, srcUL, regionUL, regionLR);
+
+	if (!src->NW && !src->NE && !src->SW && !src->SE) {
+		return new Node(ul, lr, src->avg);
+	}
+
+	if (scale == 1 && srcUL == regionUL && nodeWidth(src) == lr.first - ul.first + 1 && nodeHeight(src) == lr.second - ul.second + 1) {
+		return retain(src);
+	}
+
+	if (ul == lr) {
+		return new Node(ul, lr, regionAverage(src, srcUL, regionUL, regionLR));
+	}
+
+	// split the output rectangle the same way BuildNode does
+	unsigned int midX = (ul.first + lr.first) / 2;
+	unsigned int midY = (ul.second + lr.second) / 2;
+
+	Node* nd = new Node(ul, lr, RGBAPixel());
+	nd->NW = resampleNode(src, srcUL, ul, make_pair(midX, midY), scale, offset);
+	if (lr.first == ul.first) {
+		nd->SW = resampleNode(src, srcUL, make_pair(ul.first, midY + 1), make_pair(midX, lr.second), scale, offset);
+	} else {
+		nd->NE = resampleNode(src, srcUL, make_pair(midX + 1, ul.second), make_pair(lr.first, midY), scale, offset);
+		if (ul.second != lr.second) {
+			nd->SW = resampleNode(src, srcUL, make_pair(ul.first, midY + 1), make_pair(midX, lr.second), scale, offset);
+			nd->SE = resampleNode(src, srcUL, make_pair(midX + 1, midY + 1), lr, scale, offset);
+		}
+	}
+	nd->avg = averageOf(nd);
+	nd->Rehash();
+
+	return nd;
+}
+
+RGBAPixel QTree::regionAverage(Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> regionUL,
+                               pair<unsigned int, unsigned int> regionLR) const {
+	unsigned long long totals[4] = { 0, 0, 0, 0 };
+	double totalA = 0.0;
+	regionTotals(nd, ul, regionUL, regionLR, totals, totalA);
+
+	unsigned long long area = totals[3];
+	return RGBAPixel(totals[0] / area, totals[1] / area, totals[2] / area, totalA / area);
+}
+
+void QTree::regionTotals(Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> regionUL,
+                         pair<unsigned int, unsigned int> regionLR, unsigned long long totals[4], double& totalA) const {
+	if (!nd) {
+		return;
+	}
+
+	unsigned int x0 = max(ul.first, regionUL.first);
+	unsigned int y0 = max(ul.second, regionUL.second);
+	unsigned int x1 = min(ul.first + nodeWidth(nd) - 1, regionLR.first);
+	unsigned int y1 = min(ul.second + nodeHeight(nd) - 1, regionLR.second);
+	if (x0 > x1 || y0 > y1) {
+		return;
+	}
+
+	unsigned long long overlap = (unsigned long long) (x1 - x0 + 1) * (y1 - y0 + 1);
+	bool inside = overlap == (unsigned long long) nodeWidth(nd) * nodeHeight(nd);
+
+	// a node fully inside the region, or a leaf, contributes its average color
+	if (inside || (!nd->NW && !nd->NE && !nd->SW && !nd->SE)) {
+		totals[0] += nd->avg.r * overlap;
+		totals[1] += nd->avg.g * overlap;
+		totals[2] += nd->avg.b * overlap;
+		totals[3] += overlap;
+		totalA += nd->avg.a * overlap;
+		return;
+	}
+
+	pair<unsigned int, unsigned int> corners[4];
+	childCorners(nd, ul, corners);
+	regionTotals(nd->NW, corners[0], regionUL, regionLR, totals, totalA);
+	regionTotals(nd->NE, corners[1], regionUL, regionLR, totals, totalA);
+	regionTotals(nd->SW, corners[2], regionUL, regionLR, totals, totalA);
+	regionTotals(nd->SE, corners[3], regionUL, regionLR, totals, totalA);
+}
+
+Node* QTree::containing(Node* nd, pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int> regionUL,
+                        pair<unsigned int, unsigned int> regionLR) {
+	bool descended = true;
+	while (descended) {
+		descended = false;
+		pair<unsigned int, unsigned int> corners[4];
+		childCorners(nd, ul, corners);
+		Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+		for (int i = 0; i < 4 && !descended; i++) {
+			Node* child = children[i];
+			if (child && corners[i].first <= regionUL.first && corners[i].second <= regionUL.second &&
+			    corners[i].first + nodeWidth(child) > regionLR.first && corners[i].second + nodeHeight(child) > regionLR.second) {
+				nd = child;
+				ul = corners[i];
+				descended = true;
+			}
+		}
+	}
+
+	return nd;
+}
+
+Node* QTree::overlayNode(Node* node, pair<unsigned int, unsigned int> ul, const QTree& top, pair<unsigned int, unsigned int> at, bool shared) {
+	if (!node) {
+		return node;
+	}
+
+	// part of this node covered by top, in this tree's coordinates
+	pair<unsigned int, unsigned int> lr(ul.first + nodeWidth(node) - 1, ul.second + nodeHeight(node) - 1);
+	pair<unsigned int, unsigned int> coverUL(max(ul.first, at.first), max(ul.second, at.second));
+	pair<unsigned int, unsigned int> coverLR(min(lr.first, at.first + top.width - 1), min(lr.second, at.second + top.height - 1));
+	if (coverUL.first > coverLR.first || coverUL.second > coverLR.second) {
+		return node;
+	}
+	bool covered = coverUL == ul && coverLR == lr;
+
+	// smallest node of top that spans the whole covered part
+	pair<unsigned int, unsigned int> topUL(0, 0);
+	Node* t = containing(top.root, topUL, make_pair(coverUL.first - at.first, coverUL.second - at.second),
+	                     make_pair(coverLR.first - at.first, coverLR.second - at.second));
+	bool topLeaf = !t->NW && !t->NE && !t->SW && !t->SE;
+	bool baseLeaf = !node->NW && !node->NE && !node->SW && !node->SE;
+
+	if (t->avg.a == 0) {
+		return node;
+	}
+
+	if (covered && t->avg.a == 1) {
+		if (topLeaf) {
+			return new Node(ul, lr, t->avg);
+		}
+		if (topUL.first + at.first == ul.first && topUL.second + at.second == ul.second &&
+		    nodeWidth(t) == nodeWidth(node) && nodeHeight(t) == nodeHeight(node)) {
+			return retain(t);
+		}
+	}
+
+	if (covered && topLeaf && baseLeaf) {
+		return new Node(ul, lr, blendOver(t->avg, node->avg));
+	}
+
+	// mixed region: split a leaf of this tree so each part can be blended separately
+	Node* work = baseLeaf ? expandLeaf(node, ul) : node;
+	shared = work == node && (shared || node->refs > 1);
+
+	pair<unsigned int, unsigned int> corners[4];
+	childCorners(work, ul, corners);
+	Node* NW = overlayNode(work->NW, corners[0], top, at, shared);
+	Node* NE = overlayNode(work->NE, corners[1], top, at, shared);
+	Node* SW = overlayNode(work->SW, corners[2], top, at, shared);
+	Node* SE = overlayNode(work->SE, corners[3], top, at, shared);
+
+	if (work == node && NW == node->NW && NE == node->NE && SW == node->SW && SE == node->SE) {
+		return node;
+	}
+
+	Node* out = work == node ? unshare(node, shared) : work;
+	replaceChild(out->NW, NW);
+	replaceChild(out->NE, NE);
+	replaceChild(out->SW, SW);
+	replaceChild(out->SE, SE);
+	out->avg = averageOf(out);
+	out->Rehash();
+
+	return out;
+}
+
+Node* QTree::expandLeaf(Node* leaf, pair<unsigned int, unsigned int> ul) {
+	pair<unsigned int, unsigned int> lr(ul.first + nodeWidth(leaf) - 1, ul.second + nodeHeight(leaf) - 1);
+
+	// split the same way BuildNode does
+	unsigned int midX = (ul.first + lr.first) / 2;
+	unsigned int midY = (ul.second + lr.second) / 2;
+
+	Node* nd = new Node(ul, lr, leaf->avg);
+	nd->NW = new Node(ul, make_pair(midX, midY), leaf->avg);
+	if (lr.first == ul.first) {
+		nd->SW = new Node(make_pair(ul.first, midY + 1), make_pair(midX, lr.second), leaf->avg);
+	} else {
+		nd->NE = new Node(make_pair(midX + 1, ul.second), make_pair(lr.first, midY), leaf->avg);
+		if (ul.second != lr.second) {
+			nd->SW = new Node(make_pair(ul.first, midY + 1), make_pair(midX, lr.second), leaf->avg);
+			nd->SE = new Node(make_pair(midX + 1, midY + 1), lr, leaf->avg);
+		}
+	}
+	nd->Rehash();
+
+	return nd;
+}
+
+RGBAPixel QTree::blendOver(const RGBAPixel& top, const RGBAPixel& bottom) {
+	double a = top.a + bottom.a * (1 - top.a);
+	if (a == 0) {
+		return RGBAPixel(0, 0, 0, 0.0);
+	}
+
+	double bottomWeight = bottom.a * (1 - top.a);
+	int r = lround((top.r * top.a + bottom.r * bottomWeight) / a);
+	int g = lround((top.g * top.a + bottom.g * bottomWeight) / a);
+	int b = lround((top.b * top.a + bottom.b * bottomWeight) / a);
+
+	return RGBAPixel(r, g, b, a);
+}
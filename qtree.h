@@ -6,8 +6,14 @@
 #ifndef _QTREE_H_
 #define _QTREE_H_
 
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 #include "imgUtil/PNG.h"
+#include "imgUtil/PixelBatch.h"
 #include "imgUtil/RGBAPixel.h"
 
 using namespace std;
@@ -17,6 +23,8 @@ class Node {
 public:
     Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, RGBAPixel a); // Node constructor
 
+    void Rehash(); // recomputes hash from this node's size, color and children
+
     pair<unsigned int, unsigned int> upLeft;   // image coordinates of upper-left corner of node's rectangular region
     pair<unsigned int, unsigned int> lowRight; // image coordinates of lower-right corner of node's rectangular region
     RGBAPixel avg;  // average color of node's rectangular region
@@ -24,6 +32,25 @@ public:
     Node* NE; // upper-right child
     Node* SW; // lower-left child
     Node* SE; // lower-right child
+
+    atomic<unsigned int> refs; // number of parents (or tree roots) sharing this node
+    uint64_t hash; // position-independent hash of this subtree's sizes and colors
+};
+
+/**
+ * Error introduced by the most recent Prune, measured against the leaves
+ * the tree had just before it. Colors are compared premultiplied by their
+ * alpha, that is, as they appear composited over black.
+ */
+struct PruneStats {
+    unsigned long long pixels;       // pixels in the image
+    unsigned long long prunedPixels; // pixels under the pruned subtrees
+    unsigned int prunedSubtrees;     // number of subtrees pruned
+    double sse;      // sum of squared error over red, green and blue, on a 0-255 scale
+    double maxError; // largest distanceTo between a removed leaf and the color replacing it
+
+    double MSE() const;  // mean squared error per channel per pixel
+    double PSNR() const; // peak signal-to-noise ratio in dB; infinite if nothing changed
 };
 
 /**
@@ -48,6 +75,11 @@ public:
      * Since QTrees allocate dynamic memory (i.e., they use "new", we
      * must define the Big Three).
      *
+     * The copy shares all of its nodes with other. Prune, FlipHorizontal
+     * and RotateCCW copy a node before changing it whenever it is still
+     * reachable from another tree, so neither tree observes the other's
+     * modifications.
+     *
      * @param other The QTree  we are copying.
      */
     QTree(const QTree& other);
@@ -63,7 +95,14 @@ public:
     unsigned int CountLeaves() const;
 
     /**
-     * Constructor that builds a QTree out of the given PNG.
+     * Counts the number of distinct nodes stored for the tree. This is
+     * smaller than CountNodes once Deduplicate has merged repeated regions.
+     */
+    unsigned int CountUniqueNodes() const;
+
+    /**
+     * Constructor that builds a QTree out of the given image, which may
+     * be a PNG or a view of any other buffer of pixels.
      * Every leaf in the tree corresponds to a pixel in the PNG.
      * Every non-leaf node corresponds to a rectangle of pixels
      * in the original PNG, represented by an (x,y) pair for the
@@ -86,8 +125,11 @@ public:
      * In this way, each of the children's rectangles together will have coordinates
      * that when combined, completely cover the original rectangle's image
      * region and do not overlap.
+     *
+     * The one exception: a rectangle whose pixels are all fully transparent
+     * is stored as a single transparent leaf rather than split further.
      */
-    QTree(const PNG& imIn);
+    QTree(const ImageView& imIn);
 
     /**
      * Overloaded assignment operator for QTrees.
@@ -106,22 +148,91 @@ public:
      * 
      * For up-scaled images, no color interpolation will be done;
      * each rectangle is fully rendered into a larger rectangular region.
+     *
+     * Rendering is split into horizontal bands across worker threads;
+     * each band is painted independently, so no locking is needed.
      * 
      * @param scale multiplier for each horizontal/vertical dimension
      * @pre scale > 0
+     * @return the rendered image, or an empty PNG if scale is too large
+     *         for the result to be addressed (see RenderFits).
      */
     PNG Render(unsigned int scale) const;
 
+    /**
+     * Returns true if an image of width by height pixels can be rendered
+     * at scale: each side, and the number of pixels, must fit in an
+     * unsigned int, as the PNG indexes its pixels with one.
+     */
+    static bool RenderFits(unsigned int width, unsigned int height, unsigned int scale);
+
+    /**
+     * Render draws the tree into a caller-provided image instead of a new
+     * PNG, exactly as Render(scale) would.
+     *
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param img destination; must be (width * scale) by (height * scale)
+     * @pre scale > 0
+     */
+    void Render(unsigned int scale, const ImageView& img) const;
+
     /**
      *  Prune function trims subtrees as high as possible in the tree.
      *  A subtree is pruned (cleared) if all of the subtree's leaves are within
      *  tolerance of the average color stored in the root of the subtree.
+     *  Only the nodes on the paths to pruned subtrees are copied if the
+     *  tree shares nodes with a copy.
      *
      * @param tolerance maximum RGBA distance to qualify for pruning
      * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
      */
     void Prune(double tolerance);
 
+    /**
+     *  Returns the error introduced by the most recent Prune, gathered
+     *  while the subtrees were being collapsed, so judging a prune needs
+     *  no Render. Before any Prune every field but pixels is zero.
+     */
+    PruneStats LastPruneStats() const;
+
+    /**
+     *  Prunes the tree with the largest tolerance that keeps the PSNR
+     *  reported by LastPruneStats at or above minPSNR.
+     *
+     *  The smallest tolerance at which Prune would collapse each node,
+     *  and the error of collapsing it, are worked out once; every
+     *  tolerance tried by the search is then evaluated from those figures
+     *  alone, exactly, without copying, pruning or rendering the tree.
+     *  (A maximum-error target needs no search: it is the tolerance.)
+     *
+     * @param minPSNR lowest acceptable PSNR, in dB
+     * @return the tolerance the tree was pruned with
+     * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+     */
+    double PruneToPSNR(double minPSNR);
+
+    /**
+     *  Prunes the tree with the smallest tolerance for which Render(1),
+     *  encoded as a PNG, takes at most maxBytes.
+     *
+     *  Encoded sizes cannot be worked out from the tree, so the search
+     *  predicts them from leaf counts, which are evaluated like in
+     *  PruneToPSNR, scaled by the bytes per leaf of the encodes done so
+     *  far. Each prediction is checked by one encode, and at most
+     *  MAX_SIZE_ENCODES encodes are done in all; if none of them fits,
+     *  the tree is pruned with the largest tolerance that changes it.
+     *
+     * @param maxBytes largest acceptable size of the encoded PNG
+     * @return the tolerance the tree was pruned with
+     * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+     */
+    double PruneToBytes(size_t maxBytes);
+
+    /**
+     * Largest number of PNG encodes PruneToBytes does.
+     */
+    static const unsigned int MAX_SIZE_ENCODES = 5;
+
     /**
      *  FlipHorizontal rearranges the contents of the tree, so that
      *  its rendered image will appear mirrored across a vertical axis.
@@ -133,6 +244,9 @@ public:
      *  null eastern children
      *  (i.e. after flipping, a node's NW and SW pointers may be null, but
      *  have non-null NE and SE)
+     *
+     *  Every node moves, so a tree that shares its nodes with a copy
+     *  ends up with its own copy of every node.
      */
     void FlipHorizontal();
 
@@ -150,10 +264,95 @@ public:
      *  have null eastern or southern children
      *  (i.e. after rotation, a node's NW and NE pointers may be null, but have
      *  non-null SW and SE, or it may have null NW/SW but non-null NE/SE)
+     *
+     *  Every node moves, so a tree that shares its nodes with a copy
+     *  ends up with its own copy of every node.
      */
     void RotateCCW();
 
+    /**
+     *  Chooses how this tree releases its nodes when it is destroyed or
+     *  reassigned. When deferred, the root is handed to the background
+     *  NodeReclaimer instead of being deleted on the calling thread; if
+     *  the reclaimer's queue is full the nodes are freed immediately.
+     *  Copies inherit the setting of the tree they were copied from.
+     *
+     * @param deferred true to release nodes on the reclaimer thread
+     */
+    void SetDeferredClear(bool deferred);
+
+    /**
+     *  Deduplicate merges subtrees that describe identical regions of the
+     *  image (same sizes, same colors, same shape) wherever they occur, so
+     *  that each distinct region is stored only once and the tree becomes a
+     *  DAG. Subtrees are matched by their position-independent hash and
+     *  then compared exactly, so hash collisions never merge different
+     *  regions. Rendering is unaffected.
+     *
+     *  Shared subtrees are copied on write like those shared between
+     *  copies, so the tree can still be pruned, flipped or rotated.
+     */
+    void Deduplicate();
+
+    /**
+     *  Update brings the tree up to date after the pixels inside the
+     *  rectangle [ul, lr] of the source image have changed. Subtrees that
+     *  lie entirely inside the rectangle, and leaves that overlap it, are
+     *  rebuilt from img; the average colors of their ancestors are then
+     *  recomputed. Every other subtree is left untouched, so the cost is
+     *  proportional to the size of the changed region.
+     *
+     *  Rebuilt regions are unpruned; call Prune again if needed.
+     *
+     * @param img the changed image, in the tree's current orientation.
+     * @param ul upper left point of the changed rectangle.
+     * @param lr lower right point of the changed rectangle.
+     * @pre img has the same dimensions as the tree.
+     */
+    void Update(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+
+    /**
+     *  Crop returns a tree for the rectangle [ul, lr] of this tree's
+     *  image, without rendering. Subtrees of this tree that line up exactly
+     *  with a node of the cropped tree are shared rather than copied, and
+     *  regions covered by a single leaf stay a single leaf.
+     *
+     * @param ul upper left point of the rectangle to keep.
+     * @param lr lower right point of the rectangle to keep; clamped to the image.
+     * @pre ul lies inside the image and ul <= lr in both coordinates.
+     */
+    QTree Crop(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+    /**
+     *  Downscale returns a tree for this tree's image shrunk by a factor of
+     *  2^levels in each dimension (rounding up), without rendering. Each
+     *  pixel of the result is the average of the block of pixels it
+     *  replaces, read from the average colors stored in the tree, so whole
+     *  subtrees are collapsed instead of visiting their leaves.
+     *
+     * @param levels number of times to halve each dimension.
+     * @pre 2^levels does not overflow an unsigned int.
+     */
+    QTree Downscale(unsigned int levels) const;
+
+    /**
+     *  Overlay composites the image of top over this tree's image, with
+     *  top's upper left corner placed at (x, y), without rendering either
+     *  tree. Both trees are walked together: wherever top is fully
+     *  transparent this tree is left as is, wherever top is fully opaque
+     *  over a whole node that node is replaced outright, and only the
+     *  remaining regions are subdivided and alpha-blended ("over").
+     *  Parts of top that fall outside this tree's image are ignored.
+     *
+     * @param top the tree to draw on top of this one.
+     * @param x column of this tree's image where top's left edge lands.
+     * @param y row of this tree's image where top's top edge lands.
+     */
+    void Overlay(const QTree& top, unsigned int x, unsigned int y);
+
 private:
+    friend class QTreeSequence;
+
     /*
      * Private member variables.
      */
@@ -162,6 +361,18 @@ private:
     unsigned int height; // height of PNG represented by the tree
     unsigned int width; // width of PNG represented by the tree
 
+    bool deferClear; // whether Clear hands the root to the NodeReclaimer
+
+    PruneStats pruneStats; // error introduced by the most recent Prune
+
+    /**
+     * Constructor that adopts an already built tree.
+     * @param nd root of the tree; the new QTree takes over its reference.
+     * @param w width of the image represented by the tree.
+     * @param h height of the image represented by the tree.
+     */
+    QTree(Node* nd, unsigned int w, unsigned int h);
+
     /**
      * Destroys all dynamically allocated memory associated with the
      * current QTree object.
@@ -182,7 +393,7 @@ private:
      * @param ul upper left point of current node's rectangle.
      * @param lr lower right point of current node's rectangle.
      */
-    Node* BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+    Node* BuildNode(const ImageView& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
 
     /**
      * Private helper function for counting the total number of nodes in the tree. GIVEN
@@ -0,0 +1,175 @@
+/**
+ * @file qtreepng.cpp
+ * @description implementation of the libqtreepng interface over ResultCache
+ */
+
+#include <cstring>
+#include <new>
+
+#include "qtree-cache.h"
+#include "qtreepng.h"
+
+struct qtreepng_context {
+	ResultCache cache;
+
+	qtreepng_context(size_t cacheBytes) : cache(cacheBytes) {}
+};
+
+static CompressParams toParams(const qtreepng_params* params) {
+	qtreepng_params defaults;
+	if (!params) {
+		qtreepng_default_params(&defaults);
+		params = &defaults;
+	}
+	return CompressParams(params->tolerance, params->scale, params->rotations, params->flip != 0);
+}
+
+/**
+ * Compresses img through context's cache into out. Nothing may throw out
+ * of the interface: running out of memory, and any other exception,
+ * from the tree's threads or rethrown by the cache, is turned into a
+ * status.
+ */
+static qtreepng_status compressView(qtreepng_context* context, const ImageView& img, const qtreepng_params* params,
+                                    unsigned char* out, size_t outCapacity, size_t* outSize) {
+	try {
+		shared_ptr<const vector<unsigned char> > encoded = context->cache.Encoded(img, toParams(params));
+		if (!encoded) {
+			return QTREEPNG_ENCODE;
+		}
+
+		*outSize = encoded->size();
+		if (encoded->size() > outCapacity || (!out && !encoded->empty())) {
+			return QTREEPNG_TOO_SMALL;
+		}
+		if (!encoded->empty()) {
+			memcpy(out, encoded->data(), encoded->size());
+		}
+		return QTREEPNG_OK;
+	} catch (const bad_alloc&) {
+		return QTREEPNG_NO_MEMORY;
+	} catch (...) {
+		return QTREEPNG_FAILED;
+	}
+}
+
+/**
+ * Returns QTREEPNG_VERSION as the library was built.
+ */
+int qtreepng_version(void) {
+	return QTREEPNG_VERSION;
+}
+
+/**
+ * Returns a short description of status.
+ */
+const char* qtreepng_status_text(qtreepng_status status) {
+	switch (status) {
+		case QTREEPNG_OK: return "success";
+		case QTREEPNG_INVALID: return "invalid argument";
+		case QTREEPNG_DECODE: return "input is not a readable PNG";
+		case QTREEPNG_ENCODE: return "result could not be encoded";
+		case QTREEPNG_TOO_SMALL: return "output buffer too small";
+		case QTREEPNG_NO_MEMORY: return "out of memory";
+		case QTREEPNG_FAILED: return "compression failed";
+	}
+	return "unknown status";
+}
+
+/**
+ * Fills params with the defaults: no pruning, scale 1, no turning.
+ */
+void qtreepng_default_params(qtreepng_params* params) {
+	if (params) {
+		CompressParams defaults;
+		params->tolerance = defaults.tolerance;
+		params->scale = defaults.scale;
+		params->rotations = defaults.rotations;
+		params->flip = defaults.flip ? 1 : 0;
+	}
+}
+
+/**
+ * Creates a context.
+ * @param cache_bytes budget of the context's result cache.
+ * @return the context, or NULL if out of memory.
+ */
+qtreepng_context* qtreepng_create(size_t cache_bytes) {
+	try {
+		return new qtreepng_context(cache_bytes);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+/**
+ * Frees a context. NULL is ignored.
+ */
+void qtreepng_destroy(qtreepng_context* context) {
+	delete context;
+}
+
+/**
+ * Compresses an encoded PNG into an encoded PNG.
+ * @param in the encoded input.
+ * @param in_size number of bytes at in.
+ * @param params what to do to the image; NULL for the defaults.
+ * @param out buffer the result is written to; may be NULL if out_capacity is 0.
+ * @param out_capacity number of bytes available at out.
+ * @param out_size receives the size of the result, also when it did not
+ *        fit, so that the caller can retry with a big enough buffer; the
+ *        retry is answered from the cache.
+ */
+qtreepng_status qtreepng_compress(qtreepng_context* context, const unsigned char* in, size_t in_size,
+                                  const qtreepng_params* params, unsigned char* out,
+                                  size_t out_capacity, size_t* out_size) {
+	if (!context || !in || in_size == 0 || !out_size || (params && params->scale == 0)) {
+		return QTREEPNG_INVALID;
+	}
+	*out_size = 0;
+
+	try {
+		PNG img;
+		if (!img.readFromBuffer(in, in_size)) {
+			return QTREEPNG_DECODE;
+		}
+		if (params && !QTree::RenderFits(img.width(), img.height(), params->scale)) {
+			return QTREEPNG_INVALID;
+		}
+		return compressView(context, img, params, out, out_capacity, out_size);
+	} catch (const bad_alloc&) {
+		return QTREEPNG_NO_MEMORY;
+	} catch (...) {
+		return QTREEPNG_FAILED;
+	}
+}
+
+/**
+ * Compresses raw pixels, 4 bytes each in RGBA order, into an encoded PNG.
+ * @param pixels the first row of the image.
+ * @param width width of the image.
+ * @param height height of the image.
+ * @param stride bytes from the start of one row to the start of the next,
+ *        at least 4 * width.
+ * The other parameters are as for qtreepng_compress.
+ */
+qtreepng_status qtreepng_compress_rgba(qtreepng_context* context, const unsigned char* pixels,
+                                       unsigned int width, unsigned int height, size_t stride,
+                                       const qtreepng_params* params, unsigned char* out,
+                                       size_t out_capacity, size_t* out_size) {
+	if (!context || !pixels || width == 0 || height == 0 || stride < (size_t) width * 4 || !out_size
+	    || (params && !QTree::RenderFits(width, height, params->scale))) {
+		return QTREEPNG_INVALID;
+	}
+	*out_size = 0;
+
+	try {
+		// the view is only read from
+		ImageView img(const_cast<unsigned char*>(pixels), width, height, stride);
+		return compressView(context, img, params, out, out_capacity, out_size);
+	} catch (const bad_alloc&) {
+		return QTREEPNG_NO_MEMORY;
+	} catch (...) {
+		return QTREEPNG_FAILED;
+	}
+}
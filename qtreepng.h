@@ -0,0 +1,173 @@
+/**
+ * @file qtreepng.h
+ * @description the public interface of libqtreepng: compresses PNG images
+ *              from memory to memory, callable from C and C++
+ *
+ * Only the functions declared here are exported from libqtreepng.so, and
+ * only plain C types cross the interface, so programs built against one
+ * version keep working with the next. QTREEPNG_VERSION is raised when the
+ * interface changes.
+ */
+
+#ifndef _QTREEPNG_H_
+#define _QTREEPNG_H_
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define QTREEPNG_API __attribute__((visibility("default")))
+#else
+#define QTREEPNG_API
+#endif
+
+#define QTREEPNG_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * What to do with an image: the fields of CompressParams.
+ */
+typedef struct qtreepng_params {
+    double tolerance;       /* Prune tolerance; negative to skip pruning */
+    unsigned int scale;     /* Render scale, at least 1 */
+    unsigned int rotations; /* quarter turns counter-clockwise after pruning */
+    int flip;               /* nonzero to mirror left to right after turning */
+} qtreepng_params;
+
+typedef enum qtreepng_status {
+    QTREEPNG_OK = 0,
+    QTREEPNG_INVALID,   /* a NULL pointer, zero size, a bad stride, or a scale of 0 or too large for the image */
+    QTREEPNG_DECODE,    /* the input is not a PNG lodepng can read */
+    QTREEPNG_ENCODE,    /* the result could not be encoded */
+    QTREEPNG_TOO_SMALL, /* the output buffer is too small; *out_size says how big it must be */
+    QTREEPNG_NO_MEMORY,
+    QTREEPNG_FAILED     /* anything else went wrong, such as no thread to be had; since version 2 */
+} qtreepng_status;
+
+/**
+ * A compressor: a cache of recent results, so that the same image
+ * compressed again, or with another tolerance, is cheaper. One context
+ * may be used from many threads at once.
+ */
+typedef struct qtreepng_context qtreepng_context;
+
+/**
+ * Returns QTREEPNG_VERSION as the library was built.
+ */
+QTREEPNG_API int qtreepng_version(void);
+
+/**
+ * Returns a short description of status.
+ */
+QTREEPNG_API const char* qtreepng_status_text(qtreepng_status status);
+
+/**
+ * Fills params with the defaults: no pruning, scale 1, no turning.
+ */
+QTREEPNG_API void qtreepng_default_params(qtreepng_params* params);
+
+/**
+ * Creates a context.
+ * @param cache_bytes budget of the context's result cache.
+ * @return the context, or NULL if out of memory.
+ */
+QTREEPNG_API qtreepng_context* qtreepng_create(size_t cache_bytes);
+
+/**
+ * Frees a context. NULL is ignored.
+ */
+QTREEPNG_API void qtreepng_destroy(qtreepng_context* context);
+
+/**
+ * Compresses an encoded PNG into an encoded PNG.
+ * @param in the encoded input.
+ * @param in_size number of bytes at in.
+ * @param params what to do to the image; NULL for the defaults.
+ * @param out buffer the result is written to; may be NULL if out_capacity is 0.
+ * @param out_capacity number of bytes available at out.
+ * @param out_size receives the size of the result, also when it did not
+ *        fit, so that the caller can retry with a big enough buffer; the
+ *        retry is answered from the cache.
+ */
+QTREEPNG_API qtreepng_status qtreepng_compress(qtreepng_context* context, const unsigned char* in, size_t in_size,
+                                               const qtreepng_params* params, unsigned char* out,
+                                               size_t out_capacity, size_t* out_size);
+
+/**
+ * Compresses raw pixels, 4 bytes each in RGBA order, into an encoded PNG.
+ * @param pixels the first row of the image.
+ * @param width width of the image.
+ * @param height height of the image.
+ * @param stride bytes from the start of one row to the start of the next,
+ *        at least 4 * width.
+ * The other parameters are as for qtreepng_compress.
+ */
+QTREEPNG_API qtreepng_status qtreepng_compress_rgba(qtreepng_context* context, const unsigned char* pixels,
+                                                    unsigned int width, unsigned int height, size_t stride,
+                                                    const qtreepng_params* params, unsigned char* out,
+                                                    size_t out_capacity, size_t* out_size);
+
+#ifdef __cplusplus
+}
+
+#include <vector>
+
+namespace qtreepng {
+    /**
+     * Compressor: owns a qtreepng_context, and compresses into vectors
+     * that grow as needed.
+     */
+    class Compressor {
+    public:
+        explicit Compressor(size_t cacheBytes = 64 << 20) : context(qtreepng_create(cacheBytes)) {}
+        ~Compressor() { qtreepng_destroy(context); }
+
+        /**
+         * Compresses an encoded PNG into out, replacing its contents.
+         */
+        qtreepng_status Compress(const unsigned char* in, size_t inSize, const qtreepng_params& params,
+                                 std::vector<unsigned char>& out) {
+            return Fit(out, [&](unsigned char* data, size_t capacity, size_t* size) {
+                return qtreepng_compress(context, in, inSize, &params, data, capacity, size);
+            });
+        }
+
+        /**
+         * Compresses raw RGBA pixels into out, replacing its contents.
+         */
+        qtreepng_status CompressRGBA(const unsigned char* pixels, unsigned int width, unsigned int height,
+                                     size_t stride, const qtreepng_params& params, std::vector<unsigned char>& out) {
+            return Fit(out, [&](unsigned char* data, size_t capacity, size_t* size) {
+                return qtreepng_compress_rgba(context, pixels, width, height, stride, &params, data, capacity, size);
+            });
+        }
+
+    private:
+        qtreepng_context* context;
+
+        Compressor(const Compressor&) = delete;
+        Compressor& operator=(const Compressor&) = delete;
+
+        // writes into out's spare capacity, and once more if it was too small
+        template <typename Call>
+        qtreepng_status Fit(std::vector<unsigned char>& out, Call call) {
+            if (!context) {
+                return QTREEPNG_NO_MEMORY;
+            }
+            out.resize(out.capacity());
+            size_t size = 0;
+            qtreepng_status status = call(out.data(), out.size(), &size);
+            if (status == QTREEPNG_TOO_SMALL) {
+                out.resize(size);
+                status = call(out.data(), out.size(), &size);
+            }
+            out.resize(status == QTREEPNG_OK ? size : 0);
+            return status;
+        }
+    };
+}
+#endif
+
+#endif